@@ -0,0 +1,622 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * tftpload: a loopback load generator for WvTFTPServer.
+ *
+ * A real WvTFTPServer runs in a child process; the parent drives N
+ * simulated clients against it over loopback, optionally dropping,
+ * delaying and reordering packets on the client side, and reports
+ * aggregate goodput, transfer time percentiles, server retransmits and the
+ * server's CPU time.  Each transfer can also be cut off part way and
+ * retried, from the start or (with "blkoffset") from where it stopped, to
+ * see what a retry costs.  See "tftpload -h".
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "uniconfroot.h"
+#include "wvistreamlist.h"
+#include "wvfileutils.h"
+#include "../wvtftpserver.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Options
+{
+    int clients;            // -n
+    int transfers;          // -t, per client
+    int blksize;            // -b
+    int window;             // -w, server "Prefetch"
+    int port;               // -p
+    double loss;            // -l, probability, each direction
+    int delay;              // -d, ms added to each client packet sent
+    double reorder;         // -r, probability of holding back a DATA
+    int client_timeout;     // -T, ms
+    double interrupt;       // -i, fraction of each file before a retry
+    bool resume;            // -R, retry with "blkoffset"
+    off_t sizes[16];        // -s, comma separated
+    int nsizes;
+};
+
+static Options opt;
+
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+
+static bool chance(double p)
+{
+    return p > 0 && drand48() < p;
+}
+
+
+/* The server side: runs in the child until the parent closes 'ctlfd', then
+ * writes its counters and CPU time to 'resfd'.
+ */
+static void run_server(WvStringParm base_dir, int ctlfd, int resfd)
+{
+    UniConfRoot cfg("temp:");
+    cfg["TFTP/Port"].setmeint(opt.port);
+    cfg["TFTP/Base dir"].setme(base_dir);
+    cfg["TFTP/Prefetch"].setmeint(opt.window);
+
+    WvTFTPServer *server = new WvTFTPServer(cfg, 100);
+    server->set_loglevel(WvLog::Info);
+    WvIStreamList::globallist.append(server, false, "TFTP server");
+
+    if (write(resfd, "R", 1) != 1)
+        _exit(1);
+
+    struct pollfd pfd;
+    pfd.fd = ctlfd;
+    pfd.events = POLLIN;
+    for (;;)
+    {
+        WvIStreamList::globallist.runonce(20);
+        if (poll(&pfd, 1, 0) > 0)
+            break;
+    }
+
+    TFTPStats total(false);
+    TFTPStats::collect(total);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "%llu %llu %llu %.3f\n",
+                       (unsigned long long)total.retransmits,
+                       (unsigned long long)total.timeouts,
+                       (unsigned long long)total.bytes_sent, cpu);
+    if (write(resfd, buf, len) != len)
+        _exit(1);
+
+    WvIStreamList::globallist.unlink(server);
+    WVRELEASE(server);
+    _exit(0);
+}
+
+
+/* One simulated client: a plain UDP socket and a tiny TFTP state machine. */
+struct Client
+{
+    enum State { IDLE, REQUESTED, RUNNING, DONE };
+
+    int fd;
+    int id;
+    State state;
+    int transfers_left;
+    WvString filename;
+    unsigned int expect;        // next block wanted (full number)
+    long long bytes;
+    off_t size;
+    bool interrupted;           // already cut off and retried once
+    double start, last_progress;
+    unsigned char last_sent[512];
+    size_t last_sent_len;
+    int retries;
+
+    // Outgoing packets waiting for their artificial delay.
+    struct Delayed
+    {
+        double due;
+        unsigned char buf[512];
+        size_t len;
+    } delayed[64];
+    int ndelayed;
+
+    // A DATA packet held back to be delivered out of order.
+    unsigned char held[65536];
+    ssize_t heldlen;
+};
+
+static double *times;
+static int ntimes, nfailed, ninterrupted;
+static long long total_bytes;
+static int client_retries;
+
+
+static void raw_send(Client &c, const unsigned char *buf, size_t len)
+{
+    if (chance(opt.loss))
+        return;
+    if (send(c.fd, buf, len, 0) < 0)
+        perror("send");
+}
+
+
+static void client_send(Client &c, const unsigned char *buf, size_t len)
+{
+    memcpy(c.last_sent, buf, len);
+    c.last_sent_len = len;
+
+    if (opt.delay <= 0 || c.ndelayed == 64)
+    {
+        raw_send(c, buf, len);
+        return;
+    }
+
+    Client::Delayed &d = c.delayed[c.ndelayed++];
+    d.due = now_ms() + opt.delay;
+    memcpy(d.buf, buf, len);
+    d.len = len;
+}
+
+
+static void flush_delayed(Client &c, double now)
+{
+    int i = 0;
+    while (i < c.ndelayed)
+    {
+        if (c.delayed[i].due <= now)
+        {
+            raw_send(c, c.delayed[i].buf, c.delayed[i].len);
+            c.delayed[i] = c.delayed[--c.ndelayed];
+        }
+        else
+            i++;
+    }
+}
+
+
+static void send_ack(Client &c, unsigned int block)
+{
+    unsigned char ack[4] = { 0, 4, (unsigned char)((block >> 8) & 0xff),
+                             (unsigned char)(block & 0xff) };
+    client_send(c, ack, 4);
+}
+
+
+// Asks for c.filename, from block c.expect on.
+static void send_request(Client &c)
+{
+    unsigned char rrq[512];
+    size_t len = 0;
+    rrq[len++] = 0;
+    rrq[len++] = 1;
+    len += sprintf((char *)rrq + len, "%s", c.filename.cstr()) + 1;
+    len += sprintf((char *)rrq + len, "octet") + 1;
+    if (opt.blksize != 512)
+    {
+        len += sprintf((char *)rrq + len, "blksize") + 1;
+        len += sprintf((char *)rrq + len, "%d", opt.blksize) + 1;
+    }
+    if (c.expect > 1)
+    {
+        len += sprintf((char *)rrq + len, "blkoffset") + 1;
+        len += sprintf((char *)rrq + len, "%u", c.expect - 1) + 1;
+    }
+
+    c.state = Client::REQUESTED;
+    c.retries = 0;
+    c.last_progress = now_ms();
+    c.heldlen = 0;
+    client_send(c, rrq, len);
+}
+
+
+static void start_transfer(Client &c)
+{
+    int n = (c.id + c.transfers_left) % opt.nsizes;
+    c.filename = WvString("file%s", n);
+    c.size = opt.sizes[n];
+    c.expect = 1;
+    c.bytes = 0;
+    c.interrupted = false;
+    c.start = now_ms();
+    send_request(c);
+}
+
+
+// As if the client had been rebooted part way through: it just asks
+// again, which makes the server drop the old transfer.
+static void interrupt_transfer(Client &c)
+{
+    c.interrupted = true;
+    ninterrupted++;
+    if (!opt.resume)
+    {
+        c.expect = 1;
+        c.bytes = 0;
+    }
+    send_request(c);
+}
+
+
+static void finish_transfer(Client &c, bool ok)
+{
+    if (ok)
+    {
+        times[ntimes++] = now_ms() - c.start;
+        total_bytes += c.bytes;
+    }
+    else
+        nfailed++;
+
+    if (--c.transfers_left > 0)
+        start_transfer(c);
+    else
+        c.state = Client::DONE;
+}
+
+
+static void handle_packet(Client &c, const unsigned char *buf, ssize_t len)
+{
+    if (len < 4)
+        return;
+    int opcode = buf[0] * 256 + buf[1];
+
+    if (opcode == 6 && c.state == Client::REQUESTED)     // OACK
+    {
+        // A server that doesn't know "blkoffset" starts from the top.
+        if (c.expect > 1 && !memmem(buf + 2, len - 2, "blkoffset", 10))
+        {
+            c.expect = 1;
+            c.bytes = 0;
+        }
+        c.state = Client::RUNNING;
+        c.last_progress = now_ms();
+        send_ack(c, (c.expect - 1) & 0xffff);
+        return;
+    }
+    if (opcode == 5)                                    // ERROR
+    {
+        fprintf(stderr, "client %d: error %d: %.*s\n", c.id, buf[3],
+                (int)len - 4, buf + 4);
+        finish_transfer(c, false);
+        return;
+    }
+    if (opcode != 3)
+        return;
+
+    // Until the OACK of a resumed request, DATA is left over from before.
+    if (c.state == Client::REQUESTED && c.expect > 1)
+        return;
+
+    unsigned int block = buf[2] * 256 + buf[3];
+    if (block != (c.expect & 0xffff))
+        return;                 // out of order: wait for a retransmit
+
+    c.state = Client::RUNNING;
+    c.bytes += len - 4;
+    c.retries = 0;
+    c.last_progress = now_ms();
+    send_ack(c, block);
+    c.expect++;
+
+    if (len - 4 < opt.blksize)
+        finish_transfer(c, true);
+    else if (opt.interrupt > 0 && !c.interrupted
+             && c.bytes >= opt.interrupt * c.size)
+        interrupt_transfer(c);
+}
+
+
+static void client_readable(Client &c)
+{
+    unsigned char buf[65536];
+    ssize_t len;
+
+    while ((len = recv(c.fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    {
+        if (chance(opt.loss))
+            continue;
+
+        // Reordering: hold this packet back and deliver it after the next.
+        if (!c.heldlen && chance(opt.reorder))
+        {
+            memcpy(c.held, buf, len);
+            c.heldlen = len;
+            continue;
+        }
+
+        handle_packet(c, buf, len);
+        if (c.heldlen)
+        {
+            ssize_t hl = c.heldlen;
+            c.heldlen = 0;
+            handle_packet(c, c.held, hl);
+        }
+    }
+}
+
+
+static void client_tick(Client &c, double now)
+{
+    flush_delayed(c, now);
+    if (c.state != Client::REQUESTED && c.state != Client::RUNNING)
+        return;
+    if (now - c.last_progress < opt.client_timeout)
+        return;
+
+    // Any held packet is as good as lost now.
+    c.heldlen = 0;
+    if (++c.retries > 30)
+    {
+        fprintf(stderr, "client %d: giving up on %s\n", c.id,
+                c.filename.cstr());
+        finish_transfer(c, false);
+        return;
+    }
+    client_retries++;
+    c.last_progress = now;
+    raw_send(c, c.last_sent, c.last_sent_len);
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static double percentile(double p)
+{
+    if (!ntimes)
+        return 0;
+    int i = (int)(p * (ntimes - 1) + 0.5);
+    return times[i];
+}
+
+
+static void create_file(WvStringParm name, off_t size)
+{
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(name);
+        exit(1);
+    }
+    unsigned char buf[65536];
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = i;
+    while (size > 0)
+    {
+        size_t n = size < (off_t)sizeof(buf) ? size : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t)n)
+        {
+            perror(name);
+            exit(1);
+        }
+        size -= n;
+    }
+    close(fd);
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n clients      simulated clients (default 10)\n"
+            "  -t transfers    transfers per client (default 1)\n"
+            "  -s size[,size]  file sizes in bytes (default 1048576)\n"
+            "  -b blksize      blksize option to request (default 512)\n"
+            "  -w window       server Prefetch setting (default 3)\n"
+            "  -l loss         packet loss probability, each way (default 0)\n"
+            "  -d ms           delay added to every client packet\n"
+            "  -r reorder      probability of reordering a DATA packet\n"
+            "  -T ms           client retransmit timeout (default 1000)\n"
+            "  -i fraction     cut each transfer off this far in, and retry\n"
+            "  -R              retry from where it stopped (\"blkoffset\")\n"
+            "  -p port         server port (default 6971)\n", argv0);
+    exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+    opt.clients = 10;
+    opt.transfers = 1;
+    opt.blksize = 512;
+    opt.window = 3;
+    opt.port = 6971;
+    opt.loss = 0;
+    opt.delay = 0;
+    opt.reorder = 0;
+    opt.client_timeout = 1000;
+    opt.interrupt = 0;
+    opt.resume = false;
+    opt.sizes[0] = 1048576;
+    opt.nsizes = 1;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "n:t:s:b:w:l:d:r:T:i:Rp:h")) != -1)
+    {
+        switch (ch)
+        {
+        case 'n': opt.clients = atoi(optarg); break;
+        case 't': opt.transfers = atoi(optarg); break;
+        case 'b': opt.blksize = atoi(optarg); break;
+        case 'w': opt.window = atoi(optarg); break;
+        case 'l': opt.loss = atof(optarg); break;
+        case 'd': opt.delay = atoi(optarg); break;
+        case 'r': opt.reorder = atof(optarg); break;
+        case 'T': opt.client_timeout = atoi(optarg); break;
+        case 'i': opt.interrupt = atof(optarg); break;
+        case 'R': opt.resume = true; break;
+        case 'p': opt.port = atoi(optarg); break;
+        case 's':
+        {
+            opt.nsizes = 0;
+            for (char *p = strtok(optarg, ","); p && opt.nsizes < 16;
+                 p = strtok(NULL, ","))
+                opt.sizes[opt.nsizes++] = atoll(p);
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opt.clients < 1 || opt.transfers < 1 || !opt.nsizes
+        || opt.blksize < 8 || opt.blksize > 65464)
+        usage(argv[0]);
+
+    srand48(getpid());
+
+    WvString base_dir("/tmp/tftpload-%s", getpid());
+    mkdir(base_dir, 0755);
+    for (int i = 0; i < opt.nsizes; i++)
+        create_file(WvString("%s/file%s", base_dir, i), opt.sizes[i]);
+
+    int ctl[2], res[2];
+    if (pipe(ctl) || pipe(res))
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(ctl[1]);
+        close(res[0]);
+        run_server(base_dir, ctl[0], res[1]);
+    }
+    close(ctl[0]);
+    close(res[1]);
+
+    char ready;
+    if (read(res[0], &ready, 1) != 1)
+    {
+        fprintf(stderr, "server failed to start\n");
+        return 1;
+    }
+
+    Client *clients = new Client[opt.clients];
+    struct pollfd *pfds = new struct pollfd[opt.clients];
+    times = new double[opt.clients * opt.transfers];
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opt.port);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    double start = now_ms();
+    for (int i = 0; i < opt.clients; i++)
+    {
+        Client &c = clients[i];
+        c.fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (c.fd < 0 || connect(c.fd, (struct sockaddr *)&server_addr,
+                                sizeof(server_addr)) < 0)
+        {
+            perror("client socket");
+            return 1;
+        }
+        c.id = i;
+        c.ndelayed = 0;
+        c.transfers_left = opt.transfers;
+        pfds[i].fd = c.fd;
+        pfds[i].events = POLLIN;
+        start_transfer(c);
+    }
+
+    for (;;)
+    {
+        int active = 0;
+        for (int i = 0; i < opt.clients; i++)
+            if (clients[i].state != Client::DONE)
+                active++;
+        if (!active)
+            break;
+
+        poll(pfds, opt.clients, opt.delay > 0 ? 1 : 10);
+        double now = now_ms();
+        for (int i = 0; i < opt.clients; i++)
+        {
+            if (pfds[i].revents & POLLIN)
+                client_readable(clients[i]);
+            client_tick(clients[i], now);
+        }
+    }
+    double elapsed = now_ms() - start;
+
+    // Stop the server and collect its side of the story.
+    close(ctl[1]);
+    char buf[256];
+    ssize_t len = read(res[0], buf, sizeof(buf) - 1);
+    buf[len > 0 ? len : 0] = 0;
+    unsigned long long retransmits = 0, timeouts = 0, bytes_sent = 0;
+    double cpu = 0;
+    sscanf(buf, "%llu %llu %llu %lf", &retransmits, &timeouts, &bytes_sent,
+           &cpu);
+    waitpid(pid, NULL, 0);
+    rm_rf(base_dir);
+
+    qsort(times, ntimes, sizeof(double), cmp_double);
+
+    // One "key=value" per line, so results are easy to diff and graph.
+    printf("clients=%d\n", opt.clients);
+    printf("transfers=%d\n", ntimes);
+    printf("failed=%d\n", nfailed);
+    printf("blksize=%d\n", opt.blksize);
+    printf("window=%d\n", opt.window);
+    printf("loss=%g\ndelay_ms=%d\nreorder=%g\n", opt.loss, opt.delay,
+           opt.reorder);
+    printf("interrupted=%d\n", ninterrupted);
+    printf("resume=%d\n", (int)opt.resume);
+    printf("elapsed_ms=%.1f\n", elapsed);
+    printf("bytes=%lld\n", total_bytes);
+    printf("goodput_mbit=%.2f\n", total_bytes * 8 / (elapsed * 1000));
+    printf("p50_ms=%.1f\n", percentile(0.50));
+    printf("p99_ms=%.1f\n", percentile(0.99));
+    printf("max_ms=%.1f\n", ntimes ? times[ntimes - 1] : 0);
+    printf("server_retransmits=%llu\n", retransmits);
+    printf("server_timeouts=%llu\n", timeouts);
+    printf("server_bytes_sent=%llu\n", bytes_sent);
+    printf("server_cpu_s=%.3f\n", cpu);
+    printf("client_retries=%d\n", client_retries);
+
+    return nfailed ? 2 : 0;
+}
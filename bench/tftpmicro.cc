@@ -0,0 +1,305 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * tftpmicro: microbenchmarks for the request path, from an RRQ arriving
+ * to the first DATA or OACK leaving.  Each case is timed in a loop that
+ * doubles until it runs for at least -t ms, and the results are printed as
+ * JSON.  Packets are never actually sent.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "uniconfroot.h"
+#include "wvfileutils.h"
+#include "../wvtftpserver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int window = 64;             // -w
+static int naliases = 10000;        // -a
+static int min_ms = 200;            // -t
+
+
+class MicroServer : public WvTFTPServer
+{
+public:
+    MicroServer(UniConf &cfg, WvStringParm _base_dir)
+        : WvTFTPServer(cfg, 100), base_dir(_base_dir), sent(0)
+        { set_loglevel(WvLog::Info); }
+
+    void rrq(long iters);
+    void rrq_malformed(long iters);
+    void parse(long iters);
+    void options(long iters);
+    void aliases_hit(long iters);
+    void aliases_miss(long iters);
+    void filename(long iters);
+    void access(long iters);
+    void pkttime(long iters);
+
+protected:
+    virtual void send_pkt(const WvIPPortAddr &, TFTPPacket *)
+        { sent++; }
+
+private:
+    WvString base_dir;
+    unsigned long sent;
+
+    void set_packet(const char *pkt, size_t len)
+    {
+        memcpy(packet, pkt, len);
+        packetsize = len;
+    }
+};
+
+// Option names are deliberately mixed case, as some PXE ROMs send them.
+static const char rrq_pkt[] =
+    "\0\1pxelinux.0\0octet\0BLKSIZE\0" "1432\0tsize\0" "0";
+
+
+void MicroServer::rrq(long iters)
+{
+    remaddr = WvIPPortAddr("10.1.0.1", 2070);
+    for (long i = 0; i < iters; i++)
+    {
+        set_packet(rrq_pkt, sizeof(rrq_pkt));
+        new_connection();
+        conns.zap();
+    }
+}
+
+
+void MicroServer::rrq_malformed(long iters)
+{
+    static const char junk[] = "\0\1pxelinux.0-with-no-terminator";
+    remaddr = WvIPPortAddr("10.1.0.1", 2070);
+    for (long i = 0; i < iters; i++)
+    {
+        set_packet(junk, sizeof(junk) - 1);
+        new_connection();
+    }
+}
+
+
+void MicroServer::parse(long iters)
+{
+    TFTPRequest req;
+    for (long i = 0; i < iters; i++)
+        tftp_parse_request(rrq_pkt, sizeof(rrq_pkt), req);
+}
+
+
+void MicroServer::options(long iters)
+{
+    WvString name("%s/pxelinux.0", base_dir);
+    TFTPRequest req;
+    tftp_parse_request(rrq_pkt, sizeof(rrq_pkt), req);
+    for (long i = 0; i < iters; i++)
+    {
+        TFTPConn c;
+        c.remote = WvIPPortAddr("10.1.0.1", 2070);
+        c.filename = name;
+        c.direction = tftpread;
+        c.blksize = 512;
+        c.tsize = 0;
+        c.send_oack = false;
+        process_options(&c, req);
+    }
+}
+
+
+void MicroServer::aliases_hit(long iters)
+{
+    TFTPConn c;
+    c.remote = WvIPPortAddr("10.1.0.1", 2070);
+    for (long i = 0; i < iters; i++)
+    {
+        c.filename = WvString("alias%s", i % naliases);
+        check_aliases(&c);
+    }
+}
+
+
+void MicroServer::aliases_miss(long iters)
+{
+    TFTPConn c;
+    c.remote = WvIPPortAddr("10.1.0.1", 2070);
+    c.filename = "no-such-alias";
+    for (long i = 0; i < iters; i++)
+        check_aliases(&c);
+}
+
+
+void MicroServer::filename(long iters)
+{
+    TFTPConn c;
+    c.remote = WvIPPortAddr("10.1.0.1", 2070);
+    c.direction = tftpread;
+    for (long i = 0; i < iters; i++)
+    {
+        c.filename = WvString("alias%s", i % naliases);
+        check_filename(&c);
+    }
+}
+
+
+void MicroServer::access(long iters)
+{
+    TFTPConn c;
+    c.filename = WvString("%s/pxelinux.0", base_dir);
+    c.direction = tftpread;
+    for (long i = 0; i < iters; i++)
+        validate_access(&c);
+}
+
+
+void MicroServer::pkttime(long iters)
+{
+    PktTime pt(window);
+    struct timeval tv = { 1, 0 };
+    for (long i = 0; i < iters; i++)
+    {
+        tv.tv_usec = i % 1000000;
+        pt.set(i, tv);
+        pt.get(i - window / 2);
+    }
+}
+
+
+struct Benchmark
+{
+    const char *name;
+    void (MicroServer::*fn)(long iters);
+};
+
+static const Benchmark benchmarks[] = {
+    { "new_connection_rrq", &MicroServer::rrq },
+    { "new_connection_malformed", &MicroServer::rrq_malformed },
+    { "parse_request", &MicroServer::parse },
+    { "process_options", &MicroServer::options },
+    { "check_aliases_hit", &MicroServer::aliases_hit },
+    { "check_aliases_miss", &MicroServer::aliases_miss },
+    { "check_filename", &MicroServer::filename },
+    { "validate_access", &MicroServer::access },
+    { "pkttime_set_get", &MicroServer::pkttime },
+};
+
+
+static double elapsed_ns(const struct timespec &a, const struct timespec &b)
+{
+    return (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-w window] [-a aliases] [-t ms] [name...]\n"
+            "  -w window   PktTime window size (default 64)\n"
+            "  -a aliases  entries in the alias table (default 10000)\n"
+            "  -t ms       minimum run time per benchmark (default 200)\n"
+            "Only the named benchmarks are run, if any are given.\n", argv0);
+    exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "w:a:t:h")) != -1)
+    {
+        switch (ch)
+        {
+        case 'w': window = atoi(optarg); break;
+        case 'a': naliases = atoi(optarg); break;
+        case 't': min_ms = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (window < 2 || naliases < 1 || min_ms < 1)
+        usage(argv[0]);
+
+    WvString base_dir("/tmp/tftpmicro-%s", getpid());
+    mkdir(base_dir, 0755);
+    WvString file("%s/pxelinux.0", base_dir);
+    FILE *f = fopen(file, "wb");
+    if (!f)
+    {
+        perror(file);
+        return 1;
+    }
+    for (int i = 0; i < 32768; i++)
+        putc(i & 0xff, f);
+    fclose(f);
+
+    UniConfRoot cfg("temp:");
+    cfg["TFTP/Port"].setmeint(0);
+    cfg["TFTP/Base dir"].setme(base_dir);
+    cfg["TFTP/Prefetch"].setmeint(window);
+    for (int i = 0; i < naliases; i++)
+    {
+        cfg["TFTP/Aliases/default"][WvString("alias%s", i)].setme(
+            "pxelinux.0");
+        // Per-client entries too, as sites with many machines have them.
+        cfg["TFTP/Aliases"][WvString("10.0.%s.%s", i / 250, i % 250 + 1)]
+            ["pxelinux.cfg/default"].setme("pxelinux.0");
+    }
+
+    MicroServer server(cfg, base_dir);
+
+    printf("{\n  \"window\": %d,\n  \"aliases\": %d,\n  \"benchmarks\": [",
+           window, naliases);
+    bool first = true;
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(*benchmarks); b++)
+    {
+        if (optind < argc)
+        {
+            int i;
+            for (i = optind; i < argc; i++)
+                if (!strcmp(argv[i], benchmarks[b].name))
+                    break;
+            if (i == argc)
+                continue;
+        }
+
+        long iters = 1;
+        double ns;
+        for (;;)
+        {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            (server.*benchmarks[b].fn)(iters);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns = elapsed_ns(t0, t1);
+            if (ns >= min_ms * 1e6 || iters >= (1L << 30))
+                break;
+            iters *= 2;
+        }
+
+        printf("%s\n    { \"name\": \"%s\", \"iterations\": %ld, "
+               "\"ns_per_op\": %.1f }", first ? "" : ",",
+               benchmarks[b].name, iters, ns / iters);
+        first = false;
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+
+    rm_rf(base_dir);
+    return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * tftpreplay: feeds the client side of pcap captures (as written by
+ * wvtftpd's "Capture Dir" option, or tcpdump on a raw IP interface) to an
+ * in-process WvTFTPServer and reports what the server did.
+ *
+ * By default the replay runs on a virtual clock, as fast as possible, with
+ * the server's timeout checks run at every tick the recording spanned; -r
+ * replays in real time instead, preserving the recorded gaps.  Either way
+ * the server's replies never leave the process: they are counted, hashed
+ * (so two runs can be compared with a single number) and optionally
+ * written to another capture with -o.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "uniconfroot.h"
+#include "../wvtftpserver.h"
+#include "../wvtftppcap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static bool realtime = false;       // -r
+static int tick_ms = 100;           // -k
+static int drain = 10000;           // -D, ms
+
+
+static unsigned long long usec(const struct timeval &tv)
+{
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+
+static double mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+class ReplayServer : public WvTFTPServer
+{
+public:
+    struct timeval vclock;
+    TFTPPcapWriter *out;
+    unsigned long pkts_out, errors_out;
+    unsigned long long bytes_out;
+    uint32_t hash;
+
+    ReplayServer(UniConf &cfg)
+        : WvTFTPServer(cfg, tick_ms), out(NULL)
+    {
+        set_loglevel(WvLog::Info);
+        reset();
+    }
+
+    void reset()
+    {
+        pkts_out = errors_out = 0;
+        bytes_out = 0;
+        hash = 2166136261u;
+    }
+
+    void deliver(const WvIPPortAddr &from, const unsigned char *data,
+                 size_t len)
+    {
+        memcpy(packet, data, len);
+        packetsize = len;
+        remaddr = from;
+        process_packet();
+    }
+
+    void tick()
+        { check_timeouts(); }
+
+    bool idle() const
+        { return conns.isempty(); }
+
+protected:
+    virtual struct timeval now()
+        { return realtime ? wvtime() : vclock; }
+
+    virtual void send_pkt(const WvIPPortAddr &dest, TFTPPacket *pkt)
+    {
+        struct iovec iov[2];
+        int n = pkt->iovecs(iov);
+        for (int i = 0; i < n; i++)
+        {
+            const unsigned char *p = (const unsigned char *)iov[i].iov_base;
+            for (size_t j = 0; j < iov[i].iov_len; j++)
+                hash = (hash ^ p[j]) * 16777619u;
+        }
+        pkts_out++;
+        bytes_out += pkt->pktlen();
+        if (pkt->hdr[1] == ERROR)
+            errors_out++;
+        if (out)
+            out->recordv(now(), localaddr, dest, iov, n);
+    }
+};
+
+
+// Runs the server's timeout checks, and moves the clock, up to 'until'.
+static void advance(ReplayServer &server, unsigned long long &next_tick,
+                    unsigned long long until)
+{
+    if (realtime)
+    {
+        for (;;)
+        {
+            unsigned long long now = usec(wvtime());
+            if (now >= until)
+                break;
+            if (now >= next_tick)
+            {
+                server.tick();
+                next_tick = now + tick_ms * 1000;
+            }
+            unsigned long long wait = (next_tick < until ? next_tick : until)
+                - now;
+            usleep(wait);
+        }
+        return;
+    }
+
+    while (next_tick <= until)
+    {
+        server.vclock.tv_sec = next_tick / 1000000;
+        server.vclock.tv_usec = next_tick % 1000000;
+        server.tick();
+        next_tick += tick_ms * 1000;
+    }
+    server.vclock.tv_sec = until / 1000000;
+    server.vclock.tv_usec = until % 1000000;
+}
+
+
+static int replay(ReplayServer &server, const char *filename)
+{
+    TFTPPcapReader in(filename);
+    if (!in.isok())
+    {
+        fprintf(stderr, "%s: not a readable raw-IP pcap file\n", filename);
+        return 1;
+    }
+
+    struct timeval tv;
+    WvIPPortAddr src, dst, client;
+    const unsigned char *data;
+    size_t len;
+    bool first = true;
+    unsigned long long offset = 0, next_tick = 0, last = 0;
+    unsigned long pkts_in = 0;
+    double server_ns = 0, max_ns = 0;
+
+    server.reset();
+    while (in.next(tv, src, dst, data, len))
+    {
+        if (first)
+        {
+            // The capture starts with the request, so its sender is the
+            // client; everything else in the file is the server talking.
+            client = src;
+            unsigned long long base = realtime ? usec(wvtime()) : usec(tv);
+            offset = base - usec(tv);
+            next_tick = base + tick_ms * 1000;
+            first = false;
+        }
+        if (src != client)
+            continue;
+
+        last = usec(tv) + offset;
+        advance(server, next_tick, last);
+
+        double t0 = mono_ns();
+        server.deliver(client, data, len);
+        double ns = mono_ns() - t0;
+        server_ns += ns;
+        if (ns > max_ns)
+            max_ns = ns;
+        pkts_in++;
+    }
+
+    // Let the server finish, retransmit or give up as it would have.
+    unsigned long long end = last + drain * 1000ULL;
+    while (!server.idle() && last < end)
+    {
+        last += tick_ms * 1000;
+        advance(server, next_tick, last);
+    }
+
+    printf("{ \"file\": \"%s\", \"client\": \"%s\", \"packets_in\": %lu, "
+           "\"packets_out\": %lu, \"errors_out\": %lu, \"bytes_out\": %llu, "
+           "\"server_us\": %.1f, \"max_packet_us\": %.1f, "
+           "\"output_hash\": \"%08x\", \"finished\": %s }\n",
+           filename, WvString(client).cstr(), pkts_in, server.pkts_out,
+           server.errors_out, server.bytes_out, server_ns / 1000,
+           max_ns / 1000, server.hash, server.idle() ? "true" : "false");
+    return 0;
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options] capture.pcap...\n"
+            "  -d dir      directory to serve files from (default .)\n"
+            "  -C moniker  UniConf moniker for the full server config\n"
+            "  -r          replay in real time (default: as fast as possible)\n"
+            "  -k ms       timeout check interval (default 100)\n"
+            "  -D ms       how long to let the server run after the last\n"
+            "              packet (default 10000)\n"
+            "  -o file     also write the server's replies to this capture\n",
+            argv0);
+    exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+    const char *base_dir = ".", *moniker = "temp:", *outfile = NULL;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "d:C:rk:D:o:h")) != -1)
+    {
+        switch (ch)
+        {
+        case 'd': base_dir = optarg; break;
+        case 'C': moniker = optarg; break;
+        case 'r': realtime = true; break;
+        case 'k': tick_ms = atoi(optarg); break;
+        case 'D': drain = atoi(optarg); break;
+        case 'o': outfile = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind == argc || tick_ms < 1 || drain < 0)
+        usage(argv[0]);
+
+    UniConfRoot cfg(moniker);
+    cfg["TFTP/Port"].setmeint(0);
+    if (!cfg["TFTP/Base dir"].exists() || strcmp(base_dir, "."))
+        cfg["TFTP/Base dir"].setme(base_dir);
+    // Never capture the replay itself.
+    cfg["TFTP/Capture Dir"].setme("");
+
+    ReplayServer server(cfg);
+    if (outfile)
+    {
+        server.out = new TFTPPcapWriter(outfile);
+        if (!server.out->isok())
+        {
+            perror(outfile);
+            return 1;
+        }
+    }
+
+    int rc = 0;
+    for (int i = optind; i < argc; i++)
+        rc |= replay(server, argv[i]);
+
+    delete server.out;
+    return rc;
+}
@@ -0,0 +1,563 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * tftpsim: runs the WvTFTPServer protocol engine against simulated clients
+ * on a simulated network, in virtual time.
+ *
+ * The server's clock (now()) and transmit path (send_pkt()) are replaced,
+ * so nothing ever sleeps or touches the network; a run is a pure function
+ * of its options and random seed.  The link model has a bandwidth, a
+ * latency, uniform jitter (which also reorders), a tail-drop queue and
+ * Gilbert-Elliott burst loss, separately in each direction.  See
+ * "tftpsim -h".
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "uniconfroot.h"
+#include "wvfileutils.h"
+#include "../wvtftpserver.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <queue>
+#include <vector>
+
+typedef unsigned long long usec_t;
+
+// Deterministic on every platform, unlike drand48().
+static unsigned long long rng_state;
+
+static double rnd()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* One direction of the simulated link. */
+struct Link
+{
+    double bandwidth;       // bits per second; 0 means unlimited
+    usec_t latency;
+    usec_t jitter;          // uniform, 0..jitter extra
+    usec_t queue;           // max queueing delay before tail drop
+    double p_gb, p_bg;      // Gilbert-Elliott: good->bad, bad->good
+    double loss_good, loss_bad;
+
+    bool bad;
+    usec_t busy_until;
+    unsigned long long sent, dropped;
+
+    Link() : bandwidth(0), latency(0), jitter(0), queue(100000), p_gb(0),
+        p_bg(1), loss_good(0), loss_bad(1), bad(false), busy_until(0),
+        sent(0), dropped(0)
+        { }
+
+    // Returns the arrival time of a 'len' byte packet sent at 't', or 0 if
+    // the packet is lost.
+    usec_t transmit(usec_t t, size_t len)
+    {
+        sent++;
+        bad = bad ? rnd() >= p_bg : rnd() < p_gb;
+        if (rnd() < (bad ? loss_bad : loss_good))
+        {
+            dropped++;
+            return 0;
+        }
+
+        usec_t start = t > busy_until ? t : busy_until;
+        if (start - t > queue)
+        {
+            dropped++;
+            return 0;
+        }
+        usec_t tx = bandwidth > 0 ? (usec_t)(len * 8 * 1e6 / bandwidth) : 0;
+        busy_until = start + tx;
+        return busy_until + latency + (usec_t)(rnd() * jitter);
+    }
+};
+
+
+enum EventType { TO_SERVER, TO_CLIENT, CLIENT_TIMER, CLIENT_START,
+                 SERVER_TICK };
+
+struct Event
+{
+    usec_t t;
+    unsigned long long seq;     // keeps equal-time events in FIFO order
+    EventType type;
+    int client;
+    unsigned int gen;           // CLIENT_TIMER: stale unless it matches
+    std::vector<unsigned char> data;
+
+    bool operator<(const Event &e) const
+        { return t != e.t ? t > e.t : seq > e.seq; }
+};
+
+
+struct SimClient
+{
+    enum State { WAITING, REQUESTED, RUNNING, DONE, FAILED };
+
+    State state;
+    unsigned int expect;
+    long long bytes;
+    usec_t start, end;
+    std::vector<unsigned char> last_sent;
+    unsigned int timer_gen;
+    int retries;
+};
+
+
+class Sim;
+
+class SimServer : public WvTFTPServer
+{
+public:
+    SimServer(UniConf &cfg, Sim &_sim)
+        : WvTFTPServer(cfg, 100), sim(_sim)
+        { set_loglevel(WvLog::Info); }
+
+    void deliver(const WvIPPortAddr &from, const std::vector<unsigned char> &d)
+    {
+        memcpy(packet, &d[0], d.size());
+        packetsize = d.size();
+        remaddr = from;
+        process_packet();
+    }
+
+    void tick()
+        { check_timeouts(); }
+
+protected:
+    virtual struct timeval now();
+    virtual void send_pkt(const WvIPPortAddr &dest, TFTPPacket *pkt);
+
+private:
+    Sim &sim;
+};
+
+
+struct Options
+{
+    int transfers;          // -n
+    int concurrency;        // -c
+    off_t size;             // -s
+    int blksize;            // -b
+    int window;             // -w
+    int min_timeout;        // -m, server "Min Timeout"
+    int max_timeout;        // -M, server "Max Timeout"
+    int tick;               // -k, ms between server timeout checks
+    usec_t client_rto;      // -T, ms
+    usec_t ack_delay;       // -a, us
+    bool dupack;            // -D disables: client re-ACKs old DATA
+    unsigned long long seed;
+};
+
+
+class Sim
+{
+public:
+    Options opt;
+    Link down, up;              // server->client, client->server
+    usec_t clock;
+    unsigned long long seq;
+    std::priority_queue<Event> events;
+    std::vector<SimClient> clients;
+    SimServer *server;
+    int next_client, active, failed;
+    unsigned long long client_retries;
+
+    Sim() : clock(0), seq(0), server(NULL), next_client(0), active(0),
+        failed(0), client_retries(0)
+        { }
+
+    static WvIPPortAddr addr(int client)
+    {
+        unsigned char ip[4] = { 10, (unsigned char)(client >> 24),
+                                (unsigned char)(client >> 16),
+                                (unsigned char)(client >> 8) };
+        return WvIPPortAddr(WvIPAddr(ip), 1024 + (client & 0xff));
+    }
+
+    static int client_of(const WvIPPortAddr &a)
+    {
+        const unsigned char *ip = a.rawdata();
+        return (ip[1] << 24) | (ip[2] << 16) | (ip[3] << 8)
+            | (a.port - 1024);
+    }
+
+    void schedule(usec_t t, EventType type, int client,
+                  const unsigned char *buf = NULL, size_t len = 0,
+                  unsigned int gen = 0)
+    {
+        Event e;
+        e.t = t;
+        e.seq = seq++;
+        e.type = type;
+        e.client = client;
+        e.gen = gen;
+        if (buf)
+            e.data.assign(buf, buf + len);
+        events.push(e);
+    }
+
+    // Server -> client.
+    void from_server(const WvIPPortAddr &dest, const unsigned char *buf,
+                     size_t len)
+    {
+        usec_t t = down.transmit(clock, len + 28);
+        if (t)
+            schedule(t, TO_CLIENT, client_of(dest), buf, len);
+    }
+
+    // Client -> server, with the client's retransmit timer restarted.
+    void client_send(int i, const unsigned char *buf, size_t len)
+    {
+        SimClient &c = clients[i];
+        c.last_sent.assign(buf, buf + len);
+        usec_t t = up.transmit(clock + opt.ack_delay, len + 28);
+        if (t)
+            schedule(t, TO_SERVER, i, buf, len);
+        schedule(clock + opt.client_rto, CLIENT_TIMER, i, NULL, 0,
+                 ++c.timer_gen);
+    }
+
+    void send_ack(int i, unsigned int block)
+    {
+        unsigned char ack[4] = { 0, 4, (unsigned char)(block >> 8),
+                                 (unsigned char)block };
+        client_send(i, ack, 4);
+    }
+
+    void start_client(int i)
+    {
+        SimClient &c = clients[i];
+        unsigned char rrq[64];
+        size_t len = 2;
+        rrq[0] = 0;
+        rrq[1] = 1;
+        len += sprintf((char *)rrq + len, "file") + 1;
+        len += sprintf((char *)rrq + len, "octet") + 1;
+        if (opt.blksize != 512)
+        {
+            len += sprintf((char *)rrq + len, "blksize") + 1;
+            len += sprintf((char *)rrq + len, "%d", opt.blksize) + 1;
+        }
+
+        c.state = SimClient::REQUESTED;
+        c.expect = 1;
+        c.bytes = 0;
+        c.start = clock;
+        c.timer_gen = 0;
+        c.retries = 0;
+        active++;
+        client_send(i, rrq, len);
+    }
+
+    void finish_client(int i, bool ok)
+    {
+        SimClient &c = clients[i];
+        c.state = ok ? SimClient::DONE : SimClient::FAILED;
+        c.end = clock;
+        c.timer_gen++;
+        active--;
+        if (!ok)
+            failed++;
+        if (next_client < opt.transfers)
+            schedule(clock, CLIENT_START, next_client++);
+    }
+
+    void client_receive(int i, const std::vector<unsigned char> &d)
+    {
+        SimClient &c = clients[i];
+        if (d.size() < 4 || c.state == SimClient::DONE
+            || c.state == SimClient::FAILED)
+            return;
+
+        int opcode = d[0] * 256 + d[1];
+        if (opcode == 6 && c.state == SimClient::REQUESTED)
+        {
+            c.state = SimClient::RUNNING;
+            c.retries = 0;
+            send_ack(i, 0);
+        }
+        else if (opcode == 5)
+            finish_client(i, false);
+        else if (opcode == 3)
+        {
+            unsigned int block = d[2] * 256 + d[3];
+            if (block == (c.expect & 0xffff))
+            {
+                c.state = SimClient::RUNNING;
+                c.retries = 0;
+                c.bytes += d.size() - 4;
+                c.expect++;
+                send_ack(i, block);
+                if (d.size() - 4 < (size_t)opt.blksize)
+                    finish_client(i, true);
+            }
+            else if (opt.dupack && c.expect > 1
+                     && block == ((c.expect - 1) & 0xffff))
+                send_ack(i, block);
+        }
+    }
+
+    void client_timer(int i, unsigned int gen)
+    {
+        SimClient &c = clients[i];
+        if (gen != c.timer_gen || c.state == SimClient::DONE
+            || c.state == SimClient::FAILED)
+            return;
+        if (++c.retries > 10)
+        {
+            finish_client(i, false);
+            return;
+        }
+        client_retries++;
+        std::vector<unsigned char> again(c.last_sent);
+        client_send(i, &again[0], again.size());
+    }
+
+    void run()
+    {
+        clients.resize(opt.transfers);
+        for (int i = 0; i < opt.concurrency && i < opt.transfers; i++)
+            schedule(0, CLIENT_START, next_client++);
+        schedule(opt.tick * 1000, SERVER_TICK, 0);
+
+        while (!events.empty())
+        {
+            Event e = events.top();
+            events.pop();
+            clock = e.t;
+
+            switch (e.type)
+            {
+            case TO_SERVER:
+                server->deliver(addr(e.client), e.data);
+                break;
+            case TO_CLIENT:
+                client_receive(e.client, e.data);
+                break;
+            case CLIENT_TIMER:
+                client_timer(e.client, e.gen);
+                break;
+            case CLIENT_START:
+                start_client(e.client);
+                break;
+            case SERVER_TICK:
+                server->tick();
+                if (active || next_client < opt.transfers)
+                    schedule(clock + opt.tick * 1000, SERVER_TICK, 0);
+                break;
+            }
+        }
+    }
+};
+
+
+struct timeval SimServer::now()
+{
+    // Start well away from zero, which PktTime treats as "never".
+    struct timeval tv;
+    usec_t t = sim.clock + 1000000;
+    tv.tv_sec = t / 1000000;
+    tv.tv_usec = t % 1000000;
+    return tv;
+}
+
+
+void SimServer::send_pkt(const WvIPPortAddr &dest, TFTPPacket *pkt)
+{
+    unsigned char buf[MAX_PACKET_SIZE];
+    size_t len = pkt->hdrlen;
+    memcpy(buf, pkt->hdr, pkt->hdrlen);
+    memcpy(buf + len, pkt->data, pkt->len);
+    len += pkt->len;
+    sim.from_server(dest, buf, len);
+}
+
+
+static int cmp_usec(const void *a, const void *b)
+{
+    usec_t x = *(const usec_t *)a, y = *(const usec_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "workload:\n"
+        "  -n transfers     total transfers (default 1000)\n"
+        "  -c concurrency   transfers in progress at once (default 50)\n"
+        "  -s size          file size in bytes (default 65536)\n"
+        "  -b blksize       blksize option (default 512)\n"
+        "  -a usec          client processing delay before each send\n"
+        "  -T ms            client retransmit timeout (default 1000)\n"
+        "  -D               client never re-ACKs duplicate DATA\n"
+        "server:\n"
+        "  -w window        Prefetch (default 3)\n"
+        "  -m ms            Min Timeout (default 100)\n"
+        "  -M ms            Max Timeout (default 5000)\n"
+        "  -k ms            timeout check interval (default 100)\n"
+        "link (applies to both directions):\n"
+        "  -B bits/s        bandwidth (default unlimited)\n"
+        "  -L usec          one-way latency (default 500)\n"
+        "  -J usec          jitter (default 0)\n"
+        "  -Q usec          queue limit (default 100000)\n"
+        "  -l prob          random loss (default 0)\n"
+        "  -g prob          burst loss: chance of entering a burst\n"
+        "  -e prob          burst loss: chance of leaving a burst "
+        "(default 0.3)\n"
+        "  -S seed          random seed (default 1)\n", argv0);
+    exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+    Sim sim;
+    Options &opt = sim.opt;
+    opt.transfers = 1000;
+    opt.concurrency = 50;
+    opt.size = 65536;
+    opt.blksize = 512;
+    opt.window = 3;
+    opt.min_timeout = 100;
+    opt.max_timeout = 5000;
+    opt.tick = 100;
+    opt.client_rto = 1000000;
+    opt.ack_delay = 0;
+    opt.dupack = true;
+    opt.seed = 1;
+
+    Link link;
+    link.latency = 500;
+    link.p_bg = 0.3;
+
+    int ch;
+    while ((ch = getopt(argc, argv, "n:c:s:b:a:T:Dw:m:M:k:B:L:J:Q:l:g:e:S:h"))
+           != -1)
+    {
+        switch (ch)
+        {
+        case 'n': opt.transfers = atoi(optarg); break;
+        case 'c': opt.concurrency = atoi(optarg); break;
+        case 's': opt.size = atoll(optarg); break;
+        case 'b': opt.blksize = atoi(optarg); break;
+        case 'a': opt.ack_delay = atoll(optarg); break;
+        case 'T': opt.client_rto = atoll(optarg) * 1000; break;
+        case 'D': opt.dupack = false; break;
+        case 'w': opt.window = atoi(optarg); break;
+        case 'm': opt.min_timeout = atoi(optarg); break;
+        case 'M': opt.max_timeout = atoi(optarg); break;
+        case 'k': opt.tick = atoi(optarg); break;
+        case 'B': link.bandwidth = atof(optarg); break;
+        case 'L': link.latency = atoll(optarg); break;
+        case 'J': link.jitter = atoll(optarg); break;
+        case 'Q': link.queue = atoll(optarg); break;
+        case 'l': link.loss_good = atof(optarg); break;
+        case 'g': link.p_gb = atof(optarg); break;
+        case 'e': link.p_bg = atof(optarg); break;
+        case 'S': opt.seed = strtoull(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (opt.transfers < 1 || opt.concurrency < 1 || opt.tick < 1
+        || opt.blksize < 8 || opt.blksize > 65464)
+        usage(argv[0]);
+    rng_state = opt.seed ? opt.seed : 1;
+    sim.down = sim.up = link;
+
+    // The server still reads a real file; only time and the network are
+    // simulated.
+    WvString base_dir("/tmp/tftpsim-%s", getpid());
+    mkdir(base_dir, 0755);
+    {
+        WvString name("%s/file", base_dir);
+        FILE *f = fopen(name, "wb");
+        if (!f)
+        {
+            perror(name);
+            return 1;
+        }
+        for (off_t i = 0; i < opt.size; i++)
+            putc(i & 0xff, f);
+        fclose(f);
+    }
+
+    UniConfRoot cfg("temp:");
+    cfg["TFTP/Port"].setmeint(0);
+    cfg["TFTP/Base dir"].setme(base_dir);
+    cfg["TFTP/Prefetch"].setmeint(opt.window);
+    cfg["TFTP/Min Timeout"].setmeint(opt.min_timeout);
+    cfg["TFTP/Max Timeout"].setmeint(opt.max_timeout);
+    sim.server = new SimServer(cfg, sim);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    sim.run();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    TFTPStats total(false);
+    TFTPStats::collect(total);
+    WVRELEASE(sim.server);
+    rm_rf(base_dir);
+
+    int n = 0;
+    long long bytes = 0;
+    usec_t *times = new usec_t[opt.transfers];
+    for (int i = 0; i < opt.transfers; i++)
+    {
+        if (sim.clients[i].state != SimClient::DONE)
+            continue;
+        times[n++] = sim.clients[i].end - sim.clients[i].start;
+        bytes += sim.clients[i].bytes;
+    }
+    qsort(times, n, sizeof(usec_t), cmp_usec);
+
+    printf("transfers=%d\n", n);
+    printf("failed=%d\n", sim.failed);
+    printf("virtual_ms=%.1f\n", sim.clock / 1000.0);
+    printf("goodput_mbit=%.2f\n",
+           sim.clock ? bytes * 8.0 / sim.clock : 0);
+    printf("p50_ms=%.1f\n", n ? times[(int)(0.50 * (n - 1) + 0.5)] / 1000.0
+           : 0);
+    printf("p99_ms=%.1f\n", n ? times[(int)(0.99 * (n - 1) + 0.5)] / 1000.0
+           : 0);
+    printf("max_ms=%.1f\n", n ? times[n - 1] / 1000.0 : 0);
+    printf("server_retransmits=%llu\n",
+           (unsigned long long)total.retransmits);
+    printf("server_timeouts=%llu\n", (unsigned long long)total.timeouts);
+    printf("client_retries=%llu\n", sim.client_retries);
+    printf("down_dropped=%llu/%llu\n", sim.down.dropped, sim.down.sent);
+    printf("up_dropped=%llu/%llu\n", sim.up.dropped, sim.up.sent);
+    printf("wall_s=%.3f\n", wall);
+    printf("transfers_per_wall_s=%.0f\n", wall > 0 ? n / wall : 0);
+
+    deletev times;
+    return sim.failed ? 2 : 0;
+}
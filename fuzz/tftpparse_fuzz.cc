@@ -0,0 +1,110 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * Fuzz harness for tftp_parse_request().  Built with "make fuzz", which
+ * needs clang's libFuzzer:
+ *
+ *     fuzz/tftpparse_fuzz -max_len=1100 fuzz/corpus
+ *
+ * Built with -DSTANDALONE instead, it runs the same checks over the files
+ * named on its command line, for AFL or for replaying a crash without
+ * libFuzzer.
+ *
+ * Besides not crashing, the parser must only ever point inside the packet,
+ * at strings that are NUL-terminated there, and must agree with itself
+ * about which options it recognized.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "../wvtftpparse.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void check_view(const TFTPStrView &v, const char *pkt, size_t len)
+{
+    if (!v.str)
+        return;
+    if (v.str < pkt || v.str + v.len >= pkt + len || v.str[v.len] != 0
+        || memchr(v.str, 0, v.len))
+        abort();
+}
+
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    // A private copy, so reads past the end are caught by ASan.
+    char *pkt = (char *)malloc(size ? size : 1);
+    memcpy(pkt, data, size);
+
+    TFTPRequest req;
+    int err = tftp_parse_request(pkt, size, req);
+
+    if (err == 0)
+    {
+        if (req.opcode != 1 && req.opcode != 2)
+            abort();
+        if (req.mode == TFTP_MODE_UNKNOWN || !req.filename.str)
+            abort();
+        if (req.nopts < 0 || req.nopts > TFTP_MAX_OPTIONS)
+            abort();
+    }
+    else if (err != -1 && err != 4 && err != 8)
+        abort();
+
+    check_view(req.filename, pkt, size);
+    check_view(req.mode_str, pkt, size);
+    for (int i = 0; i < req.nopts; i++)
+    {
+        check_view(req.opts[i].name, pkt, size);
+        check_view(req.opts[i].value, pkt, size);
+        if (req.opts[i].id != tftp_option_id(req.opts[i].name.str,
+                                             req.opts[i].name.len))
+            abort();
+        if (req.opts[i].id != TFTP_OPT_UNKNOWN
+            && req.known[req.opts[i].id] != i)
+            abort();
+
+        unsigned long long val;
+        if (tftp_parse_uint(req.opts[i].value, 65535, val) && val > 65535)
+            abort();
+    }
+
+    free(pkt);
+    return 0;
+}
+
+
+#ifdef STANDALONE
+int main(int argc, char **argv)
+{
+    static uint8_t buf[65536];
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t len = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    return 0;
+}
+#endif
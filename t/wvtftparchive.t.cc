@@ -0,0 +1,143 @@
+#include "wvtest.h"
+#include "../wvtftparchive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Appends one tar entry (header and padded data) to 'f'.
+static void tar_member(FILE *f, const char *name, char type, const char *data,
+                       size_t len, const char *prefix = NULL)
+{
+    unsigned char h[512];
+    memset(h, 0, sizeof(h));
+    strncpy((char *)h, name, 100);
+    sprintf((char *)h + 100, "%07o", 0644);
+    sprintf((char *)h + 124, "%011o", (unsigned)len);
+    sprintf((char *)h + 136, "%011o", 1000000000);
+    h[156] = type;
+    memcpy(h + 257, "ustar\0" "00", 8);
+    if (prefix)
+        strncpy((char *)h + 345, prefix, 155);
+
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += h[i];
+    sprintf((char *)h + 148, "%06o", sum);
+
+    fwrite(h, 1, 512, f);
+    fwrite(data, 1, len, f);
+    static const char zeros[512] = { 0 };
+    fwrite(zeros, 1, (512 - len % 512) % 512, f);
+}
+
+
+// Appends one newc cpio entry to 'f'.
+static void cpio_member(FILE *f, const char *name, unsigned mode,
+                        const char *data, size_t len)
+{
+    long start = ftell(f);
+    fprintf(f, "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+            1, mode, 0, 0, 1, 1000000000, (unsigned)len, 0, 0, 0, 0,
+            (unsigned)strlen(name) + 1, 0);
+    fwrite(name, 1, strlen(name) + 1, f);
+    while ((ftell(f) - start) % 4)
+        fputc(0, f);
+    fwrite(data, 1, len, f);
+    while ((ftell(f) - start) % 4)
+        fputc(0, f);
+}
+
+
+WVTEST_MAIN("tar archive index")
+{
+    TFTPMappedFile *maps = NULL;
+    char name[] = "/tmp/wvtftparchive.XXXXXX";
+    int fd = mkstemp(name);
+    FILE *f = fdopen(fd, "w");
+
+    char longname[200];
+    memset(longname, 'x', sizeof(longname) - 1);
+    longname[sizeof(longname) - 1] = 0;
+
+    tar_member(f, "./boot/", '5', "", 0);
+    tar_member(f, "./boot/kernel", '0', "kernel data", 11);
+    tar_member(f, "pxelinux.0", '0', "pxe", 3, "boot");
+    tar_member(f, "././@LongLink", 'L', longname, strlen(longname) + 1);
+    tar_member(f, "truncated", '0', "long", 4);
+    tar_member(f, "PaxHeader", 'x', "21 path=boot/pax.cfg\n", 21);
+    tar_member(f, "short.cfg", '0', "pax", 3);
+    tar_member(f, "boot/link", '2', "", 0);
+    fclose(f);
+
+    TFTPArchive a(name, maps);
+    WVPASS(a.isok());
+    WVPASSEQ(a.count(), 4);
+    WVFAIL(a.find("boot"));
+    WVFAIL(a.find("boot/link"));
+    WVFAIL(a.find("short.cfg"));
+    WVFAIL(a.find("truncated"));
+    WVPASS(a.find(longname));
+    WVPASS(a.find("boot/pax.cfg"));
+    WVPASS(a.find("boot/pxelinux.0"));
+
+    const TFTPArchive::Member *m = a.find("boot/kernel");
+    WVPASS(m);
+    if (m)
+    {
+        WVPASSEQ((int)m->size, 11);
+        WVPASS(!memcmp(a.mapping()->bytes() + m->offset, "kernel data", 11));
+    }
+
+    // Replacing the file is noticed.
+    struct stat st;
+    stat(name, &st);
+    WVPASS(a.same_file(st));
+    st.st_mtime++;
+    WVFAIL(a.same_file(st));
+    unlink(name);
+}
+
+
+WVTEST_MAIN("cpio archive index")
+{
+    TFTPMappedFile *maps = NULL;
+    char name[] = "/tmp/wvtftparchive.XXXXXX";
+    int fd = mkstemp(name);
+    FILE *f = fdopen(fd, "w");
+
+    cpio_member(f, "boot", 040755, "", 0);
+    cpio_member(f, "boot/initrd", 0100644, "initrd", 6);
+    cpio_member(f, "TRAILER!!!", 0, "", 0);
+    cpio_member(f, "after", 0100644, "ignored", 7);
+    fclose(f);
+
+    TFTPArchive a(name, maps);
+    WVPASS(a.isok());
+    WVPASSEQ(a.count(), 1);
+    WVFAIL(a.find("after"));
+    const TFTPArchive::Member *m = a.find("boot/initrd");
+    WVPASS(m);
+    if (m)
+        WVPASS(!memcmp(a.mapping()->bytes() + m->offset, "initrd", 6));
+    unlink(name);
+}
+
+
+WVTEST_MAIN("not an archive")
+{
+    TFTPMappedFile *maps = NULL;
+    char name[] = "/tmp/wvtftparchive.XXXXXX";
+    int fd = mkstemp(name);
+    char junk[1024];
+    memset(junk, 'j', sizeof(junk));
+    write(fd, junk, sizeof(junk));
+    close(fd);
+
+    TFTPArchive a(name, maps);
+    WVFAIL(a.isok());
+    WVPASS(a.errstr().len() > 0);
+    WVFAIL(maps);
+    unlink(name);
+}
@@ -0,0 +1,42 @@
+#include "uniconfroot.h"
+#include "wvtest.h"
+#include "../wvtftpcontrol.h"
+#include "../wvtftpserver.h"
+
+static WvString failed_upgrade()
+{
+    return "no binary";
+}
+
+
+WVTEST_MAIN("control commands")
+{
+    UniConfRoot cfg("temp:");
+    cfg["TFTP/Port"].setmeint(6970);
+    WvTFTPServer *server = new WvTFTPServer(cfg, 100);
+
+    WvString reply = TFTPControl::command("list");
+    WVPASS(strstr(reply, "# peer"));
+    WVPASS(strstr(reply, "OK\n"));
+
+    reply = TFTPControl::command("abort 127.0.0.1:1234");
+    WVPASS(strstr(reply, "ERROR") == reply.cstr());
+
+    reply = TFTPControl::command("window 127.0.0.1:1234 2");
+    WVPASS(strstr(reply, "ERROR") == reply.cstr());
+
+    reply = TFTPControl::command("window 127.0.0.1:1234 0");
+    WVPASS(strstr(reply, "ERROR") == reply.cstr());
+
+    reply = TFTPControl::command("upgrade");
+    WVPASS(strstr(reply, "ERROR") == reply.cstr());
+    TFTPControl::upgrade = failed_upgrade;
+    reply = TFTPControl::command("upgrade");
+    WVPASSEQ(reply, "ERROR upgrade failed: no binary\n");
+    TFTPControl::upgrade = NULL;
+
+    reply = TFTPControl::command("bogus");
+    WVPASS(strstr(reply, "ERROR usage") == reply.cstr());
+
+    WVRELEASE(server);
+}
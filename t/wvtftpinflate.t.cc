@@ -0,0 +1,262 @@
+#include "wvtest.h"
+#include "../wvtftpinflate.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// Byte 'i' of the test data: compressible, but not the same everywhere.
+static unsigned char pattern(off_t i)
+{
+    return (i / 7 + (i >> 12) * 31) & 0xff;
+}
+
+
+// Appends a gzip member of 'size' bytes to 'fd'.
+static void gzip_member(int fd, off_t size)
+{
+    gzFile gz = gzdopen(dup(fd), "wb");
+    unsigned char buf[4096];
+    for (off_t pos = 0; pos < size; pos += sizeof(buf))
+    {
+        size_t n = size - pos < (off_t)sizeof(buf) ? size - pos : sizeof(buf);
+        for (size_t i = 0; i < n; i++)
+            buf[i] = pattern(pos + i);
+        gzwrite(gz, buf, n);
+    }
+    gzclose(gz);
+}
+
+
+static int gzip_file(char *name, off_t size)
+{
+    int fd = mkstemp(name);
+    gzip_member(fd, size);
+    return fd;
+}
+
+
+static bool matches(const unsigned char *buf, off_t offset, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        if (buf[i] != pattern(offset + i))
+            return false;
+    return true;
+}
+
+
+WVTEST_MAIN("gzip blocks in and out of order")
+{
+    TFTPMappedFile *maps = NULL;
+    TFTPInflatedFile *list = NULL;
+    char name[] = "/tmp/wvtftpinflate.XXXXXX";
+    off_t size = 5 * TFTPInflatedFile::SPAN + 12345;
+    int fd = gzip_file(name, size);
+
+    TFTPInflatedFile *f = TFTPInflatedFile::get(list, fd, maps, 4);
+    WVPASS(f);
+    if (!f)
+        return;
+    WVPASS(TFTPInflatedFile::get(list, fd, maps, 4) == f);
+    f->release();
+    WVPASSEQ((long long)f->size(), (long long)size);
+
+    // Straight through, in blocks that straddle chunks.
+    unsigned char buf[1428];
+    off_t pos = 0;
+    bool ok = true;
+    ssize_t n;
+    while ((n = f->read(pos, buf, sizeof(buf))) > 0)
+    {
+        ok = ok && matches(buf, pos, n);
+        pos += n;
+    }
+    WVPASS(ok);
+    WVPASSEQ((long long)pos, (long long)size);
+    WVPASSEQ((int)f->restarts, 0);
+    WVPASSEQ((int)f->discarded, 0);
+
+    // Going back near the end doesn't start over from the top: it costs
+    // at most a SPAN of output plus the chunk itself.
+    long long before = f->inflated;
+    off_t back = 4 * TFTPInflatedFile::SPAN + 100000;
+    WVPASSEQ((int)f->read(back, buf, sizeof(buf)), (int)sizeof(buf));
+    WVPASS(matches(buf, back, sizeof(buf)));
+    WVPASSEQ((int)f->restarts, 1);
+    WVPASSEQ(f->inflated - before, 1LL);
+    WVPASS(f->discarded <= TFTPInflatedFile::SPAN + TFTPInflatedFile::CHUNK);
+
+    // Past the end.
+    WVPASSEQ((int)f->read(size, buf, sizeof(buf)), 0);
+    WVPASSEQ((int)f->read(size + 3 * TFTPInflatedFile::CHUNK, buf, 10), 0);
+
+    f->release();
+    WVFAIL(list);
+    WVFAIL(maps);
+    close(fd);
+    unlink(name);
+}
+
+
+WVTEST_MAIN("not gzip")
+{
+    TFTPMappedFile *maps = NULL;
+    TFTPInflatedFile *list = NULL;
+    char name[] = "/tmp/wvtftpinflate.XXXXXX";
+    int fd = mkstemp(name);
+    write(fd, "plain text, not compressed", 26);
+
+    WVFAIL(TFTPInflatedFile::get(list, fd, maps, 4));
+    WVFAIL(maps);
+    close(fd);
+    unlink(name);
+
+    // Cut short: what's there comes out, then an error instead of EOF.
+    char name2[] = "/tmp/wvtftpinflate.XXXXXX";
+    fd = gzip_file(name2, 1000000);
+    ftruncate(fd, lseek(fd, 0, SEEK_END) / 2);
+    TFTPInflatedFile *f = TFTPInflatedFile::get(list, fd, maps, 4);
+    WVPASS(f);
+    if (f)
+    {
+        unsigned char buf[512];
+        WVPASSEQ((int)f->read(0, buf, sizeof(buf)), (int)sizeof(buf));
+        WVPASS(matches(buf, 0, sizeof(buf)));
+        WVPASSEQ((int)f->read(900000, buf, sizeof(buf)), -1);
+        f->release();
+    }
+    close(fd);
+    unlink(name2);
+
+    // A trailer promising more than the stream holds is an error too.
+    char name3[] = "/tmp/wvtftpinflate.XXXXXX";
+    fd = gzip_file(name3, 100000);
+    unsigned char isize[4] = { 0x40, 0x0d, 0x03, 0 };   // 200000
+    pwrite(fd, isize, sizeof(isize), lseek(fd, 0, SEEK_END) - 4);
+    f = TFTPInflatedFile::get(list, fd, maps, 4);
+    WVPASS(f);
+    if (f)
+    {
+        unsigned char buf[512];
+        WVPASSEQ((long long)f->size(), 200000LL);
+        WVPASSEQ((int)f->read(0, buf, sizeof(buf)), (int)sizeof(buf));
+        WVPASSEQ((int)f->read(99840, buf, sizeof(buf)), -1);
+        WVPASSEQ((int)f->read(150000, buf, sizeof(buf)), -1);
+        f->release();
+    }
+    close(fd);
+    unlink(name3);
+}
+
+
+WVTEST_MAIN("gzip bigger than its trailer says")
+{
+    TFTPMappedFile *maps = NULL;
+    TFTPInflatedFile *list = NULL;
+    unsigned char buf[512];
+
+    // Two members: the last one's ISIZE is the first one's size, but the
+    // end of that isn't the end of the file.
+    char name[] = "/tmp/wvtftpinflate.XXXXXX";
+    off_t size = 5 * TFTPInflatedFile::SPAN + 12345;
+    int fd = gzip_file(name, size);
+    gzip_member(fd, size);
+    TFTPInflatedFile *f = TFTPInflatedFile::get(list, fd, maps, 4);
+    WVPASS(f);
+    if (f)
+    {
+        WVPASSEQ((long long)f->size(), (long long)size);
+        WVPASSEQ((int)f->read(0, buf, sizeof(buf)), (int)sizeof(buf));
+        WVPASSEQ((int)f->read(size - 100, buf, sizeof(buf)), -1);
+        // And again from a saved point rather than from the top.
+        long long before = f->discarded;
+        WVPASSEQ((int)f->read(size - 100, buf, sizeof(buf)), -1);
+        WVPASS(f->discarded - before < size / 2);
+        f->release();
+    }
+    close(fd);
+    unlink(name);
+
+    // The size modulo 2^32, as for a file of 4GB or more.
+    char name2[] = "/tmp/wvtftpinflate.XXXXXX";
+    fd = gzip_file(name2, 200000);
+    unsigned char isize[4] = { 0xa0, 0x86, 0x01, 0 };   // 100000
+    pwrite(fd, isize, sizeof(isize), lseek(fd, 0, SEEK_END) - 4);
+    f = TFTPInflatedFile::get(list, fd, maps, 4);
+    WVPASS(f);
+    if (f)
+    {
+        WVPASSEQ((long long)f->size(), 100000LL);
+        WVPASSEQ((int)f->read(0, buf, sizeof(buf)), (int)sizeof(buf));
+        WVPASSEQ((int)f->read(99900, buf, sizeof(buf)), -1);
+        f->release();
+    }
+    close(fd);
+    unlink(name2);
+
+    // Whereas a single member ends where it should, from a point or not.
+    char name3[] = "/tmp/wvtftpinflate.XXXXXX";
+    fd = gzip_file(name3, size);
+    f = TFTPInflatedFile::get(list, fd, maps, 2);
+    WVPASS(f);
+    if (f)
+    {
+        WVPASSEQ((int)f->read(size - 100, buf, sizeof(buf)), 100);
+        WVPASS(matches(buf, size - 100, 100));
+        // Push the last chunk out of the cache, and go back for it.
+        WVPASSEQ((int)f->read(0, buf, sizeof(buf)), (int)sizeof(buf));
+        WVPASSEQ((int)f->read(TFTPInflatedFile::CHUNK, buf, sizeof(buf)),
+                 (int)sizeof(buf));
+        long long before = f->discarded;
+        WVPASSEQ((int)f->read(size - 100, buf, sizeof(buf)), 100);
+        WVPASS(matches(buf, size - 100, 100));
+        WVPASS(f->discarded - before < size / 2);
+        f->release();
+    }
+    close(fd);
+    unlink(name3);
+}
+
+
+WVTEST_MAIN("warm copy")
+{
+    TFTPMappedFile *maps = NULL;
+    TFTPInflatedFile *list = NULL;
+    char name[] = "/tmp/wvtftpinflate.XXXXXX";
+    char dir[] = "/tmp/wvtftpwarm.XXXXXX";
+    WVPASS(mkdtemp(dir));
+    off_t size = 3 * TFTPInflatedFile::CHUNK + 1000;
+    int fd = gzip_file(name, size);
+
+    // The second time round (a restarted daemon, say) nothing needs
+    // decompressing.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        TFTPInflatedFile *f = TFTPInflatedFile::get(list, fd, maps, 2, dir,
+                                                    1 << 24);
+        WVPASS(f);
+        if (!f)
+            break;
+        unsigned char buf[1000];
+        off_t pos = 0;
+        bool ok = true;
+        ssize_t n;
+        while ((n = f->read(pos, buf, sizeof(buf))) > 0)
+        {
+            ok = ok && matches(buf, pos, n);
+            pos += n;
+        }
+        WVPASS(ok);
+        WVPASSEQ((long long)pos, (long long)size);
+        WVPASSEQ((int)f->inflated, pass ? 0 : 4);
+        f->release();
+    }
+
+    close(fd);
+    unlink(name);
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    system(cmd);
+}
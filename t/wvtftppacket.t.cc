@@ -0,0 +1,224 @@
+#include "wvtest.h"
+#include "../wvtftppacket.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+WVTEST_MAIN("packet pool recycling")
+{
+    TFTPPacketPool pool(1);
+
+    TFTPPacket *a = pool.get(512);
+    WVPASSEQ((int)a->size, 512);
+    WVPASSEQ((int)a->len, 0);
+    a->sethdr(3, 65537);
+    WVPASSEQ(a->hdr[1], 3);
+    WVPASSEQ(a->hdr[2], 0);
+    WVPASSEQ(a->hdr[3], 1);
+    a->release();
+
+    // The buffer comes back from the free list.
+    TFTPPacket *b = pool.get(512);
+    WVPASS(a == b);
+
+    // A different blksize gets its own buffer.
+    TFTPPacket *c = pool.get(1024);
+    WVPASS(c != b);
+    WVPASSEQ((int)c->size, 1024);
+
+    b->release();
+    c->release();
+}
+
+
+WVTEST_MAIN("packet ring")
+{
+    TFTPPacketPool pool;
+    PktRing ring(3);
+
+    for (int i = 1; i <= 5; i++)
+    {
+        TFTPPacket *pkt = pool.get(8);
+        pkt->sethdr(3, i);
+        ring.set(i, pkt);
+        pkt->release();
+    }
+
+    WVFAIL(ring.get(1));
+    WVFAIL(ring.get(2));
+    WVPASS(ring.get(3));
+    WVPASS(ring.get(5));
+    WVPASSEQ(ring.get(5)->hdr[3], 5);
+}
+
+
+WVTEST_MAIN("shared file blocks")
+{
+    TFTPPacketPool pool;
+    TFTPSharedFile *list = NULL;
+    char name[] = "/tmp/wvtftpshared.XXXXXX";
+    int fd = mkstemp(name);
+    WVPASS(fd >= 0);
+    write(fd, "0123456789", 10);
+    int fd2 = open(name, O_RDONLY);
+
+    TFTPSharedFile *a = TFTPSharedFile::get(list, fd, 512, 4);
+    WVPASS(a);
+    WVPASS(list == a);
+
+    // Alone, a reader caches nothing.
+    TFTPPacket *pkt = pool.get(512);
+    a->set(1, pkt);
+    WVFAIL(a->block(1));
+
+    // The same file through another descriptor is the same entry; a
+    // different blksize isn't.
+    WVPASS(TFTPSharedFile::get(list, fd2, 512, 4) == a);
+    TFTPSharedFile *c = TFTPSharedFile::get(list, fd2, 1024, 4);
+    WVPASS(c != a);
+    a->set(1, pkt);
+    WVPASS(a->block(1) == pkt);
+    pkt->release();
+
+    c->release();
+    a->release();
+    WVPASS(list == a);
+
+    // Down to one reader and back to two: the same ring, still full.
+    WVPASS(TFTPSharedFile::get(list, fd2, 512, 4) == a);
+    WVPASS(a->block(1) == pkt);
+    a->release();
+
+    a->release();
+    WVFAIL(list);
+
+    close(fd);
+    close(fd2);
+    unlink(name);
+}
+
+
+WVTEST_MAIN("send batch")
+{
+    TFTPPacketPool pool;
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    WVPASSEQ(bind(rx, (struct sockaddr *)&sin, sizeof(sin)), 0);
+    socklen_t len = sizeof(sin);
+    getsockname(rx, (struct sockaddr *)&sin, &len);
+
+    {
+        TFTPSendBatch batch;
+        for (int i = 1; i <= 3; i++)
+        {
+            TFTPPacket *pkt = pool.get(4);
+            pkt->sethdr(3, i);
+            memcpy(pkt->data, "data", 4);
+            pkt->len = 4;
+            batch.add((struct sockaddr *)&sin, sizeof(sin), pkt);
+            pkt->release();
+        }
+        WVFAIL(batch.full());
+        WVPASSEQ(batch.flush(tx), 0);
+        WVPASSEQ(batch.flush(tx), 0);
+    }
+
+    for (int i = 1; i <= 3; i++)
+    {
+        unsigned char buf[16];
+        WVPASSEQ((int)recv(rx, buf, sizeof(buf), MSG_DONTWAIT), 8);
+        WVPASSEQ(buf[3], i);
+        WVPASS(!memcmp(buf + 4, "data", 4));
+    }
+    close(rx);
+    close(tx);
+}
+
+
+WVTEST_MAIN("mapped file blocks")
+{
+    TFTPPacketPool pool;
+    TFTPMappedFile *list = NULL;
+    char name[] = "/tmp/wvtftpmapped.XXXXXX";
+    int fd = mkstemp(name);
+    WVPASS(fd >= 0);
+
+    // Nothing to map yet.
+    WVFAIL(TFTPMappedFile::get(list, fd));
+    write(fd, "0123456789", 10);
+
+    TFTPMappedFile *m = TFTPMappedFile::get(list, fd);
+    WVPASS(m);
+    int fd2 = open(name, O_RDONLY);
+    WVPASS(TFTPMappedFile::get(list, fd2) == m);
+    m->release();
+
+    // Any blksize slices the same pages.
+    TFTPPacket *pkt = m->slice(pool, 4, 4);
+    WVPASSEQ((int)pkt->len, 4);
+    WVPASS(!memcmp(pkt->data, "4567", 4));
+    TFTPPacket *last = m->slice(pool, 6, 6);
+    WVPASSEQ((int)last->len, 4);
+    WVPASS(!memcmp(last->data, "6789", 4));
+    TFTPPacket *past = m->slice(pool, 10, 5);
+    WVPASSEQ((int)past->len, 0);
+    past->release();
+
+    // The packets keep the file mapped after everyone else has let go.
+    m->release();
+    WVPASS(list == m);
+    WVPASS(!memcmp(pkt->data, "4567", 4));
+    pkt->release();
+    last->release();
+    WVFAIL(list);
+
+    // Recycled, the buffer-less packet is an ordinary empty one.
+    pkt = pool.get(0);
+    WVFAIL(pkt->data);
+    pkt->release();
+
+    close(fd);
+    close(fd2);
+    unlink(name);
+}
+
+
+WVTEST_MAIN("mapped file truncated in place")
+{
+    TFTPMappedFile::catch_truncation();
+    TFTPMappedFile *list = NULL;
+    char name[] = "/tmp/wvtftpmapped.XXXXXX";
+    int fd = mkstemp(name);
+    WVPASS(fd >= 0);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    unsigned char *buf = new unsigned char[pagesize * 3];
+    memset(buf, 'x', pagesize * 3);
+    write(fd, buf, pagesize * 3);
+
+    TFTPMappedFile *m = TFTPMappedFile::get(list, fd);
+    WVPASS(m);
+    WVFAIL(m->truncated(pagesize * 3 - 1));
+
+    // Reading what's gone finds zeros rather than killing us.
+    ftruncate(fd, pagesize);
+    WVPASSEQ(m->bytes()[0], 'x');
+    WVPASSEQ(m->bytes()[pagesize * 2], 0);
+    WVPASS(m->truncated(0));
+
+    // A new mapping of the file starts out clean.
+    TFTPMappedFile *again = TFTPMappedFile::get(list, fd);
+    WVPASS(again && again != m);
+    WVFAIL(again->truncated(pagesize - 1));
+    again->release();
+    m->release();
+
+    delete[] buf;
+    close(fd);
+    unlink(name);
+}
@@ -0,0 +1,87 @@
+#include "wvtest.h"
+#include "../wvtftpparse.h"
+#include <string.h>
+
+#define PARSE(lit, req) tftp_parse_request(lit, sizeof(lit) - 1, req)
+
+WVTEST_MAIN("request parsing")
+{
+    TFTPRequest req;
+    static const char rrq[] = "\0\1boot/pxelinux.0\0OcTeT\0"
+        "BLKSIZE\0" "1432\0windowsize\0" "4\0tsize\0" "0\0blksize\0" "512\0";
+
+    WVPASSEQ(PARSE(rrq, req), 0);
+    WVPASSEQ(req.opcode, 1);
+    WVPASSEQ(req.filename.str, "boot/pxelinux.0");
+    WVPASSEQ((int)req.filename.len, 15);
+    WVPASSEQ(req.mode, TFTP_MODE_OCTET);
+
+    // The repeated blksize is dropped; the unknown option is kept.
+    WVPASSEQ(req.nopts, 3);
+    WVPASSEQ(req.opts[0].id, TFTP_OPT_BLKSIZE);
+    WVPASSEQ(req.opts[0].value.str, "1432");
+    WVPASSEQ(req.opts[1].id, TFTP_OPT_UNKNOWN);
+    WVPASSEQ(req.opts[1].name.str, "windowsize");
+    WVPASSEQ(req.known[TFTP_OPT_BLKSIZE], 0);
+    WVPASSEQ(req.known[TFTP_OPT_TSIZE], 2);
+    WVPASSEQ(req.known[TFTP_OPT_TIMEOUT], -1);
+
+    // Trailing padding is fine.
+    WVPASSEQ(PARSE("\0\2x\0netascii\0\0\0\0", req), 0);
+    WVPASSEQ(req.opcode, 2);
+    WVPASSEQ(req.mode, TFTP_MODE_NETASCII);
+    WVPASSEQ(req.nopts, 0);
+}
+
+
+WVTEST_MAIN("malformed requests")
+{
+    TFTPRequest req;
+
+    // Not requests at all: dropped silently.
+    WVPASSEQ(PARSE("", req), -1);
+    WVPASSEQ(PARSE("\0\4\0\1", req), -1);
+
+    // Requests, but broken.
+    WVPASSEQ(PARSE("\0\1file", req), 4);
+    WVPASSEQ(PARSE("\0\1file\0octet", req), 4);
+    WVPASSEQ(PARSE("\0\1file\0", req), 4);
+    WVPASSEQ(PARSE("\0\1file\0binary\0", req), 4);
+    WVPASSEQ(req.mode, TFTP_MODE_UNKNOWN);
+    WVPASSEQ(req.mode_str.str, "binary");
+    WVPASSEQ(PARSE("\0\1file\0octet\0blksize\0", req), 8);
+
+    char big[TFTP_MAX_REQUEST + 10];
+    memset(big, 'a', sizeof(big));
+    big[0] = 0;
+    big[1] = 1;
+    big[10] = 0;
+    memcpy(big + sizeof(big) - 7, "octet", 6);
+    WVPASSEQ(tftp_parse_request(big, sizeof(big), req), 4);
+}
+
+
+WVTEST_MAIN("option values")
+{
+    unsigned long long val;
+    TFTPStrView v;
+
+#define UINT(s, max) (v.str = s, v.len = strlen(s), \
+                      tftp_parse_uint(v, max, val))
+    WVPASS(UINT("1432", 65464));
+    WVPASSEQ((int)val, 1432);
+    WVPASS(UINT("0", 10));
+    WVPASS(UINT("65464", 65464));
+    WVFAIL(UINT("65465", 65464));
+    WVFAIL(UINT("", 10));
+    WVFAIL(UINT("-1", 10));
+    WVFAIL(UINT(" 5", 10));
+    WVFAIL(UINT("12x", 100));
+    WVFAIL(UINT("99999999999999999999999", ~0ULL));
+
+    WVPASSEQ(tftp_option_id("TSize", 5), TFTP_OPT_TSIZE);
+    WVPASSEQ(tftp_option_id("tsize", 4), TFTP_OPT_UNKNOWN);
+    WVPASSEQ(tftp_mode_id("MAIL", 4), TFTP_MODE_MAIL);
+    WVPASSEQ(tftp_option_name(TFTP_OPT_BLKSIZE), "blksize");
+    WVPASSEQ(tftp_option_id("BlkOffset", 9), TFTP_OPT_BLKOFFSET);
+}
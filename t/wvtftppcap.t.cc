@@ -0,0 +1,65 @@
+#include "wvtest.h"
+#include "wvaddr.h"
+#include "../wvtftppcap.h"
+#include <string.h>
+#include <unistd.h>
+
+WVTEST_MAIN("pcap capture round trip")
+{
+    WvString path("/tmp/wvtftpd-pcap.%s", getpid());
+    WvIPPortAddr client("192.168.1.7:2070"), server("10.0.0.1:69");
+    struct timeval tv = { 1000, 250 };
+
+    {
+        TFTPPcapWriter w(path);
+        WVPASS(w.isok());
+        w.record(tv, client, server, "\0\1boot\0octet", 13);
+
+        // Header and payload in separate pieces, the way send_pkt() has
+        // them.
+        struct iovec iov[2];
+        iov[0].iov_base = (void *)"\0\3\0\1";
+        iov[0].iov_len = 4;
+        iov[1].iov_base = (void *)"data";
+        iov[1].iov_len = 4;
+        tv.tv_usec = 500;
+        w.recordv(tv, server, client, iov, 2);
+    }
+
+    TFTPPcapReader r(path);
+    WVPASS(r.isok());
+
+    WvIPPortAddr src, dst;
+    const unsigned char *data;
+    size_t len;
+    WVPASS(r.next(tv, src, dst, data, len));
+    WVPASSEQ((int)tv.tv_sec, 1000);
+    WVPASSEQ((int)tv.tv_usec, 250);
+    WVPASS(src == client);
+    WVPASS(dst == server);
+    WVPASSEQ((int)len, 13);
+    WVPASS(!memcmp(data, "\0\1boot\0octet", 13));
+
+    WVPASS(r.next(tv, src, dst, data, len));
+    WVPASSEQ((int)tv.tv_usec, 500);
+    WVPASS(src == server);
+    WVPASSEQ((int)dst.port, 2070);
+    WVPASSEQ((int)len, 8);
+    WVPASS(!memcmp(data, "\0\3\0\1data", 8));
+
+    WVFAIL(r.next(tv, src, dst, data, len));
+    unlink(path);
+}
+
+
+WVTEST_MAIN("pcap reader rejects other formats")
+{
+    WvString path("/tmp/wvtftpd-pcap.%s", getpid());
+    FILE *f = fopen(path, "wb");
+    fputs("this is not a capture file at all", f);
+    fclose(f);
+
+    TFTPPcapReader r(path);
+    WVFAIL(r.isok());
+    unlink(path);
+}
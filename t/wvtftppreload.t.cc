@@ -0,0 +1,62 @@
+#include "wvtest.h"
+#include "../wvtftppreload.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int temp_file(char *name, size_t size)
+{
+    int fd = mkstemp(name);
+    char buf[4096];
+    memset(buf, 'p', sizeof(buf));
+    for (size_t pos = 0; pos < size; pos += sizeof(buf))
+        write(fd, buf, size - pos < sizeof(buf) ? size - pos : sizeof(buf));
+    return fd;
+}
+
+
+WVTEST_MAIN("preload")
+{
+    TFTPMappedFile *maps = NULL;
+    char a[] = "/tmp/wvtftppreload.XXXXXX", b[] = "/tmp/wvtftppreload.XXXXXX";
+    int fda = temp_file(a, 100000), fdb = temp_file(b, 3000);
+
+    {
+        TFTPPreload p(maps, false, false);
+        WVPASS(p.add(a));
+        WVPASS(p.add(b));
+        WVPASS(p.add(a));
+        WVFAIL(p.add("/tmp"));
+        WVFAIL(p.add("/nonexistent/file"));
+        WVPASSEQ(p.count(), 2);
+        WVPASSEQ((int)p.bytes(), 103000);
+
+        // Transfers of the file get the preloaded mapping.
+        TFTPMappedFile *m = TFTPMappedFile::get(maps, fda);
+        WVPASS(m);
+        if (m)
+        {
+            WVPASSEQ((int)m->size(), 100000);
+            m->release();
+        }
+
+        WVPASS(p.start());
+        int pending, ms, unlocked;
+        off_t loaded;
+        for (int i = 0; i < 500 && !p.progress(pending, loaded, ms, unlocked);
+             i++)
+            usleep(10000);
+        WVPASS(p.progress(pending, loaded, ms, unlocked));
+        WVPASSEQ(pending, 0);
+        WVPASSEQ((int)loaded, 103000);
+        WVPASSEQ(unlocked, 0);
+        WVPASS(maps);
+    }
+    WVFAIL(maps);
+
+    close(fda);
+    close(fdb);
+    unlink(a);
+    unlink(b);
+}
@@ -0,0 +1,128 @@
+#include "wvtest.h"
+#include "../wvtftpsched.h"
+
+static struct timeval at(int ms)
+{
+    struct timeval tv = { 1000 + ms / 1000, (ms % 1000) * 1000 };
+    return tv;
+}
+
+
+static void fill(TFTPPacketPool &pool, TFTPSchedFlow &flow, int n)
+{
+    for (int i = 1; i <= n; i++)
+    {
+        TFTPPacket *pkt = pool.get(996);
+        pkt->len = 996;
+        flow.enqueue(pkt, pkt->pktlen(), i);
+        pkt->release();
+    }
+}
+
+
+WVTEST_MAIN("deficit round-robin weights")
+{
+    TFTPPacketPool pool;
+    TFTPScheduler sched;
+    sched.set_quantum(1000);
+    WvIPPortAddr a("10.0.0.1:1000"), b("10.0.0.2:1000");
+
+    TFTPSchedFlow fa(&sched, a, 1), fb(&sched, b, 3);
+    fill(pool, fa, 40);
+    fill(pool, fb, 40);
+    WVPASSEQ((int)sched.backlog(), 80000);
+
+    // Without a rate limit everything is ready at once, in DRR order.
+    int from_a = 0, from_b = 0;
+    for (int i = 0; i < 20; i++)
+    {
+        WvIPPortAddr dest;
+        int num;
+        TFTPPacket *pkt = sched.dequeue(at(0), dest, num);
+        WVPASS(pkt);
+        if (!pkt)
+            break;
+        if (dest == a)
+            from_a++;
+        else
+            from_b++;
+        pkt->release();
+    }
+    WVPASSEQ(from_a, 5);
+    WVPASSEQ(from_b, 15);
+    WVPASSEQ(fa.pending(), 35);
+    WVPASSEQ((int)sched.backlog(), 60000);
+}
+
+
+WVTEST_MAIN("rate limit")
+{
+    TFTPPacketPool pool;
+    TFTPScheduler sched;
+    sched.set_rate(10000, 2000);
+    WVPASS(sched.enabled());
+    WvIPPortAddr a("10.0.0.1:1000");
+    WVPASSEQ(sched.wait(at(0)), -1);
+
+    TFTPSchedFlow f(&sched, a, 1);
+    fill(pool, f, 10);
+
+    // The bucket starts full: two packets, then one per 100ms.
+    WvIPPortAddr dest;
+    int num;
+    TFTPPacket *pkt;
+    for (int i = 1; i <= 2; i++)
+    {
+        pkt = sched.dequeue(at(0), dest, num);
+        WVPASS(pkt);
+        WVPASSEQ(num, i);
+        if (pkt)
+            pkt->release();
+    }
+    WVFAIL(sched.dequeue(at(0), dest, num));
+    WVPASSEQ(sched.wait(at(0)), 101);
+    WVFAIL(sched.dequeue(at(50), dest, num));
+
+    pkt = sched.dequeue(at(100), dest, num);
+    WVPASS(pkt);
+    WVPASSEQ(num, 3);
+    if (pkt)
+        pkt->release();
+}
+
+
+WVTEST_MAIN("flows leaving the rotation")
+{
+    TFTPPacketPool pool;
+    TFTPScheduler sched;
+    sched.set_quantum(1000);
+    WvIPPortAddr a("10.0.0.1:1000"), b("10.0.0.2:1000"), c("10.0.0.3:1000");
+
+    TFTPSchedFlow fa(&sched, a, 1);
+    TFTPSchedFlow *fb = new TFTPSchedFlow(&sched, b, 1);
+    TFTPSchedFlow fc(&sched, c, 1);
+    fill(pool, fa, 2);
+    fill(pool, *fb, 2);
+    fill(pool, fc, 2);
+
+    WvIPPortAddr dest;
+    int num;
+    TFTPPacket *pkt = sched.dequeue(at(0), dest, num);
+    WVPASS(dest == a);
+    pkt->release();
+
+    // b is next in line when it goes away, packets and all.
+    delete fb;
+    WVPASSEQ((int)sched.backlog(), 3000);
+
+    int n = 0;
+    while ((pkt = sched.dequeue(at(0), dest, num)) != NULL)
+    {
+        WVFAIL(dest == b);
+        pkt->release();
+        n++;
+    }
+    WVPASSEQ(n, 3);
+    WVPASSEQ((int)sched.backlog(), 0);
+    WVPASSEQ(sched.wait(at(0)), -1);
+}
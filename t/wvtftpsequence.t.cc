@@ -0,0 +1,99 @@
+#include "wvtest.h"
+#include "../wvtftpsequence.h"
+#include <stdio.h>
+
+static const char *boot[] = {
+    "pxelinux.0", "ldlinux.c32", "pxelinux.cfg/default", "vmlinuz", "initrd"
+};
+
+
+// Client 'addr' asks for the whole of 'boot'.
+static void boot_client(TFTPSequence &seq, uint32_t addr, uint32_t cls,
+                        time_t now)
+{
+    TFTPSequence::Outcome outcome;
+    for (int i = 0; i < 5; i++)
+        seq.request(addr, cls, boot[i], now, outcome);
+}
+
+
+WVTEST_MAIN("learned sequence")
+{
+    TFTPSequence seq(1 << 20, 50);
+    TFTPSequence::Outcome outcome;
+
+    // Nothing to go on yet.
+    WVFAIL(seq.request(1, 100, "pxelinux.0", 1000, outcome));
+    WVPASSEQ(outcome, TFTPSequence::UNPREDICTED);
+
+    boot_client(seq, 2, 100, 1000);
+    boot_client(seq, 3, 100, 1000);
+    WVPASSEQ(seq.count(), 4);
+
+    // The next one is a step ahead all the way through.
+    const char *next = seq.request(4, 100, "pxelinux.0", 1000, outcome);
+    WVPASSEQ(next, "ldlinux.c32");
+    for (int i = 1; i < 4; i++)
+    {
+        next = seq.request(4, 100, boot[i], 1001, outcome);
+        WVPASSEQ(outcome, TFTPSequence::HIT);
+        WVPASSEQ(next, boot[i + 1]);
+    }
+    seq.request(4, 100, "memtest", 1002, outcome);
+    WVPASSEQ(outcome, TFTPSequence::MISS);
+
+    // Another subnet hasn't been seen doing it.
+    WVFAIL(seq.request(5, 200, "pxelinux.0", 1000, outcome));
+
+    // Long enough after, it's a new boot rather than the next step.
+    seq.request(4, 100, "pxelinux.0", 2000, outcome);
+    WVPASSEQ(outcome, TFTPSequence::UNPREDICTED);
+}
+
+
+WVTEST_MAIN("sequence guesses need a majority")
+{
+    TFTPSequence seq(1 << 20, 60);
+    TFTPSequence::Outcome outcome;
+
+    // Half go one way and half the other: no guess.
+    for (uint32_t addr = 1; addr <= 4; addr++)
+    {
+        seq.request(addr, 1, "menu", 1000, outcome);
+        seq.request(addr, 1, addr % 2 ? "linux" : "windows", 1000, outcome);
+    }
+    WVFAIL(seq.request(10, 1, "menu", 1000, outcome));
+
+    // Then most go one way.
+    for (uint32_t addr = 20; addr < 24; addr++)
+    {
+        seq.request(addr, 1, "menu", 1000, outcome);
+        seq.request(addr, 1, "linux", 1000, outcome);
+    }
+    WVPASSEQ(seq.request(11, 1, "menu", 1000, outcome), "linux");
+}
+
+
+WVTEST_MAIN("sequence memory budget")
+{
+    TFTPSequence big(1 << 20, 50);
+    size_t base = big.memory();
+
+    // Room for the clients and a little more.
+    TFTPSequence seq(base + 4096, 50);
+    char name[32];
+    TFTPSequence::Outcome outcome;
+    for (uint32_t addr = 1; addr < 500; addr++)
+    {
+        snprintf(name, sizeof(name), "config-%u", addr);
+        seq.request(addr, 1, "pxelinux.0", 1000, outcome);
+        seq.request(addr, 1, name, 1000, outcome);
+        boot_client(seq, addr, 1, 1000);
+        WVPASS(seq.memory() <= base + 4096 + 1024 * 64);
+    }
+
+    // What's common survives forgetting the one-offs.
+    WVPASS(seq.count() > 0);
+    WVPASS(seq.count() < 500);
+    WVPASSEQ(seq.request(1000, 1, "vmlinuz", 1000, outcome), "initrd");
+}
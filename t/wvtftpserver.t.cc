@@ -5,8 +5,14 @@
 #include "wvistreamlist.h"
 #include "wvstrutils.h"
 #include "wvtest.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
 #define private public
+#define protected public
 #include "../wvtftpserver.h"
+#undef protected
 #undef private
 
 #define PACKETS_EQ(ref_packet,rcvd_packet)                              \
@@ -549,3 +555,493 @@ WVTEST_MAIN("write protocol")
     WvIStreamList::globallist.unlink(tester.tftp_server);
     WvIStreamList::globallist.unlink(&udp);
 }
+
+
+WVTEST_MAIN("resent read request")
+{
+    WvTftpServerTester tester;
+    WvIStreamList::globallist.append(tester.tftp_server, false, "TFTP server");
+
+    WvUDPStream udp("127.0.0.1", "127.0.0.1:6969");
+    WVPASS(udp.isok());
+    WvIStreamList::globallist.append(&udp, false, "TFTP client");
+
+    while (!udp.iswritable())
+        WvIStreamList::globallist.runonce();
+
+    tester.create_file("foo", 768);
+
+    TftpPacket *packet = NULL;
+    TftpPacket rcvd_packet;
+    unsigned char databuf[512];
+    for (unsigned int i = 0; i < 512; i++)
+        databuf[i] = i;
+
+    // With the default prefetch of 3 the whole file goes out at once.
+    TftpPacket *rrq = rq_packet(WvTFTPBase::tftpread, "foo",
+                                WvTFTPBase::octet);
+    udp.write(rrq->packet, rrq->length);
+    for (int copy = 0; copy < 2; copy++)
+    {
+        get_response_packet(udp, *tester.tftp_server, rcvd_packet);
+        packet = data_packet(1, databuf, 512);
+        PACKETS_EQ(packet, rcvd_packet);
+        WVDELETE(packet);
+
+        get_response_packet(udp, *tester.tftp_server, rcvd_packet);
+        packet = data_packet(2, databuf, 256);
+        PACKETS_EQ(packet, rcvd_packet);
+        WVDELETE(packet);
+
+        // As if the client had lost both: the same transfer, sent again.
+        if (!copy)
+            udp.write(rrq->packet, rrq->length);
+    }
+
+    WVPASSEQ((int)tester.tftp_server->stats.duplicate_requests, 1);
+    WVPASSEQ((int)tester.tftp_server->stats.started[TFTPStats::READ], 1);
+    WVPASSEQ((int)tester.tftp_server->stats.retransmits, 2);
+    WVPASSEQ((int)tester.tftp_server->conns.count(), 1);
+
+    // Once a block is acknowledged, the same request starts over.
+    packet = ack_packet(1);
+    udp.write(packet->packet, packet->length);
+    WVDELETE(packet);
+    udp.write(rrq->packet, rrq->length);
+    get_response_packet(udp, *tester.tftp_server, rcvd_packet);
+    packet = data_packet(1, databuf, 512);
+    PACKETS_EQ(packet, rcvd_packet);
+    WVDELETE(packet);
+    WVPASSEQ((int)tester.tftp_server->stats.duplicate_requests, 1);
+    WVPASSEQ((int)tester.tftp_server->stats.started[TFTPStats::READ], 2);
+
+    WVDELETE(rrq);
+    WvIStreamList::globallist.unlink(tester.tftp_server);
+    WvIStreamList::globallist.unlink(&udp);
+}
+
+
+static void deliver(WvTFTPServer &server, WvStringParm from,
+                    TftpPacket *pkt)
+{
+    memcpy(server.packet, pkt->packet, pkt->length);
+    server.packetsize = pkt->length;
+    server.remaddr = WvIPPortAddr(from);
+    server.process_packet();
+    delete pkt;
+}
+
+
+static void request(WvTFTPServer &server, WvStringParm from,
+                    WvStringParm filename)
+{
+    deliver(server, from, rq_packet(WvTFTPBase::tftpread, filename,
+                                    WvTFTPBase::octet));
+}
+
+
+WVTEST_MAIN("admission queue")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    tester.cfg["TFTP/Max Active"].setmeint(1);
+    tester.cfg["TFTP/Queue Length"].setmeint(2);
+    tester.cfg["TFTP/Small File KB"].setmeint(1);
+    tester.create_file("image", 4096);
+    tester.create_file("image2", 4096);
+    tester.create_file("loader", 512);
+
+    request(server, "127.0.0.1:2001", "image");
+    request(server, "127.0.0.1:2002", "image2");
+    request(server, "127.0.0.1:2003", "loader");
+    WVFAIL(server.conns[WvIPPortAddr("127.0.0.1:2001")]->queued);
+    WVPASS(server.conns[WvIPPortAddr("127.0.0.1:2002")]->queued);
+    WVPASS(server.conns[WvIPPortAddr("127.0.0.1:2003")]->queued);
+    WVPASSEQ((int)server.stats.started[TFTPStats::READ], 1);
+
+    // The queue is full.
+    request(server, "127.0.0.1:2004", "loader");
+    WVFAIL(server.conns[WvIPPortAddr("127.0.0.1:2004")]);
+    WVPASSEQ((int)server.stats.rejected, 1);
+
+    // Resending a queued request changes nothing.
+    request(server, "127.0.0.1:2003", "loader");
+    WVPASS(server.conns[WvIPPortAddr("127.0.0.1:2003")]->queued);
+    WVPASSEQ((int)server.stats.duplicate_requests, 1);
+
+    // The small file goes next, though it was asked for last.
+    server.abort_conn(WvIPPortAddr("127.0.0.1:2001"));
+    WVPASSEQ((int)server.stats.aborted[TFTPStats::ABORT_ADMIN], 1);
+    WVFAIL(server.conns[WvIPPortAddr("127.0.0.1:2003")]->queued);
+    WVPASS(server.conns[WvIPPortAddr("127.0.0.1:2002")]->queued);
+    WVPASSEQ((int)server.stats.started[TFTPStats::READ], 2);
+    WVPASSEQ(server.nqueued, 1);
+}
+
+
+// A read request followed by the 'optlen' bytes of options in 'opts'.
+static TftpPacket *opt_rq_packet(WvStringParm filename, const char *opts,
+                                 size_t optlen)
+{
+    TftpPacket *rrq = rq_packet(WvTFTPBase::tftpread, filename,
+                                WvTFTPBase::octet);
+    unsigned char *packet = new unsigned char[rrq->length + optlen];
+    memcpy(packet, rrq->packet, rrq->length);
+    memcpy(packet + rrq->length, opts, optlen);
+    deletev rrq->packet;
+    rrq->packet = packet;
+    rrq->length += optlen;
+    return rrq;
+}
+
+#define OPT_RQ(filename, opts) opt_rq_packet(filename, opts, sizeof(opts))
+
+// With an empty value, as clients send it.
+static const char mcast_opt[] = "multicast\0";
+
+
+// Returns the number of DATA packets waiting on 'fd'.
+static int count_data(int fd)
+{
+    int n = 0;
+    unsigned char buf[516];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (poll(&pfd, 1, 200) > 0)
+    {
+        if (recv(fd, buf, sizeof(buf), 0) >= 4
+            && buf[1] == WvTFTPBase::DATA)
+            n++;
+    }
+    return n;
+}
+
+
+WVTEST_MAIN("multicast")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    tester.cfg["TFTP/Multicast Group"].setme("239.255.69.69");
+    tester.cfg["TFTP/Multicast Port"].setmeint(16969);
+    tester.cfg["TFTP/Multicast Interface"].setme("127.0.0.1");
+    tester.create_file("image", 768);
+
+    // Listen to the group over loopback, as a client would.
+    int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(16969);
+    inet_aton("239.255.69.69", &sin.sin_addr);
+    WVPASS(bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0);
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = sin.sin_addr;
+    inet_aton("127.0.0.1", &mreq.imr_interface);
+    WVPASS(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                      sizeof(mreq)) == 0);
+
+    WvIPPortAddr a("127.0.0.1:2001"), b("127.0.0.1:2002");
+    deliver(server, "127.0.0.1:2001", OPT_RQ("image", mcast_opt));
+    deliver(server, "127.0.0.1:2002", OPT_RQ("image", mcast_opt));
+    WVPASS(server.conns[a]->mcast);
+    WVFAIL(server.conns[a]->passive);
+    WVPASS(server.conns[b]->passive);
+    WVPASS(server.conns[a]->mcast == server.conns[b]->mcast);
+    const char *value = (const char *)server.conns[b]->oack->data + 10;
+    WVPASSEQ(value, "239.255.69.69,16969,0");
+
+    // Both blocks go to the group once, for everyone.
+    deliver(server, "127.0.0.1:2001", ack_packet(0));
+    WVPASSEQ(count_data(fd), 2);
+    WVPASSEQ((int)server.stats.bytes_sent, 768);
+
+    // The master is done, so the other client takes over.  It missed the
+    // second block, which it gets by itself.
+    deliver(server, "127.0.0.1:2001", ack_packet(1));
+    deliver(server, "127.0.0.1:2001", ack_packet(2));
+    WVFAIL(server.conns[a]);
+    WVFAIL(server.conns[b]->passive);
+    WVPASSEQ(value, "239.255.69.69,16969,1");
+    deliver(server, "127.0.0.1:2002", ack_packet(1));
+    WVPASSEQ(count_data(fd), 0);
+    WVPASSEQ((int)server.stats.bytes_sent, 1024);
+    deliver(server, "127.0.0.1:2002", ack_packet(2));
+    WVFAIL(server.conns[b]);
+    WVFAIL(server.mcast_sessions);
+
+    close(fd);
+}
+
+
+WVTEST_MAIN("idle multicast session")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    tester.cfg["TFTP/Multicast Group"].setme("239.255.69.69");
+    tester.cfg["TFTP/Multicast Port"].setmeint(16969);
+    tester.cfg["TFTP/Multicast Interface"].setme("127.0.0.1");
+    tester.cfg["TFTP/Total Timeout Seconds"].setmeint(5);
+    tester.create_file("image", 768);
+
+    WvIPPortAddr a("127.0.0.1:2001"), b("127.0.0.1:2002");
+    deliver(server, "127.0.0.1:2001", OPT_RQ("image", mcast_opt));
+    deliver(server, "127.0.0.1:2002", OPT_RQ("image", mcast_opt));
+    WVPASS(server.conns[b]->passive);
+
+    // The listener has said nothing since it joined, but the session is
+    // going, so it stays.
+    server.conns[b]->last_received.tv_sec -= 10;
+    server.check_timeouts();
+    WVPASS(server.conns[a]);
+    WVPASS(server.conns[b]);
+
+    // Once the master has been quiet for long enough, the whole group goes.
+    server.conns[a]->last_received.tv_sec -= 10;
+    server.conns[a]->mcast->active.tv_sec -= 10;
+    server.check_timeouts();
+    WVFAIL(server.conns[a]);
+    WVFAIL(server.conns[b]);
+    WVFAIL(server.mcast_sessions);
+    WVPASSEQ((int)server.stats.aborted[TFTPStats::ABORT_IDLE], 2);
+}
+
+
+WVTEST_MAIN("block number rollover")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    // Enough 8-byte blocks to wrap the 16-bit counter, and then some.
+    int nblocks = 65541;
+    tester.create_file("image", (nblocks - 1) * 8 + 3);
+
+    WvIPPortAddr a("127.0.0.1:2001");
+    deliver(server, "127.0.0.1:2001", OPT_RQ("image", "blksize\0" "8"));
+    WVPASS(server.conns[a]);
+    deliver(server, "127.0.0.1:2001", ack_packet(0));
+
+    // Acknowledging every other block, the window straddles the wrap: the
+    // ACK for 65536 (0 on the wire) arrives while 65535 is still the
+    // first unacknowledged block.
+    int wrong = 0;
+    for (int n = 2; n < nblocks; n += 2)
+    {
+        deliver(server, "127.0.0.1:2001", ack_packet(n % 65536));
+        if (!server.conns[a] || server.conns[a]->unack != n + 1)
+        {
+            wrong++;
+            break;
+        }
+    }
+    WVPASSEQ(wrong, 0);
+    deliver(server, "127.0.0.1:2001", ack_packet(nblocks % 65536));
+    WVFAIL(server.conns[a]);
+    WVPASSEQ((int)server.stats.completed[TFTPStats::READ], 1);
+    WVPASSEQ((int)server.stats.bytes_sent, (nblocks - 1) * 8 + 3);
+}
+
+
+WVTEST_MAIN("blksize clamping")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    tester.cfg["TFTP/Subnet MTU/127.0.0.0/8"].setmeint(1500);
+    tester.cfg["TFTP/Subnet MTU/127.0.0.2/32"].setmeint(9000);
+    tester.create_file("image", 65536);
+
+    // An Ethernet segment: the OACK offers what fits in 1500 bytes.
+    WvIPPortAddr a("127.0.0.1:2001"), b("127.0.0.2:2002");
+    deliver(server, "127.0.0.1:2001", OPT_RQ("image", "blksize\0" "8192"));
+    WVPASS(server.conns[a]);
+    if (server.conns[a])
+    {
+        WVPASSEQ((int)server.conns[a]->blksize, 1468);
+        WVPASSEQ((const char *)server.conns[a]->oack->data + 8, "1468");
+    }
+
+    // Jumbo frames on this one, so the request stands.
+    deliver(server, "127.0.0.2:2002", OPT_RQ("image", "blksize\0" "8192"));
+    WVPASS(server.conns[b]);
+    if (server.conns[b])
+        WVPASSEQ((int)server.conns[b]->blksize, 8192);
+
+    // Smaller requests are never raised.
+    WvIPPortAddr c("127.0.0.1:2003");
+    deliver(server, "127.0.0.1:2003", OPT_RQ("image", "blksize\0" "512"));
+    WVPASS(server.conns[c]);
+    if (server.conns[c])
+        WVPASSEQ((int)server.conns[c]->blksize, 512);
+}
+
+
+WVTEST_MAIN("hand-off to another process")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    tester.cfg["TFTP/Prefetch"].setmeint(1);
+    tester.create_file("image", 1280);
+    tester.create_file("my image", 768);
+
+    // One part way through, one still waiting for its OACK to be seen.
+    WvIPPortAddr a("127.0.0.1:2001"), b("127.0.0.1:2002");
+    request(server, "127.0.0.1:2001", "image");
+    deliver(server, "127.0.0.1:2001", ack_packet(1));
+    deliver(server, "127.0.0.1:2002", OPT_RQ("my image", "blksize\0" "256"));
+    WVPASSEQ(server.conns[a]->lastsent, 2);
+
+    char name[] = "/tmp/wvtftpstate.XXXXXX";
+    int fd = mkstemp(name);
+    unlink(name);
+    WVPASSEQ(server.save_transfers(fd), 2);
+    lseek(fd, 0, SEEK_SET);
+
+    // The new process shares the socket the old one had.
+    WvTFTPServer *next = new WvTFTPServer(tester.cfg, 100,
+                                          dup(server.getfd()));
+    WVPASS(next->isok());
+    WVPASSEQ(next->localaddr.port, 6969);
+    WVPASSEQ(next->resume_transfers(fd), 2);
+    close(fd);
+    WVFAIL(next->resume_conn("junk"));
+
+    WvTFTPServer::TFTPConn *c = next->conns[a];
+    WVPASS(c);
+    if (c)
+    {
+        WVPASSEQ(c->filename, server.conns[a]->filename);
+        WVPASSEQ(c->unack, 2);
+        WVPASSEQ(c->lastsent, 2);
+        WVPASSEQ((int)c->filesize, 1280);
+    }
+    c = next->conns[b];
+    WVPASS(c);
+    if (c)
+    {
+        WVPASSEQ((int)c->blksize, 256);
+        WVPASS(c->send_oack);
+        WVPASS(c->oack && c->oack->len == server.conns[b]->oack->len
+               && !memcmp(c->oack->data, server.conns[b]->oack->data,
+                          c->oack->len));
+    }
+    WVRELEASE(tester.tftp_server);
+    tester.tftp_server = next;
+
+    // Both carry on where they were.
+    deliver(*next, "127.0.0.1:2001", ack_packet(2));
+    WVPASSEQ(next->conns[a]->lastsent, 3);
+    WVPASSEQ((int)next->stats.bytes_sent, 256);
+    deliver(*next, "127.0.0.1:2001", ack_packet(3));
+    WVFAIL(next->conns[a]);
+    deliver(*next, "127.0.0.1:2002", ack_packet(0));
+    WVPASSEQ(next->conns[b]->lastsent, 1);
+}
+
+
+WVTEST_MAIN("blkoffset")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    tester.cfg["TFTP/Prefetch"].setmeint(1);
+    tester.cfg["TFTP/Readonly"].setmeint(0);
+    tester.create_file("image", 1280);
+
+    // The client has two blocks already: the OACK says it may skip them,
+    // and its ACK of block 2 brings the third.
+    WvIPPortAddr a("127.0.0.1:2001"), b("127.0.0.1:2002");
+    deliver(server, "127.0.0.1:2001", OPT_RQ("image", "blkoffset\0" "2"));
+    WVPASS(server.conns[a]);
+    if (server.conns[a])
+    {
+        WVPASS(server.conns[a]->send_oack);
+        WVPASSEQ((const char *)server.conns[a]->oack->data, "blkoffset");
+        WVPASSEQ((const char *)server.conns[a]->oack->data + 10, "2");
+    }
+    deliver(server, "127.0.0.1:2001", ack_packet(2));
+    WVPASSEQ((int)server.stats.bytes_sent, 256);
+    deliver(server, "127.0.0.1:2001", ack_packet(3));
+    WVFAIL(server.conns[a]);
+    WVPASSEQ((int)server.stats.completed[TFTPStats::READ], 1);
+
+    // Past the end of the file.
+    deliver(server, "127.0.0.1:2002", OPT_RQ("image", "blkoffset\0" "3"));
+    WVFAIL(server.conns[b]);
+
+    // An upload carried on after its first block.
+    WvIPPortAddr w("127.0.0.1:2003"), x("127.0.0.1:2004");
+    WvString upload("%s/upload", tester.base_dir);
+    tester.create_file("upload", 512);
+    chmod(upload, 0666);
+    TftpPacket *wrq = OPT_RQ("upload", "blkoffset\0" "1");
+    wrq->packet[1] = WvTFTPBase::WRQ;
+    deliver(server, "127.0.0.1:2003", wrq);
+    WVPASS(server.conns[w]);
+    if (server.conns[w])
+        WVPASSEQ(server.conns[w]->lastsent, 1);
+    unsigned char databuf[100];
+    memset(databuf, 'x', sizeof(databuf));
+    deliver(server, "127.0.0.1:2003", data_packet(2, databuf, 100));
+    WVFAIL(server.conns[w]);
+    struct stat st;
+    WVPASS(stat(upload, &st) == 0);
+    WVPASSEQ((int)st.st_size, 612);
+
+    // What's there has to be exactly the blocks the client says it sent.
+    wrq = OPT_RQ("upload", "blkoffset\0" "2");
+    wrq->packet[1] = WvTFTPBase::WRQ;
+    deliver(server, "127.0.0.1:2004", wrq);
+    WVFAIL(server.conns[x]);
+    WVPASS(stat(upload, &st) == 0);
+    WVPASSEQ((int)st.st_size, 612);
+}
+
+
+WVTEST_MAIN("corrupt gzip file")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    tester.cfg["TFTP/Prefetch"].setmeint(1);
+
+    // A gzip header and a trailer claiming 1024 bytes, around a deflate
+    // block of a type that doesn't exist.
+    static const unsigned char gz[] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3,
+        0xff, 0xff, 0xff, 0xff,
+        0, 0, 0, 0, 0x00, 0x04, 0, 0
+    };
+    WvFile f(WvString("%s/image.gz", tester.base_dir),
+             O_WRONLY | O_CREAT | O_TRUNC);
+    f.write(gz, sizeof(gz));
+    f.close();
+
+    // The client gets an error rather than an empty file.
+    WvIPPortAddr a("127.0.0.1:2001");
+    request(server, "127.0.0.1:2001", "image");
+    WVFAIL(server.conns[a]);
+    WVPASSEQ((int)server.stats.aborted[TFTPStats::ABORT_READ_ERROR], 1);
+    WVPASSEQ((int)server.stats.completed[TFTPStats::READ], 0);
+    WVPASSEQ((int)server.stats.bytes_sent, 0);
+
+    // Mail mode can't be read, gzipped or not.
+    WvIPPortAddr b("127.0.0.1:2002");
+    deliver(server, "127.0.0.1:2002",
+            rq_packet(WvTFTPBase::tftpread, "image", WvTFTPBase::mail));
+    WVFAIL(server.conns[b]);
+    WVPASSEQ((int)server.stats.rejected, 1);
+}
+
+
+WVTEST_MAIN("resent request answered at once")
+{
+    WvTftpServerTester tester;
+    WvTFTPServer &server = *tester.tftp_server;
+    tester.create_file("foo", 768);
+
+    request(server, "127.0.0.1:2001", "foo");
+    WVPASSEQ(server.batch.count, 0);
+
+    // The repeated window goes out now, not on the next tick.
+    request(server, "127.0.0.1:2001", "foo");
+    WVPASSEQ((int)server.stats.duplicate_requests, 1);
+    WVPASSEQ((int)server.stats.retransmits, 2);
+    WVPASSEQ(server.batch.count, 0);
+}
@@ -0,0 +1,35 @@
+#include "wvtest.h"
+#include "../wvtftpstats.h"
+#include "../wvtftpmetrics.h"
+
+WVTEST_MAIN("stats aggregation and export")
+{
+    TFTPStats a, b;
+    a.started[TFTPStats::READ] = 3;
+    b.started[TFTPStats::READ] = 4;
+    a.retransmits = 2;
+    a.shared_blocks = 3;
+    b.shared_misses = 1;
+    a.rtt.add(1);
+    a.rtt.add(7);
+    b.rtt.add(100000);
+
+    TFTPStats total(false);
+    TFTPStats::collect(total);
+    WVPASS(total.started[TFTPStats::READ] >= 7);
+    WVPASS(total.rtt.count >= 3);
+    WVPASS(total.shared_blocks >= 3);
+    WVPASS(total.shared_misses >= 1);
+
+    // 1 lands in the first bucket, 7 in "le 10" and 100000 in +Inf.
+    WVPASSEQ((int)a.rtt.counts[0], 1);
+    WVPASSEQ((int)a.rtt.counts[3], 1);
+    WVPASSEQ((int)b.rtt.counts[b.rtt.nbounds], 1);
+
+    WvString text = TFTPMetrics::format();
+    WVPASS(strstr(text, "# TYPE wvtftp_transfers_started_total counter"));
+    WVPASS(strstr(text, "wvtftp_transfers_started_total{direction=\"read\"}"));
+    WVPASS(strstr(text, "wvtftp_rtt_milliseconds_bucket{le=\"+Inf\"}"));
+    WVPASS(strstr(text, "wvtftp_data_retransmits_total"));
+    WVPASS(strstr(text, "wvtftp_shared_misses_total"));
+}
@@ -0,0 +1,68 @@
+#include "wvtest.h"
+#include "wvaddr.h"
+#include "../wvtftptrace.h"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+WVTEST_MAIN("trace ring dump")
+{
+    TFTPTrace *trace = new TFTPTrace;
+    WvString path("/tmp/wvtftpd-trace.%s", getpid());
+    trace->set_path(path);
+
+    WvIPPortAddr peer("192.168.1.1:1234");
+    trace->add(TRACE_RRQ, peer, 0, 512);
+    for (uint32_t i = 1; i <= TFTPTrace::SIZE + 10; i++)
+        trace->add(TRACE_DATA, peer, i, 512);
+    WVPASS(trace->dump());
+
+    FILE *f = fopen(path, "rb");
+    WVPASS(f);
+    TFTPTraceHeader hdr;
+    WVPASSEQ((int)fread(&hdr, sizeof(hdr), 1, f), 1);
+    WVPASSEQ((int)hdr.version, TFTP_TRACE_VERSION);
+    WVPASSEQ((int)hdr.nrecs, (int)TFTPTrace::SIZE);
+    WVPASSEQ((int)hdr.head, (int)TFTPTrace::SIZE + 11);
+
+    // The oldest surviving record is the one right after 'head'.
+    TFTPTraceRecord rec;
+    fseek(f, sizeof(hdr) + (hdr.head % hdr.nrecs) * sizeof(rec), SEEK_SET);
+    WVPASSEQ((int)fread(&rec, sizeof(rec), 1, f), 1);
+    WVPASSEQ((int)rec.type, TRACE_DATA);
+    WVPASSEQ((int)rec.block, 11);
+    WVPASSEQ((int)rec.port, 1234);
+    fclose(f);
+
+    unlink(path);
+    delete trace;
+}
+
+
+WVTEST_MAIN("trace dump replaces a symlink")
+{
+    TFTPTrace *trace = new TFTPTrace;
+    WvString path("/tmp/wvtftpd-trace.%s", getpid());
+    WvString victim("/tmp/wvtftpd-victim.%s", getpid());
+    trace->set_path(path);
+
+    FILE *f = fopen(victim, "w");
+    fputs("precious", f);
+    fclose(f);
+    unlink(path);
+    WVPASSEQ(symlink(victim, path), 0);
+
+    trace->add(TRACE_RRQ, WvIPPortAddr("192.168.1.1:1234"), 0, 512);
+    WVPASS(trace->dump());
+
+    // The link is gone, and what it pointed at is as it was.
+    struct stat st;
+    WVPASSEQ(lstat(path, &st), 0);
+    WVPASS(S_ISREG(st.st_mode));
+    WVPASSEQ(stat(victim, &st), 0);
+    WVPASSEQ((int)st.st_size, 8);
+
+    unlink(path);
+    unlink(victim);
+    delete trace;
+}
@@ -0,0 +1,134 @@
+#include "wvtest.h"
+#include "../wvtftpwarm.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int count_files(const char *dir)
+{
+    int n = 0;
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL)
+        if (e->d_name[0] != '.')
+            n++;
+    if (d)
+        closedir(d);
+    return n;
+}
+
+
+static void remove_all(const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d && (e = readdir(d)) != NULL)
+        if (e->d_name[0] != '.')
+            unlinkat(dirfd(d), e->d_name, 0);
+    if (d)
+        closedir(d);
+    rmdir(dir);
+}
+
+
+WVTEST_MAIN("warm copy across processes")
+{
+    char dir[] = "/tmp/wvtftpwarm.XXXXXX";
+    WVPASS(mkdtemp(dir));
+    struct stat src;
+    memset(&src, 0, sizeof(src));
+    src.st_dev = 8;
+    src.st_ino = 1234;
+    src.st_size = 500;
+    src.st_mtime = 1000000000;
+
+    // Too big for the limit.
+    WVFAIL(TFTPWarmFile::open(dir, src, 10000, 4096, 8192));
+    WVFAIL(TFTPWarmFile::open(NULL, src, 10000, 4096, 1 << 20));
+
+    TFTPWarmFile *w = TFTPWarmFile::open(dir, src, 10000, 4096, 1 << 20);
+    WVPASS(w);
+    if (!w)
+        return;
+    unsigned char buf[4096];
+    memset(buf, 'a', sizeof(buf));
+    WVFAIL(w->get(0));
+    w->put(0, buf, sizeof(buf));
+    // The last chunk is short, and only a whole one is taken.
+    memset(buf, 'c', sizeof(buf));
+    w->put(2, buf, 100);
+    WVFAIL(w->get(2));
+    w->put(2, buf, 10000 - 8192);
+    WVFAIL(w->get(3));
+    delete w;
+
+    // What the next daemon sees.
+    w = TFTPWarmFile::open(dir, src, 10000, 4096, 1 << 20);
+    WVPASS(w);
+    if (w)
+    {
+        WVPASS(w->get(0) && w->get(0)[4095] == 'a');
+        WVFAIL(w->get(1));
+        WVPASS(w->get(2) && w->get(2)[0] == 'c');
+        delete w;
+    }
+    WVPASSEQ(count_files(dir), 1);
+
+    // Disagreeing about the layout throws it away.
+    WVFAIL(TFTPWarmFile::open(dir, src, 10000, 8192, 1 << 20));
+    WVPASSEQ(count_files(dir), 0);
+
+    // A new version of the file replaces the old one's copy.
+    w = TFTPWarmFile::open(dir, src, 10000, 4096, 1 << 20);
+    delete w;
+    src.st_mtime++;
+    w = TFTPWarmFile::open(dir, src, 10000, 4096, 1 << 20);
+    WVPASS(w);
+    if (w)
+    {
+        WVFAIL(w->get(0));
+        delete w;
+    }
+    WVPASSEQ(count_files(dir), 1);
+
+    remove_all(dir);
+}
+
+
+WVTEST_MAIN("warm copy only in a private directory")
+{
+    char dir[] = "/tmp/wvtftpwarm.XXXXXX";
+    WVPASS(mkdtemp(dir));
+    struct stat src;
+    memset(&src, 0, sizeof(src));
+    src.st_dev = 8;
+    src.st_ino = 1234;
+    src.st_size = 500;
+    src.st_mtime = 1000000000;
+
+    // Others could plant files in it.
+    chmod(dir, 0755);
+    WVFAIL(TFTPWarmFile::open(dir, src, 10000, 4096, 1 << 20));
+    WVPASSEQ(count_files(dir), 0);
+    chmod(dir, 0700);
+
+    // Nor through a symlink, which whoever made it can point elsewhere.
+    char link[sizeof(dir) + 8], sub[sizeof(dir) + 8];
+    snprintf(link, sizeof(link), "%s.link", dir);
+    WVPASSEQ(symlink(dir, link), 0);
+    WVFAIL(TFTPWarmFile::open(link, src, 10000, 4096, 1 << 20));
+    unlink(link);
+
+    // Created where there's nothing yet.
+    snprintf(sub, sizeof(sub), "%s/sub", dir);
+    TFTPWarmFile *w = TFTPWarmFile::open(sub, src, 10000, 4096, 1 << 20);
+    WVPASS(w);
+    delete w;
+    WVPASSEQ(count_files(sub), 1);
+
+    remove_all(sub);
+    remove_all(dir);
+}
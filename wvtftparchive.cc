@@ -0,0 +1,370 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftparchive.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+static unsigned int name_hash(const char *s, size_t len)
+{
+    // FNV-1a
+    unsigned int h = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619U;
+    return h;
+}
+
+
+TFTPArchive::TFTPArchive(WvStringParm path, TFTPMappedFile *&maps)
+{
+    map = NULL;
+    buckets = NULL;
+    nbuckets = nmembers = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        err = strerror(errno);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        dev = st.st_dev;
+        ino = st.st_ino;
+        filesize = st.st_size;
+        mtime = st.st_mtime;
+        map = TFTPMappedFile::get(maps, fd);
+    }
+    close(fd);
+    if (!map)
+    {
+        err = "can't map it";
+        return;
+    }
+
+    const unsigned char *p = map->bytes();
+    bool ok = map->size() >= 6 && !memcmp(p, "07070", 5)
+        ? parse_cpio() : parse_tar();
+    if (ok && map->truncated(map->size() - 1))
+    {
+        err = "truncated while being read";
+        ok = false;
+    }
+    if (!ok)
+    {
+        clear();
+        map->release();
+        map = NULL;
+    }
+}
+
+
+TFTPArchive::~TFTPArchive()
+{
+    clear();
+    if (map)
+        map->release();
+}
+
+
+void TFTPArchive::clear()
+{
+    for (int i = 0; i < nbuckets; i++)
+    {
+        while (buckets[i])
+        {
+            Member *m = buckets[i];
+            buckets[i] = m->next;
+            delete[] m->name;
+            delete m;
+        }
+    }
+    if (buckets)
+        delete[] buckets;
+    buckets = NULL;
+    nbuckets = nmembers = 0;
+}
+
+
+bool TFTPArchive::same_file(const struct stat &st) const
+{
+    return st.st_ino == ino && st.st_dev == dev && st.st_size == filesize
+        && st.st_mtime == mtime;
+}
+
+
+const TFTPArchive::Member *TFTPArchive::find(const char *name) const
+{
+    if (!nbuckets)
+        return NULL;
+    size_t len = strlen(name);
+    Member *m = buckets[name_hash(name, len) & (nbuckets - 1)];
+    for (; m; m = m->next)
+        if (!strcmp(m->name, name))
+            return m;
+    return NULL;
+}
+
+
+void TFTPArchive::add(const char *name, size_t namelen, off_t offset,
+                      off_t size, time_t _mtime)
+{
+    while (namelen && (*name == '/'
+                       || (namelen >= 2 && name[0] == '.' && name[1] == '/')))
+    {
+        int skip = *name == '/' ? 1 : 2;
+        name += skip;
+        namelen -= skip;
+    }
+    if (!namelen)
+        return;
+
+    if (nmembers >= nbuckets)
+    {
+        // Keep the chains short by doubling along with the member count.
+        int newsize = nbuckets ? nbuckets * 2 : 64;
+        Member **b = new Member *[newsize];
+        memset(b, 0, newsize * sizeof(*b));
+        for (int i = 0; i < nbuckets; i++)
+        {
+            while (buckets[i])
+            {
+                Member *m = buckets[i];
+                buckets[i] = m->next;
+                Member *&head = b[name_hash(m->name, strlen(m->name))
+                                  & (newsize - 1)];
+                m->next = head;
+                head = m;
+            }
+        }
+        if (buckets)
+            delete[] buckets;
+        buckets = b;
+        nbuckets = newsize;
+    }
+
+    Member *&head = buckets[name_hash(name, namelen) & (nbuckets - 1)];
+    Member *m;
+    for (m = head; m; m = m->next)
+        if (!strncmp(m->name, name, namelen) && !m->name[namelen])
+            break;
+    if (!m)
+    {
+        // Like tar itself, a later copy of a name replaces the earlier one.
+        m = new Member;
+        m->name = new char[namelen + 1];
+        memcpy(m->name, name, namelen);
+        m->name[namelen] = 0;
+        m->next = head;
+        head = m;
+        nmembers++;
+    }
+    m->offset = offset;
+    m->size = size;
+    m->mtime = _mtime;
+}
+
+
+// Reads a tar header number: octal, padded with spaces or NULs, or in
+// GNU's base-256 if it's too big for that.
+static long long tar_number(const unsigned char *p, size_t len)
+{
+    long long val = 0;
+    if (*p & 0x80)
+    {
+        val = *p & 0x3f;
+        for (size_t i = 1; i < len; i++)
+            val = val << 8 | p[i];
+        return val;
+    }
+    size_t i = 0;
+    while (i < len && p[i] == ' ')
+        i++;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+        val = val * 8 + p[i] - '0';
+    return val;
+}
+
+
+static bool tar_checksum_ok(const unsigned char *h)
+{
+    unsigned long sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    return sum == (unsigned long)tar_number(h + 148, 8);
+}
+
+
+bool TFTPArchive::parse_tar()
+{
+    const unsigned char *p = map->bytes();
+    off_t size = map->size();
+
+    // A name too long for the header comes in an entry of its own first.
+    const char *longname = NULL;
+    size_t longlen = 0;
+
+    off_t pos;
+    for (pos = 0; pos + 512 <= size; )
+    {
+        const unsigned char *h = p + pos;
+        if (!h[0])
+            break;              // the zero blocks at the end
+        if (!tar_checksum_ok(h))
+        {
+            err = pos ? "bad tar header" : "not a tar or cpio archive";
+            return false;
+        }
+
+        off_t len = tar_number(h + 124, 12);
+        off_t data = pos + 512;
+        if (len < 0 || len > size - data)
+        {
+            err = "truncated tar archive";
+            return false;
+        }
+
+        char type = h[156];
+        if (type == 'L')
+        {
+            // GNU: the data is the name.
+            longname = (const char *)p + data;
+            longlen = strnlen(longname, len);
+        }
+        else if (type == 'x')
+        {
+            // pax: "<length> <key>=<value>\n" records.
+            const char *r = (const char *)p + data, *end = r + len;
+            while (r < end)
+            {
+                const char *k = r;
+                long rlen = 0;
+                while (k < end && *k >= '0' && *k <= '9' && rlen <= end - r)
+                    rlen = rlen * 10 + *k++ - '0';
+                if (k == end || *k != ' ' || rlen <= k + 1 - r
+                    || rlen > end - r)
+                    break;
+                k++;
+                const char *newline = r + rlen - 1;
+                if (newline - k > 5 && !memcmp(k, "path=", 5))
+                {
+                    longname = k + 5;
+                    longlen = newline - longname;
+                }
+                r += rlen;
+            }
+        }
+        else if (type != 'g')
+        {
+            // Regular files only; links and directories aren't served.
+            if (type == '0' || type == '\0' || type == '7')
+            {
+                time_t mt = tar_number(h + 136, 12);
+                if (longname)
+                    add(longname, longlen, data, len, mt);
+                else
+                {
+                    char name[256 + 1];
+                    size_t n = 0;
+                    // POSIX ustar may split the path; GNU uses the space
+                    // for something else.
+                    if (!memcmp(h + 257, "ustar\0", 6) && h[345])
+                    {
+                        n = strnlen((const char *)h + 345, 155);
+                        memcpy(name, h + 345, n);
+                        name[n++] = '/';
+                    }
+                    size_t nlen = strnlen((const char *)h, 100);
+                    memcpy(name + n, h, nlen);
+                    add(name, n + nlen, data, len, mt);
+                }
+            }
+            longname = NULL;
+        }
+
+        pos = data + (len + 511) / 512 * 512;
+    }
+    return true;
+}
+
+
+static unsigned long cpio_number(const unsigned char *h, int field)
+{
+    unsigned long val = 0;
+    const unsigned char *p = h + 6 + field * 8;
+    for (int i = 0; i < 8; i++)
+    {
+        int c = p[i];
+        int digit = c >= '0' && c <= '9' ? c - '0'
+            : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10
+            : -1;
+        if (digit < 0)
+            return ~0UL;
+        val = val * 16 + digit;
+    }
+    return val;
+}
+
+
+bool TFTPArchive::parse_cpio()
+{
+    const unsigned char *p = map->bytes();
+    off_t size = map->size();
+
+    for (off_t pos = 0; ; )
+    {
+        const unsigned char *h = p + pos;
+        if (pos + 110 > size || memcmp(h, "07070", 5)
+            || (h[5] != '1' && h[5] != '2'))
+        {
+            err = "bad cpio header";
+            return false;
+        }
+
+        // Fields: ino, mode, uid, gid, nlink, mtime, filesize, devmajor,
+        // devminor, rdevmajor, rdevminor, namesize, check.
+        unsigned long mode = cpio_number(h, 1);
+        unsigned long nlink = cpio_number(h, 4);
+        unsigned long mt = cpio_number(h, 5);
+        unsigned long len = cpio_number(h, 6);
+        unsigned long namesize = cpio_number(h, 11);
+        off_t data = (pos + 110 + namesize + 3) & ~(off_t)3;
+        if (namesize == ~0UL || len == ~0UL || !namesize
+            || data > size || (off_t)len > size - data)
+        {
+            err = "truncated cpio archive";
+            return false;
+        }
+
+        const char *name = (const char *)h + 110;
+        size_t namelen = strnlen(name, namesize);
+        if (namelen == 10 && !memcmp(name, "TRAILER!!!", 10))
+            break;
+
+        // All but the last of a set of hard links come without data.
+        if ((mode & 0170000) == 0100000 && (len || nlink <= 1))
+            add(name, namelen, data, len, mt);
+
+        pos = (data + len + 3) & ~(off_t)3;
+    }
+    return true;
+}
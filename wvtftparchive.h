@@ -0,0 +1,90 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPArchive, a tar or cpio file served as if it were the base directory.
+ * It is mapped into memory once and its members go into a hash table, so a
+ * request costs a lookup instead of path walks, stat()s and an open(), and
+ * a whole boot tree can be swapped by renaming one file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPARCHIVE_H
+#define __WVTFTPARCHIVE_H
+
+#include "wvstring.h"
+#include "wvtftppacket.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+
+class TFTPArchive
+{
+public:
+    struct Member
+    {
+        char *name;             // without any leading "./" or "/"
+        off_t offset;           // of its data in the archive
+        off_t size;
+        time_t mtime;
+        Member *next;           // in the same hash bucket
+    };
+
+    /** Maps the archive at 'path' through 'maps' (so transfers can keep
+     * their references to it after we're gone) and indexes its regular
+     * files.  Understands ustar, GNU and pax tar, and "newc" cpio.  If that
+     * fails, isok() is false and errstr() says why.
+     */
+    TFTPArchive(WvStringParm path, TFTPMappedFile *&maps);
+    ~TFTPArchive();
+
+    bool isok() const
+        { return map != NULL; }
+    WvString errstr() const
+        { return err; }
+
+    /** Returns true if 'st', from looking at the path again, is still the
+     * file we mapped.
+     */
+    bool same_file(const struct stat &st) const;
+
+    /** Returns the regular file called 'name' in the archive, or NULL. */
+    const Member *find(const char *name) const;
+
+    int count() const
+        { return nmembers; }
+
+    /** The whole archive; a member is 'size' bytes at 'offset' in it. */
+    TFTPMappedFile *mapping() const
+        { return map; }
+
+private:
+    TFTPMappedFile *map;
+    dev_t dev;
+    ino_t ino;
+    off_t filesize;
+    time_t mtime;
+    WvString err;
+    Member **buckets;
+    int nbuckets, nmembers;
+
+    bool parse_tar();
+    bool parse_cpio();
+    void add(const char *name, size_t namelen, off_t offset, off_t size,
+             time_t mtime);
+    void clear();
+};
+
+#endif // __WVTFTPARCHIVE_H
@@ -18,9 +18,14 @@
  */
 
 #include "wvtftpbase.h"
+#include "wvtftptrace.h"
 #include "wvstrutils.h"
 #include "wvtimeutils.h"
 #include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 PktTime::PktTime(int _pktclump)
 {
@@ -62,32 +67,64 @@ struct timeval *PktTime::get(int pktnum)
 }
 
 WvTFTPBase::WvTFTPBase(int _tftp_tick, int port)
-    : WvUDPStream(port, WvIPPortAddr()), conns(5), log("WvTFTP", WvLog::Debug),
-      tftp_tick(_tftp_tick)
+    : WvUDPStream(port, WvIPPortAddr()), pool(), shared_files(NULL),
+      mapped_files(NULL), inflated_files(NULL), conns(5),
+      log("WvTFTP", WvLog::Debug), loglevel(WvLog::Debug5),
+      tftp_tick(_tftp_tick), capturing(false)
 {
 }
 
 WvTFTPBase::~WvTFTPBase()
 {
+    flush_sends();
+}
+
+void WvTFTPBase::adopt_socket(int fd)
+{
+    // The same descriptor number as before, so nothing that has seen
+    // getfd() needs to know.
+    if (dup2(fd, getfd()) < 0)
+    {
+        seterr(errno);
+        ::close(fd);
+        return;
+    }
+    ::close(fd);
+
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    if (getsockname(getfd(), (struct sockaddr *)&sin, &len) == 0)
+        localaddr = WvIPPortAddr(&sin);
 }
 
 void WvTFTPBase::dump_pkt()
 {
-    //log(WvLog::Debug5, "Packet:\n");
-    //log(WvLog::Debug5, hexdump_buffer(packet, packetsize));
+    //TFTPLOG(WvLog::Debug5, "Packet:\n");
+    //TFTPLOG(WvLog::Debug5, hexdump_buffer(packet, packetsize));
+}
+
+// Returns the block number whose low 16 bits are 'wire' and which is
+// nearest to 'expect'.  A long transfer wraps the counter many times over.
+static inline int unwrap_block(int expect, int wire)
+{
+    return expect + (short)(wire - expect);
 }
 
 void WvTFTPBase::handle_packet()
 {
-    log(WvLog::Debug4, "Handling packet from %s\n", remaddr);
+    TFTPLOG(WvLog::Debug4, "Handling packet from %s\n", remaddr);
 
     TFTPConn *c = conns[remaddr];
-    c->last_received = wvtime();
+    c->last_received = now();
+    if (c->mcast && !c->passive)
+        c->mcast->active = c->last_received;
     TFTPOpcode opcode = (TFTPOpcode)(packet[0] * 256 + packet[1]);
 
     if (opcode == ERROR)
     {
         log(WvLog::Warning, "Received error packet; aborting.\n");
+        tftp_trace.add(TRACE_ABORT, c->remote, c->lastsent);
+        stats.aborted[TFTPStats::ABORT_ERROR_PACKET]++;
         conns.remove(c);
         return;
     }
@@ -98,6 +135,7 @@ void WvTFTPBase::handle_packet()
         if (opcode != ACK)
         {
             log(WvLog::Warning, "Expected ACK (read); aborting.\n");
+            stats.aborted[TFTPStats::ABORT_PROTOCOL]++;
             send_err(4);
             conns.remove(c);
             return;
@@ -106,28 +144,59 @@ void WvTFTPBase::handle_packet()
         c->mult = 1;
         int small_blocknum = (unsigned char)(packet[2]) * 256 +
 	    	             (unsigned char)(packet[3]);
-        int mult = c->unack / 65536;
-        int blocknum = mult * 65536 + small_blocknum;
-        if (blocknum > c->unack + 32000)
-            blocknum = (mult - 1) * 65536 + small_blocknum;
-        log(WvLog::Debug5,
+        int blocknum = unwrap_block(c->unack, small_blocknum);
+        if (c->send_oack && c->mcast)
+        {
+            // A new multicast master acknowledges the last block it has in
+            // a row, which can be anything the group has been sent.
+            blocknum = small_blocknum;
+            while (blocknum + 65536 <= c->mcast->sent)
+                blocknum += 65536;
+        }
+        TFTPLOG(WvLog::Debug5,
 	    "Handle: ack blocknum=%s(%s), unack=%s, lastsent=%s, "
             "prefetch=%s\n",
             small_blocknum, blocknum, c->unack, c->lastsent, c->pktclump);
 	
-        if (blocknum == 0 && c->send_oack)
+        time_t rtt = 0;
+        // An OACK is acknowledged with ACK 0, or with the last block the
+        // client has if it asked for a "blkoffset".
+        if (c->send_oack && (blocknum == c->unack - 1 || c->mcast))
         {
+            tftp_trace.add(TRACE_ACK, c->remote, blocknum);
 	    // treat the first block specially if we need to send an option
 	    // acknowledgement.
             c->send_oack = false;
-            log(WvLog::Debug5, "Last sent: %s unack: %s pktclump: %s\n",
+            if (blocknum > 0)
+            {
+                // The rest of the file picks up after what it already has.
+                if (blocknum > c->filesize / (off_t)c->blksize)
+                {
+                    log(WvLog::Info, "%s client already had the whole "
+                        "file.\n", c->mcast ? "Multicast" : "Resuming");
+                    tftp_trace.add(TRACE_DONE, c->remote, blocknum);
+                    transfer_done(c);
+                    conns.remove(c);
+                    return;
+                }
+                c->lastsent = blocknum;
+                c->unack = blocknum + 1;
+                if (c->tftpfile && !c->shared && !c->mapped)
+                    fseeko(c->tftpfile, (off_t)blocknum * c->blksize,
+                           SEEK_SET);
+            }
+            TFTPLOG(WvLog::Debug5, "Last sent: %s unack: %s pktclump: %s\n",
                 c->lastsent, c->unack, c->pktclump);
             int pktsremain = c->lastsent - c->unack;
             while (pktsremain < c->pktclump - 1)
             {
-                log(WvLog::Debug5, "Result is %s\n", pktsremain);
-                log(WvLog::Debug5, "Send\n");
-                send_data(c);
+                TFTPLOG(WvLog::Debug5, "Result is %s\n", pktsremain);
+                TFTPLOG(WvLog::Debug5, "Send\n");
+                if (!send_data(c))
+                {
+                    conns.remove(c);
+                    return;
+                }
                 if (c->donefile)
                     break;
                 pktsremain = c->lastsent - c->unack;
@@ -140,14 +209,16 @@ void WvTFTPBase::handle_packet()
             // Add rtt to cumulative sum.
             if (blocknum == c->unack && blocknum > c->timed_out_ignore)
             {
-                struct timeval tv = wvtime();
+                struct timeval tv = now();
 		
-                time_t rtt = msecdiff(tv, *(c->pkttimes->get(blocknum)));
-                log(WvLog::Debug4, "rtt is %s.\n", rtt);
+                rtt = msecdiff(tv, *(c->pkttimes->get(blocknum)));
+                TFTPLOG(WvLog::Debug4, "rtt is %s.\n", rtt);
 		
                 c->rtt += rtt;
                 c->total_packets++;
+                stats.rtt.add(rtt);
             }
+            tftp_trace.add(TRACE_ACK, c->remote, blocknum, rtt);
 	    
             if (blocknum == c->unack && blocknum == c->lastsent
                 && c->donefile)
@@ -157,6 +228,8 @@ void WvTFTPBase::handle_packet()
                 log(WvLog::Info, "File transferred successfully.\n");
                 log(WvLog::Info, "Average rtt was %s ms.\n", c->rtt /
 		    blocknum);
+                tftp_trace.add(TRACE_DONE, c->remote, blocknum);
+                transfer_done(c);
 
 		if (c->alias_once)
 		    c->alias.remove();
@@ -168,10 +241,8 @@ void WvTFTPBase::handle_packet()
             {
                 // send the next packet if the ack comes from one of the
                 // sent data packets.
-                int blocknum_norollover = blocknum +
-                                          (blocknum < c->unack ? 65536 : 0);
-                if (c->unack <= blocknum_norollover &&
-                    blocknum_norollover < (c->unack + c->pktclump))
+                if (c->unack <= blocknum &&
+                    blocknum < (c->unack + c->pktclump))
                 {
                     c->unack = blocknum + 1;
 
@@ -179,7 +250,11 @@ void WvTFTPBase::handle_packet()
                     {
                         if (c->donefile)
                             break;
-                        send_data(c);
+                        if (!send_data(c))
+                        {
+                            conns.remove(c);
+                            return;
+                        }
                         c->numtimeouts = 0;
                     }
                 }
@@ -197,6 +272,7 @@ void WvTFTPBase::handle_packet()
         if (opcode != DATA)
         {
             log(WvLog::Warning, "Badly formed packet (write); aborting.\n");
+            stats.aborted[TFTPStats::ABORT_PROTOCOL]++;
             send_err(4);
             conns.remove(c);
             return;
@@ -205,25 +281,29 @@ void WvTFTPBase::handle_packet()
         c->mult = 1;
         int small_blocknum = (unsigned char)(packet[2]) * 256 +
 	    	             (unsigned char)(packet[3]);
-        int mult = c->lastsent / 65536;
-        int blocknum = mult * 65536 + small_blocknum;
-        if (blocknum < c->lastsent - 32000)
-            blocknum = (mult + 1) * 65536 + small_blocknum;
+        int blocknum = unwrap_block(c->lastsent + 1, small_blocknum);
 
         if (blocknum == c->lastsent + 1)
         {
+            // The first block is as good as an ACK of our OACK.
+            c->send_oack = false;
             unsigned int data_packetsize = packetsize;
+            tftp_trace.add(TRACE_DATA, c->remote, blocknum,
+                           data_packetsize - 4);
+            stats.bytes_received += data_packetsize - 4;
+            c->bytes += data_packetsize - 4;
             fwrite(&packet[4], sizeof(char), data_packetsize-4, c->tftpfile);
 
             // Add rtt to cumulative sum.
             if (blocknum > c->timed_out_ignore)
             {
-                struct timeval tv = wvtime();
+                struct timeval tv = now();
                 time_t rtt = msecdiff(tv, *(c->pkttimes->get(blocknum - 1)));
-                log("rtt is %s.\n", rtt);
+                TFTPLOG(WvLog::Debug, "rtt is %s.\n", rtt);
 
                 c->rtt += rtt;
                 c->total_packets++;
+                stats.rtt.add(rtt);
             }
             send_ack(c);
 
@@ -232,6 +312,8 @@ void WvTFTPBase::handle_packet()
                 log(WvLog::Info, "File transferred successfully.\n");
                 log(WvLog::Info, "Average rtt was %s ms.\n", c->rtt /
 		    blocknum);
+                tftp_trace.add(TRACE_DONE, c->remote, blocknum);
+                transfer_done(c);
 		conns.remove(c);
 		c = NULL;
             }
@@ -239,9 +321,31 @@ void WvTFTPBase::handle_packet()
     }
 }
 
+void WvTFTPBase::transfer_done(TFTPConn *c)
+{
+    struct timeval tv = now();
+    stats.completed[c->direction == tftpread ? TFTPStats::READ
+                                             : TFTPStats::WRITE]++;
+    stats.completion.add(msecdiff(tv, c->start_time));
+    stats.window.add(c->pktclump);
+}
+
+// A short block would end the transfer as if that were all of the file,
+// leaving the client with a truncated copy, so tell it we've failed.
+bool WvTFTPBase::read_failed(TFTPConn *c, int block)
+{
+    log(WvLog::Warning, "Can't read block %s of %s%s; aborting transfer.\n",
+        block, c->filename, c->inflated ? ".gz" : "");
+    tftp_trace.add(TRACE_ABORT, c->remote, block);
+    stats.aborted[TFTPStats::ABORT_READ_ERROR]++;
+    setdest(c->remote);
+    send_err(0, "Error reading file.");
+    return false;
+}
+
 // Send out the next packet, unless resend is true, in which case
 // send out packets unack through lastsent.
-void WvTFTPBase::send_data(TFTPConn *c, bool resend)
+bool WvTFTPBase::send_data(TFTPConn *c, bool resend)
 {
 //    log("Sending data.\n");
     int firstpkt, lastpkt;
@@ -250,7 +354,6 @@ void WvTFTPBase::send_data(TFTPConn *c, bool resend)
     {
         firstpkt = c->unack;
         lastpkt = c->lastsent;
-        fseek(c->tftpfile, (firstpkt - 1) * c->blksize, SEEK_SET);
     }
     else
     {
@@ -259,34 +362,125 @@ void WvTFTPBase::send_data(TFTPConn *c, bool resend)
         lastpkt = c->lastsent;
     }
     
-    log(WvLog::Debug5, "send_data: sending packets %s->%s\n",
+    TFTPLOG(WvLog::Debug5, "send_data: sending packets %s->%s\n",
 	firstpkt, lastpkt);
 
+    bool seeked = false;
     for (int pktcount = firstpkt; pktcount <= lastpkt; pktcount++)
     {
-        size_t datalen = 0;
-        packetsize = 4;
-    
-        // DATA opcode
-        packet[0] = 0;
-        packet[1] = 3;
-        // block num
-        packet[2] = (pktcount % 65536) / 256;
-        packet[3] = (pktcount % 65536) % 256;
-        // data
-        datalen = fread(&packet[4], sizeof(char), c->blksize, c->tftpfile);
-        log(WvLog::Debug5, "send_data: read %s bytes from file.\n", datalen);
-        if (datalen < c->blksize)
-            c->donefile = true;
-        packetsize += datalen;
-//        log(WvLog::Debug5, "Sending ");
-        dump_pkt();
-        setdest(c->remote);  // often redundant (after reading), but safer
-        write(packet, packetsize);
-
-        struct timeval tv = wvtime();
+        // Blocks still in the window are resent exactly as they were built,
+        // and another reader of the same file may have built this one.
+        TFTPPacket *pkt = c->pkts->get(pktcount);
+        if (!pkt && c->shared && (pkt = c->shared->block(pktcount)) != NULL)
+        {
+            stats.shared_blocks++;
+            if (pkt->len < c->blksize)
+                c->donefile = true;
+            c->pkts->set(pktcount, pkt);
+        }
+
+        if (pkt)
+            pkt->addref();
+        else if (c->mapped)
+        {
+            // Nothing to read or copy: the payload is the file itself.
+            off_t offset = (off_t)(pktcount - 1) * c->blksize;
+            size_t len = 0;
+            if (offset < c->filesize)
+                len = c->filesize - offset < (off_t)c->blksize
+                    ? c->filesize - offset : c->blksize;
+            pkt = c->mapped->slice(pool, c->map_start + offset, len);
+            // The kernel copes with pages that have gone, but then the
+            // client would be waiting on blocks we can never send.
+            if (len && c->mapped->truncated(c->map_start + offset + len - 1))
+            {
+                pkt->release();
+                return read_failed(c, pktcount);
+            }
+            pkt->sethdr(DATA, pktcount);
+            stats.mapped_blocks++;
+            if (pkt->len < c->blksize)
+                c->donefile = true;
+            c->pkts->set(pktcount, pkt);
+        }
+        else
+        {
+            pkt = pool.get(c->blksize);
+            pkt->sethdr(DATA, pktcount);
+            bool failed = false;
+            if (c->inflated)
+            {
+                // Any block, resent or not, comes out of the decompressed
+                // cache or from the nearest saved point of the stream.
+                ssize_t n = c->inflated->read(
+                        (off_t)(pktcount - 1) * c->blksize, pkt->data,
+                        c->blksize);
+                failed = n < 0;
+                pkt->len = n > 0 ? n : 0;
+                stats.inflated_blocks++;
+            }
+            else if (c->shared)
+            {
+                // Shared readers may be anywhere in the file, so don't rely
+                // on (or move) the stream's position.
+                ssize_t n = pread(fileno(c->tftpfile), pkt->data, c->blksize,
+                                  (off_t)(pktcount - 1) * c->blksize);
+                failed = n < 0;
+                pkt->len = n > 0 ? n : 0;
+                if (!failed)
+                    c->shared->set(pktcount, pkt);
+                stats.shared_misses++;
+            }
+            else
+            {
+                if (resend)
+                {
+                    fseeko(c->tftpfile, (off_t)(pktcount - 1) * c->blksize,
+                           SEEK_SET);
+                    seeked = true;
+                }
+                pkt->len = fread(pkt->data, sizeof(char), c->blksize,
+                                 c->tftpfile);
+                failed = ferror(c->tftpfile);
+            }
+
+            if (failed)
+            {
+                pkt->release();
+                return read_failed(c, pktcount);
+            }
+            TFTPLOG(WvLog::Debug5, "send_data: read %s bytes from file.\n",
+                pkt->len);
+            if (pkt->len < c->blksize)
+                c->donefile = true;
+            c->pkts->set(pktcount, pkt);
+        }
+
+        if (c->flow)
+            c->flow->enqueue(pkt, pkt->pktlen(), pktcount);
+        else
+            send_pkt(c->data_to ? *c->data_to : c->remote, pkt);
+        if (c->data_to && c->mcast && pktcount > c->mcast->sent)
+            c->mcast->sent = pktcount;
+        tftp_trace.add(resend ? TRACE_RESEND : TRACE_DATA, c->remote,
+                       pktcount, pkt->len);
+        stats.bytes_sent += pkt->len;
+        c->bytes += pkt->len;
+        if (resend)
+        {
+            stats.retransmits++;
+            c->retransmits++;
+        }
+        pkt->release();
+
+        struct timeval tv = now();
         c->pkttimes->set(pktcount, tv);
     }
+
+    // Leave the file positioned after the last block we have sent.
+    if (seeked)
+        fseeko(c->tftpfile, (off_t)lastpkt * c->blksize, SEEK_SET);
+    return true;
 }
 
 // Send an acknowledgement.
@@ -295,29 +489,48 @@ void WvTFTPBase::send_ack(TFTPConn *c, bool resend)
     if (!resend)
         c->lastsent++;
 
-    packetsize = 4;
-    packet[0] = 0;
-    packet[1] = 4;
-    packet[2] = (c->lastsent % 65536) / 256;
-    packet[3] = (c->lastsent % 65536) % 256;
-//    log(WvLog::Debug5, "Sending ");
-    dump_pkt();
-    write(packet, packetsize); 
-
-    struct timeval tv = wvtime();
-    log(WvLog::Debug4, "Setting %s\n", c->lastsent);
+    TFTPPacket *pkt = pool.get(0);
+    pkt->sethdr(ACK, c->lastsent);
+    // Pacing the ACKs of an upload paces the upload, so each one costs
+    // the block it asks for.
+    if (c->flow)
+        c->flow->enqueue(pkt, c->blksize + 4, c->lastsent);
+    else
+        send_pkt(c->remote, pkt);
+    pkt->release();
+
+    struct timeval tv = now();
+    TFTPLOG(WvLog::Debug4, "Setting %s\n", c->lastsent);
     c->pkttimes->set(c->lastsent, tv);
 }
 
-void WvTFTPBase::send_err(char errcode, WvString errmsg)
+void WvTFTPBase::flush_sched()
 {
-    packetsize = 4;
+    struct timeval tv = now();
+    WvIPPortAddr dest;
+    int num;
+    TFTPPacket *pkt;
+    while ((pkt = sched.dequeue(tv, dest, num)) != NULL)
+    {
+        // Flows die with their connections, so this is always there.
+        TFTPConn *c = conns[dest];
 
-    packet[0] = 0;
-    packet[1] = 5;
-    packet[2] = 0;
-    packet[3] = errcode;
+        // A block acknowledged while it waited needn't go out at all.
+        if (c->direction == tftpread && num < c->unack)
+        {
+            pkt->release();
+            continue;
+        }
+
+        send_pkt(c->data_to ? *c->data_to : dest, pkt);
+        pkt->release();
+        // Time the block from when it really left, not when it was queued.
+        c->pkttimes->set(num, tv);
+    }
+}
 
+void WvTFTPBase::send_err(char errcode, WvString errmsg)
+{
     if (errmsg == "")
     {
         switch (errcode)
@@ -337,10 +550,39 @@ void WvTFTPBase::send_err(char errcode, WvString errmsg)
             case 7: errmsg = "No such user.";
         }
     }
-    strcpy(&packet[4],errmsg.edit());
-    packetsize += errmsg.len() + 1;
-//    log(WvLog::Debug5, "Sending Error ");
-    dump_pkt();
-    write(packet, packetsize);     
+
+    TFTPPacket *pkt = pool.get(errmsg.len() + 1);
+    pkt->sethdr(ERROR, errcode);
+    memcpy(pkt->data, errmsg.cstr(), errmsg.len() + 1);
+    pkt->len = errmsg.len() + 1;
+    send_pkt(remaddr, pkt);
+    pkt->release();
+}
+
+void WvTFTPBase::send_pkt(const WvIPPortAddr &dest, TFTPPacket *pkt)
+{
+    sockaddr_bin *sa = dest.sockaddr();
+    batch.add((struct sockaddr *)sa, dest.sockaddr_len(), pkt);
+    delete sa;
+    if (batch.full())
+        flush_sends();
+
+    if (capturing)
+    {
+        TFTPConn *c = conns[dest];
+        if (c && c->capture)
+        {
+            struct iovec iov[2];
+            int n = pkt->iovecs(iov);
+            c->capture->recordv(now(), localaddr, dest, iov, n);
+        }
+    }
 }
 
+void WvTFTPBase::flush_sends()
+{
+    int failed = batch.flush(getwfd());
+    if (failed)
+        log(WvLog::Debug, "%s datagrams could not be sent: %s\n", failed,
+            strerror(errno));
+}
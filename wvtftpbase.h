@@ -30,6 +30,13 @@
 #include "wvtimestream.h"
 #include "wvstringlist.h"
 #include "uniconf.h"
+#include "wvtftppacket.h"
+#include "wvtftpstats.h"
+#include "wvtftppcap.h"
+#include "wvtftpsched.h"
+#include "wvtftpmcast.h"
+#include "wvtftpinflate.h"
+#include "wvtimeutils.h"
 #include <stdio.h>
 #include <time.h>
 #include <sys/time.h>
@@ -37,6 +44,25 @@
 const int MAX_PACKET_SIZE = 65535;
 const bool WVTFTP_DEBUG = false;
 
+// Anything more verbose than this is compiled out of the packet path.
+// Release builds (DEBUG=0) stop at Info; override with MAX_LOGLEVEL=... on
+// the make command line.
+#ifndef WVTFTP_MAX_LOGLEVEL
+# if DEBUG
+#  define WVTFTP_MAX_LOGLEVEL WvLog::Debug5
+# else
+#  define WVTFTP_MAX_LOGLEVEL WvLog::Info
+# endif
+#endif
+
+// Logs through the object's 'log' only if 'lvl' is enabled, so the
+// arguments aren't even evaluated for messages that would be thrown away.
+#define TFTPLOG(lvl, ...)                                               \
+    do {                                                                \
+        if ((lvl) <= WVTFTP_MAX_LOGLEVEL && (lvl) <= loglevel)          \
+            log((lvl), __VA_ARGS__);                                    \
+    } while (0)
+
 class PktTime
 {
 public:
@@ -45,6 +71,8 @@ public:
     
     void set(int pktnum, struct timeval &tv);
     struct timeval *get(int pktnum);
+    int size() const
+        { return pktclump; }
 
 private:
     int idx;
@@ -63,6 +91,10 @@ public:
     WvTFTPBase(int _tftp_tick, int port = 0);
     virtual ~WvTFTPBase();
 
+    /** Sets the most verbose level TFTPLOG() will format at all. */
+    void set_loglevel(WvLog::LogLevel _loglevel)
+        { loglevel = _loglevel; }
+
     struct TFTPConn
     {
         WvIPPortAddr remote;        // remote's address and port
@@ -71,20 +103,42 @@ public:
         TFTPMode mode;              // mode (netascii or octet)
         FILE *tftpfile;             // the file being transferred
         size_t blksize;             // blocksize (RFC 2348)
-        int tsize;                  // transfer size (RFC 2349)
+        off_t tsize;                // transfer size (RFC 2349)
+        off_t filesize;             // size of the file being read
         int pktclump;               // number of packets to send at once
         int unack;                  // first unacked packet for writing data
         int lastsent;               // block number of last packet sent
         bool donefile;              // done reading from the file?
         bool send_oack;             // do we need to or did we send an OACK?
-        char oack[512];             // Holds the OACK packet in case we need
-        size_t oacklen;             //     to resend it.
+        bool queued;                // waiting to be admitted; nothing has
+                                    //     been sent yet
+        bool passive;               // a multicast client that isn't the
+                                    //     master, so just listens
+        TFTPPacket *oack;           // Holds the OACK packet in case we need
+                                    //     to resend it.
         int numtimeouts;
+        int retransmits;            // DATA packets resent so far
+        long long bytes;            // payload bytes sent or received
         int rtt;                    // "Total" round-trip time accumulator.
         int mult;                   // base of the multiplier for timeout
                                     //     backoffs.  The actual multiplier
                                     //     is mult squared.
         PktTime *pkttimes;
+        PktRing *pkts;              // DATA packets still in the window
+        TFTPPcapWriter *capture;    // packet capture, if enabled
+        TFTPSchedFlow *flow;        // queue in 'sched', if rate limited
+        TFTPSharedFile *shared;     // blocks shared with other readers
+        TFTPMappedFile *mapped;     // the file's pages, if served by mmap()
+        off_t map_start;            // where the file starts in 'mapped'
+        TFTPInflatedFile *inflated; // the output of a .gz, if serving one
+        TFTPMcastSession *mcast;    // RFC 2090 session, if any
+        int blkoffset;              // blocks the client already has (the
+                                    //     "blkoffset" option)
+        bool append;                // a WRQ carrying on a partial upload
+        const WvIPPortAddr *data_to;    // where DATA goes instead of
+                                        //     'remote' (a multicast group)
+        char *request;              // the RRQ/WRQ as received, to recognize
+        size_t requestlen;          //     the client resending it
         int total_packets;          // Number of correct packets used to
 	                            //     calculate average rtt.
 	           
@@ -93,12 +147,32 @@ public:
 				    //     timeout, and should thus be ignored
 				    //     in rtt calculations.
         struct timeval last_received;   // Time the last packet was received.
+        struct timeval start_time;      // Time the request arrived.
 	bool alias_once;
 	UniConf alias;
 	
 	TFTPConn():
 	    tftpfile(NULL),
+	    filesize(0),
+	    queued(false),
+	    passive(false),
+	    oack(NULL),
+	    retransmits(0),
+	    bytes(0),
 	    pkttimes(NULL),
+	    pkts(NULL),
+	    capture(NULL),
+	    flow(NULL),
+	    shared(NULL),
+	    mapped(NULL),
+	    map_start(0),
+	    inflated(NULL),
+	    mcast(NULL),
+	    blkoffset(0),
+	    append(false),
+	    data_to(NULL),
+	    request(NULL),
+	    requestlen(0),
 	    alias_once(false)
 	{
 	}
@@ -107,27 +181,101 @@ public:
 	    if (tftpfile)
 		fclose(tftpfile);
 
+	    if (oack)
+		oack->release();
+
 	    if (pkttimes)
 		delete pkttimes;
+
+	    if (pkts)
+		delete pkts;
+
+	    if (capture)
+		delete capture;
+
+	    if (flow)
+		delete flow;
+
+	    if (shared)
+		shared->release();
+
+	    if (mapped)
+		mapped->release();
+
+	    if (inflated)
+		inflated->release();
+
+	    if (mcast)
+		mcast->release();
+
+	    if (request)
+		deletev request;
 	}
     };
 
     DeclareWvDict(TFTPConn, WvIPPortAddr, remote);
 
 protected:
+    // Declared before 'conns' so it outlives every packet a connection
+    // still holds when the connections are torn down.
+    TFTPPacketPool pool;
+    TFTPSendBatch batch;
+    // Likewise, every TFTPConn::flow must go before the scheduler does.
+    TFTPScheduler sched;
+    TFTPSharedFile *shared_files;
+    TFTPMappedFile *mapped_files;
+    TFTPInflatedFile *inflated_files;
     TFTPConnDict conns;
     WvLog log;
+    WvLog::LogLevel loglevel;
+    TFTPStats stats;
     int tftp_tick;
+    // Incoming datagrams only; outgoing packets come from 'pool'.
     char packet[MAX_PACKET_SIZE];
     size_t packetsize;
     int def_timeout;
+    // Set once any connection has had a TFTPConn::capture, so send_pkt()
+    // doesn't look up the connection of every packet when nothing is
+    // being captured.
+    bool capturing;
 
     virtual void new_connection() = 0;
     virtual void handle_packet();
-    void send_data(TFTPConn *c, bool resend = false);
+    /** Returns false if a block couldn't be read, having told the client
+     * and counted the abort; the caller must then remove 'c'.
+     */
+    bool send_data(TFTPConn *c, bool resend = false);
+    bool read_failed(TFTPConn *c, int block);
     void send_ack(TFTPConn *c, bool resend = false);
     void send_err(char errcode, WvString errmsg = "");
 
+    /** Sends whatever 'sched' lets through right now. */
+    void flush_sched();
+
+    /** Records a finished transfer in 'stats'. */
+    virtual void transfer_done(TFTPConn *c);
+
+    /** Sends 'pkt' to 'dest' as a header+payload iovec.  The caller keeps
+     * its reference.  Together with now(), this is all the protocol code
+     * knows of the outside world; a simulator can override both.
+     * The default only adds the packet to 'batch'; see flush_sends().
+     */
+    virtual void send_pkt(const WvIPPortAddr &dest, TFTPPacket *pkt);
+
+    /** Hands everything send_pkt() has batched up to the kernel.  Call it
+     * before going back to waiting for packets.
+     */
+    void flush_sends();
+
+    /** Serves from 'fd', a UDP socket already bound (by another process,
+     * say), from now on instead of our own.  Takes ownership of 'fd'.
+     */
+    void adopt_socket(int fd);
+
+    /** The clock used for timeouts and round-trip times. */
+    virtual struct timeval now()
+        { return wvtime(); }
+
     void dump_pkt();
 };
 
@@ -0,0 +1,122 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpcontrol.h"
+#include "wvtftpserver.h"
+#include "wvistreamlist.h"
+#include "wvstringlist.h"
+#include "wvstrutils.h"
+#include "wvunixlistener.h"
+
+WvString (*TFTPControl::upgrade)() = NULL;
+
+
+IWvListener *TFTPControl::create_listener(const UniConf &cfg, WvLog &log)
+{
+    WvString sock = cfg["TFTP/Control Socket"].getme("");
+    if (!sock)
+        return NULL;
+
+    unlink(sock);
+    IWvListener *l = new WvUnixListener(WvUnixAddr(sock), 0600);
+    if (!l->isok())
+    {
+        log(WvLog::Error, "Can't listen on control socket %s: %s\n",
+            sock, l->errstr());
+        WVRELEASE(l);
+        return NULL;
+    }
+
+    l->onaccept(AcceptCallback());
+    log(WvLog::Info, "Control socket is %s.\n", sock);
+    return l;
+}
+
+
+WvString TFTPControl::command(WvStringParm line)
+{
+    WvStringList words;
+    words.split(line);
+    WvString cmd = words.popstr();
+
+    if (cmd == "list")
+    {
+        WvString out("# peer direction file blksize window unack/lastsent "
+                     "timeout_ms retransmits bytes/s\n");
+        for (WvTFTPServer *s = WvTFTPServer::first_server(); s;
+             s = s->next_server())
+            s->list_conns(out);
+        out.append("OK\n");
+        return out;
+    }
+    else if (cmd == "abort" && words.count() == 1)
+    {
+        WvIPPortAddr remote(words.popstr());
+        for (WvTFTPServer *s = WvTFTPServer::first_server(); s;
+             s = s->next_server())
+            if (s->abort_conn(remote))
+                return "OK\n";
+        return WvString("ERROR no transfer to %s\n", remote);
+    }
+    else if (cmd == "window" && words.count() == 2)
+    {
+        WvIPPortAddr remote(words.popstr());
+        int window = words.popstr().num();
+        if (window < 1)
+            return "ERROR window must be at least 1\n";
+        for (WvTFTPServer *s = WvTFTPServer::first_server(); s;
+             s = s->next_server())
+        {
+            int set = s->set_window(remote, window);
+            if (set)
+                return WvString("window %s\nOK\n", set);
+        }
+        return WvString("ERROR no transfer to %s\n", remote);
+    }
+    else if (cmd == "upgrade" && words.count() == 0)
+    {
+        if (!upgrade)
+            return "ERROR upgrades aren't supported here\n";
+        return WvString("ERROR upgrade failed: %s\n", upgrade());
+    }
+    else if (!cmd)
+        return "";
+
+    return "ERROR usage: list | abort <ip:port> | window <ip:port> <n> "
+        "| upgrade\n";
+}
+
+
+void TFTPControl::accept(IWvStream *_s)
+{
+    WvStreamClone *s = new WvStreamClone(_s);
+    s->setcallback(wv::bind(&TFTPControl::client_cb, s));
+    WvIStreamList::globallist.append(s, true, "TFTP control client");
+}
+
+
+void TFTPControl::client_cb(WvStream *s)
+{
+    // Each reply is built from the connection tables as they are right now
+    // and queued on the (non-blocking) stream, so a slow or stuck admin
+    // client never holds up the transfers.
+    char *line;
+    while ((line = s->getline(0)) != NULL)
+        s->write(command(trim_string(line)));
+}
@@ -0,0 +1,71 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPControl, the administrative control socket.  It lists the transfers
+ * in progress on every WvTFTPServer in the process and can abort them or
+ * change their window while they run, or have the daemon hand them over to
+ * a new copy of itself.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPCONTROL_H
+#define __WVTFTPCONTROL_H
+
+#include "wvstring.h"
+#include "wvlog.h"
+#include "uniconf.h"
+
+class IWvStream;
+class IWvListener;
+
+class TFTPControl
+{
+public:
+    /** Creates a UNIX socket listener at [TFTP] "Control Socket", or
+     * returns NULL if that isn't set.  The caller owns the listener and
+     * must add it to a stream list.
+     */
+    static IWvListener *create_listener(const UniConf &cfg, WvLog &log);
+
+    /** Runs one control command and returns the reply.  Commands are:
+     *   list                       - one line per transfer
+     *   abort <ip:port>            - abort a transfer
+     *   window <ip:port> <packets> - change a transfer's window
+     *   upgrade                    - run 'upgrade'
+     * Every reply ends with a line saying "OK" or "ERROR <reason>", except
+     * that a successful upgrade never replies: the connection just closes.
+     */
+    static WvString command(WvStringParm line);
+
+    /** Replaces the running program with a new copy of its binary, which
+     * takes over the transfers in progress.  Only returns if that fails,
+     * with the reason.  NULL (the default) if the program can't.
+     */
+    static WvString (*upgrade)();
+
+private:
+    static void accept(IWvStream *s);
+    static void client_cb(WvStream *s);
+
+    struct AcceptCallback
+    {
+        void operator()(IWvStream *s)
+            { accept(s); }
+    };
+};
+
+#endif // __WVTFTPCONTROL_H
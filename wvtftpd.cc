@@ -20,9 +20,19 @@
  */
 #include <uniconfroot.h>
 #include <wvstreamsdaemon.h>
+#include <iwvlistener.h>
 #include "wvtftpserver.h"
+#include "wvtftptrace.h"
+#include "wvtftpmetrics.h"
+#include "wvtftpcontrol.h"
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "version.h"
 
@@ -30,10 +40,14 @@
 class WvTFTPDaemon : public WvStreamsDaemon
 {
 public:
+    // Where upgrade() tells the new binary what to take over.
+    static const char UPGRADE_ENV[];
+
     WvTFTPDaemon()
 	: WvStreamsDaemon("wvtftpd", WVTFTP_VER_STRING, 
 			  wv::bind(&WvTFTPDaemon::cb, this)),
-          cfgmoniker("ini:/etc/wvtftpd.conf"), log("wvtftpd", WvLog::Info)
+          cfgmoniker("ini:/etc/wvtftpd.conf"), tftps(NULL),
+          log("wvtftpd", WvLog::Info)
     {
 	args.add_option('c', "config", "Config file",
 			"ini:filename.ini", cfgmoniker);
@@ -41,6 +55,8 @@ public:
     
     virtual ~WvTFTPDaemon()
     {
+        if (tftps)
+            WVRELEASE(tftps);
 	cfg.commit();
     }
     
@@ -56,11 +72,44 @@ public:
 	    return;
 	}
 	
-        tftps = new WvTFTPServer(cfg, 100);
-        add_die_stream(tftps, true, "WvTFTP");
+        // The server outlives a restart (SIGHUP), so transfers under way
+        // aren't cut off; it just rereads its configuration.
+        if (tftps)
+            tftps->reload();
+        else
+            start_server();
+        tftps->set_loglevel(log_level);
+        add_die_stream(tftps, false, "WvTFTP");
+
+        IWvListener *metrics = TFTPMetrics::create_listener(cfg, log);
+        if (metrics)
+            add_stream(metrics, true, "TFTP metrics");
+
+        IWvListener *control = TFTPControl::create_listener(cfg, log);
+        if (control)
+            add_stream(control, true, "TFTP control");
     }
 
 private:
+    void start_server()
+    {
+        // Set by upgrade() in the process we were exec()ed from.
+        int sockfd = -1, statefd = -1;
+        const char *handoff = getenv(UPGRADE_ENV);
+        if (handoff && sscanf(handoff, "%d %d", &sockfd, &statefd) != 2)
+            sockfd = statefd = -1;
+        unsetenv(UPGRADE_ENV);
+
+        tftps = new WvTFTPServer(cfg, 100, sockfd);
+        if (statefd >= 0)
+        {
+            int n = tftps->resume_transfers(statefd);
+            close(statefd);
+            log(WvLog::Info, "Took over %s transfers from the old binary.\n",
+                n);
+        }
+    }
+
     WvString cfgmoniker;
     UniConfRoot cfg;
     WvTFTPServer *tftps;
@@ -68,7 +117,88 @@ private:
 };
 
 
+const char WvTFTPDaemon::UPGRADE_ENV[] = "WVTFTPD_UPGRADE";
+
+// How we were run, to run the new binary the same way.
+static char **saved_argv;
+
+
+static void dump_trace(int sig)
+{
+    // Whatever we interrupted may be about to report its own errno.
+    int saved_errno = errno;
+    tftp_trace.dump();
+    errno = saved_errno;
+}
+
+
+// Keeps every fd but 'keep1' and 'keep2' (and stdin, stdout and stderr)
+// from outliving an exec(): open files, listeners and the like that the new
+// binary would never know about.  Harmless if the exec() then fails.
+static void cloexec_all_but(int keep1, int keep2)
+{
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0)
+        max = 1024;
+    for (int fd = 3; fd < max; fd++)
+    {
+        if (fd != keep1 && fd != keep2 && fcntl(fd, F_GETFD) >= 0)
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+
+// The control socket's "upgrade": exec()s our binary again, passing it the
+// listening socket and a file with the transfers in progress, and nothing
+// else.  The socket isn't closed in between, so clients never notice.
+static WvString upgrade()
+{
+    WvTFTPServer *s = WvTFTPServer::first_server();
+    if (!s || !s->isok())
+        return "no server running";
+
+    char name[] = "/tmp/wvtftpd-upgrade.XXXXXX";
+    int statefd = mkstemp(name);
+    if (statefd < 0)
+        return strerror(errno);
+    unlink(name);
+    if (s->save_transfers(statefd) < 0 || lseek(statefd, 0, SEEK_SET) < 0)
+    {
+        WvString err("can't save transfers: %s", strerror(errno));
+        close(statefd);
+        return err;
+    }
+
+    int sockfd = s->getfd();
+    int sockflags = fcntl(sockfd, F_GETFD);
+    fcntl(sockfd, F_SETFD, sockflags & ~FD_CLOEXEC);
+    cloexec_all_but(sockfd, statefd);
+    setenv(WvTFTPDaemon::UPGRADE_ENV,
+           WvString("%s %s", sockfd, statefd), 1);
+
+    execvp(saved_argv[0], saved_argv);
+
+    WvString err("can't run %s: %s", saved_argv[0], strerror(errno));
+    unsetenv(WvTFTPDaemon::UPGRADE_ENV);
+    fcntl(sockfd, F_SETFD, sockflags);
+    close(statefd);
+    return err;
+}
+
+
 int main(int argc, char **argv)
 {
+    // A relative path won't mean the same once we've daemonized.
+    saved_argv = new char *[argc + 1];
+    for (int i = 0; i < argc; i++)
+        saved_argv[i] = argv[i];
+    saved_argv[argc] = NULL;
+    char *path;
+    if (strchr(argv[0], '/') && (path = realpath(argv[0], NULL)) != NULL)
+        saved_argv[0] = path;
+
+    signal(SIGUSR2, dump_trace);
+    TFTPMappedFile::catch_truncation();
+    TFTPControl::upgrade = upgrade;
     return WvTFTPDaemon().run(argc, argv);
 }
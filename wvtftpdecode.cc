@@ -0,0 +1,96 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * wvtftpdecode: prints a trace dump written by wvtftpd (see wvtftptrace.h)
+ * as text, oldest event first.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#include "wvtftptrace.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *event_names[TRACE_MAX] = {
+    "?", "RRQ", "WRQ", "OACK", "DATA", "RESEND", "ACK", "TIMEOUT",
+    "WINDOW", "DONE", "ABORT"
+};
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    TFTPTraceHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1
+        || memcmp(hdr.magic, TFTP_TRACE_MAGIC, sizeof(hdr.magic)))
+    {
+        fprintf(stderr, "%s: not a wvtftpd trace file\n", argv[1]);
+        return 1;
+    }
+    if (hdr.version != TFTP_TRACE_VERSION
+        || hdr.recsize != sizeof(TFTPTraceRecord) || !hdr.nrecs)
+    {
+        fprintf(stderr, "%s: unsupported trace version %u (record size %u)\n",
+                argv[1], hdr.version, hdr.recsize);
+        return 1;
+    }
+
+    TFTPTraceRecord *recs = new TFTPTraceRecord[hdr.nrecs];
+    if (fread(recs, sizeof(TFTPTraceRecord), hdr.nrecs, f) != hdr.nrecs)
+    {
+        fprintf(stderr, "%s: truncated trace file\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    // Before the ring first wraps, only the first 'head' slots are valid.
+    uint32_t count = hdr.head < hdr.nrecs ? hdr.head : hdr.nrecs;
+    uint32_t first = hdr.head - count;
+    printf("# %u events recorded, showing the last %u\n", hdr.head, count);
+
+    uint64_t start = 0, prev = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const TFTPTraceRecord &r = recs[(first + i) % hdr.nrecs];
+        if (!i)
+            start = prev = r.usec;
+
+        struct in_addr in;
+        in.s_addr = r.addr;
+        const char *name = r.type < TRACE_MAX ? event_names[r.type] : "?";
+
+        printf("%12.6f %+10.6f %15s:%-5u %-7s block=%-10u arg=%u\n",
+               (r.usec - start) / 1e6, (r.usec - prev) / 1e6,
+               inet_ntoa(in), r.port, name, r.block, r.arg);
+        prev = r.usec;
+    }
+
+    delete[] recs;
+    return 0;
+}
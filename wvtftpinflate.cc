@@ -0,0 +1,360 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpinflate.h"
+#include <assert.h>
+#include <string.h>
+#include <sys/stat.h>
+
+TFTPInflatedFile *TFTPInflatedFile::get(TFTPInflatedFile *&list, int fd,
+                                        TFTPMappedFile *&maps, int nchunks,
+                                        const char *warmdir, off_t warmlimit)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return NULL;
+
+    TFTPInflatedFile *f;
+    for (f = list; f; f = f->next)
+    {
+        if (f->ino == st.st_ino && f->dev == st.st_dev
+            && f->filesize == st.st_size && f->mtime == st.st_mtime)
+        {
+            f->refs++;
+            return f;
+        }
+    }
+
+    TFTPMappedFile *src = TFTPMappedFile::get(maps, fd);
+    if (!src)
+        return NULL;
+    // A header and a trailer at least, and deflate is the only method.
+    const unsigned char *p = src->bytes();
+    if (src->size() < 18 || src->truncated(src->size() - 1)
+        || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8)
+    {
+        src->release();
+        return NULL;
+    }
+
+    f = new TFTPInflatedFile;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->filesize = st.st_size;
+    f->mtime = st.st_mtime;
+    // ISIZE, the last four bytes: the size modulo 2^32.
+    p += src->size() - 4;
+    f->usize = p[0] | p[1] << 8 | p[2] << 16 | (off_t)p[3] << 24;
+    f->src = src;
+    f->warm = TFTPWarmFile::open(warmdir, st, f->usize, CHUNK, warmlimit);
+    f->nchunks = nchunks > 2 ? nchunks : 2;
+    f->chunks = new Chunk[f->nchunks];
+    for (int i = 0; i < f->nchunks; i++)
+    {
+        f->chunks[i].start = -1;
+        f->chunks[i].data = NULL;
+    }
+    f->list = &list;
+    f->prev = NULL;
+    f->next = list;
+    if (list)
+        list->prev = f;
+    list = f;
+    return f;
+}
+
+
+TFTPInflatedFile::TFTPInflatedFile()
+{
+    inflated = restarts = discarded = warmed = 0;
+    warm = NULL;
+    refs = 1;
+    live = ended = bad = raw = false;
+    outpos = 0;
+    points = NULL;
+    npoints = maxpoints = 0;
+    clock = 0;
+    scratch = new unsigned char[CHUNK];
+}
+
+
+TFTPInflatedFile::~TFTPInflatedFile()
+{
+    if (live)
+        inflateEnd(&strm);
+    for (int i = 0; i < npoints; i++)
+        delete points[i];
+    if (points)
+        delete[] points;
+    for (int i = 0; i < nchunks; i++)
+        if (chunks[i].data)
+            delete[] chunks[i].data;
+    delete[] chunks;
+    delete[] scratch;
+    if (warm)
+        delete warm;
+    src->release();
+}
+
+
+void TFTPInflatedFile::release()
+{
+    assert(refs > 0);
+    if (--refs)
+        return;
+
+    if (prev)
+        prev->next = next;
+    else
+        *list = next;
+    if (next)
+        next->prev = prev;
+    delete this;
+}
+
+
+ssize_t TFTPInflatedFile::read(off_t offset, unsigned char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        off_t pos = offset + done;
+        off_t start = pos - pos % CHUNK;
+        const unsigned char *p;
+        size_t have;
+        if (warm && (p = warm->get(pos / CHUNK)) != NULL)
+        {
+            // Some process has been this way before.
+            have = usize - start < CHUNK ? usize - start : (off_t)CHUNK;
+            warmed++;
+        }
+        else
+        {
+            Chunk *ch = chunk(start);
+            if (!ch)
+                return bad || pos < usize ? -1 : (ssize_t)done;
+            p = ch->data;
+            have = ch->len;
+        }
+
+        // Running out before the size in the trailer is as bad as a corrupt
+        // stream: either way the client's copy would be short.
+        size_t skip = pos % CHUNK;
+        if (skip >= have)
+            return pos < usize ? -1 : (ssize_t)done;
+        size_t n = have - skip < len - done ? have - skip : len - done;
+        memcpy(buf + done, p + skip, n);
+        done += n;
+    }
+    return done;
+}
+
+
+TFTPInflatedFile::Chunk *TFTPInflatedFile::chunk(off_t start)
+{
+    Chunk *victim = NULL;
+    for (int i = 0; i < nchunks; i++)
+    {
+        Chunk *ch = &chunks[i];
+        if (ch->start == start)
+        {
+            ch->used = ++clock;
+            return ch;
+        }
+        if (!victim || (victim->start >= 0
+                        && (ch->start < 0 || ch->used < victim->used)))
+            victim = ch;
+    }
+
+    victim->start = -1;
+    if (!seek(start))
+        return NULL;
+    if (!victim->data)
+        victim->data = new unsigned char[CHUNK];
+    ssize_t n = inflate_to(victim->data, CHUNK);
+    // The .gz may have been cut short under us, and some of that was zeros.
+    if (n >= 0 && (src->truncated(src->size() - 1)
+                   || (start + n >= usize && !at_end())))
+    {
+        if (live)
+            inflateEnd(&strm);
+        live = false;
+        bad = true;
+        n = -1;
+    }
+    if (n < 0)
+        return NULL;
+    inflated++;
+    if (warm)
+        warm->put(start / CHUNK, victim->data, n);
+    victim->start = start;
+    victim->len = n;
+    victim->used = ++clock;
+    return victim;
+}
+
+
+// Gets 'strm' to uncompressed offset 'to': by carrying on if it's on the
+// way there already, or else from the last saved point before it.
+bool TFTPInflatedFile::seek(off_t to)
+{
+    // The points are in order of 'out'; find the last one at or before it.
+    int lo = 0, hi = npoints;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (points[mid]->out <= to)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    Point *p = lo ? points[lo - 1] : NULL;
+
+    if (!live || outpos > to || (p && p->out > outpos))
+    {
+        if (live)
+        {
+            inflateEnd(&strm);
+            restarts++;
+        }
+        memset(&strm, 0, sizeof(strm));
+        live = false;
+        const unsigned char *base = src->bytes();
+        raw = p != NULL;
+        if (raw)
+        {
+            // Raw deflate from the middle, primed with the bits of a byte
+            // the previous block ended partway through, and the window.
+            if (inflateInit2(&strm, -15) != Z_OK)
+            {
+                bad = true;
+                return false;
+            }
+            if (p->bits)
+                inflatePrime(&strm, p->bits, base[p->in - 1] >> (8 - p->bits));
+            strm.next_in = (Bytef *)base + p->in;
+            inflateSetDictionary(&strm, p->window, p->wlen);
+            outpos = p->out;
+        }
+        else
+        {
+            if (inflateInit2(&strm, 15 + 16) != Z_OK)
+            {
+                bad = true;
+                return false;
+            }
+            strm.next_in = (Bytef *)base;
+            outpos = 0;
+        }
+        live = true;
+        ended = bad = false;
+    }
+
+    while (outpos < to)
+    {
+        size_t want = to - outpos < CHUNK ? to - outpos : (off_t)CHUNK;
+        ssize_t n = inflate_to(scratch, want);
+        if (n < (ssize_t)want)
+            return false;
+        discarded += n;
+    }
+    return true;
+}
+
+
+// Decompresses up to 'len' bytes into 'buf', saving a point whenever
+// SPAN bytes have gone by since the last one.
+ssize_t TFTPInflatedFile::inflate_to(unsigned char *buf, size_t len)
+{
+    const unsigned char *base = src->bytes();
+    strm.next_out = buf;
+    strm.avail_out = len;
+    while (strm.avail_out && !ended)
+    {
+        // avail_in is only 32 bits wide.
+        if (!strm.avail_in)
+        {
+            off_t left = src->size() - (strm.next_in - base);
+            strm.avail_in = left < (1 << 30) ? left : (1 << 30);
+        }
+
+        unsigned int before = strm.avail_out;
+        int ret = inflate(&strm, Z_BLOCK);
+        outpos += before - strm.avail_out;
+        if (ret == Z_STREAM_END)
+            ended = true;
+        else if (ret != Z_OK)
+        {
+            // Corrupt or cut short; the next seek() starts over.
+            inflateEnd(&strm);
+            live = false;
+            bad = true;
+            return -1;
+        }
+        else if ((strm.data_type & 128) && !(strm.data_type & 64)
+                 && outpos >= (npoints ? points[npoints - 1]->out : 0) + SPAN)
+            save_point();
+    }
+    return len - strm.avail_out;
+}
+
+
+// Whether 'strm', having produced 'usize' bytes, is at the end of the
+// file.  ISIZE is only the size modulo 2^32, and only that of the last
+// gzip member, so a file of 4GB or more or of several members would
+// otherwise be served short, and look complete.
+bool TFTPInflatedFile::at_end()
+{
+    unsigned char extra;
+    if (!ended && inflate_to(&extra, 1) != 0)
+        return false;
+    // Inflating from a point stops short of the trailer.
+    off_t left = src->size() - (strm.next_in - src->bytes());
+    return outpos == usize && left == (raw ? 8 : 0);
+}
+
+
+// Called between two deflate blocks, the only place inflate can be
+// restarted from.
+void TFTPInflatedFile::save_point()
+{
+    Point *p = new Point;
+    p->out = outpos;
+    p->in = strm.next_in - src->bytes();
+    p->bits = strm.data_type & 7;
+    p->wlen = sizeof(p->window);
+    if (inflateGetDictionary(&strm, p->window, &p->wlen) != Z_OK)
+    {
+        delete p;
+        return;
+    }
+
+    if (npoints == maxpoints)
+    {
+        maxpoints = maxpoints ? maxpoints * 2 : 16;
+        Point **np = new Point *[maxpoints];
+        if (points)
+        {
+            memcpy(np, points, npoints * sizeof(*np));
+            delete[] points;
+        }
+        points = np;
+    }
+    points[npoints++] = p;
+}
@@ -0,0 +1,126 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPInflatedFile, a gzipped file served as what it uncompresses to, so
+ * big images can be kept compressed.  Output is decompressed a chunk at a
+ * time into a small cache shared by every transfer of the file, and the
+ * inflater's state is saved every so often along the way so that going
+ * back (a retransmission, or a reader further behind) restarts from the
+ * nearest saved point instead of from the top of the file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPINFLATE_H
+#define __WVTFTPINFLATE_H
+
+#include "wvtftppacket.h"
+#include "wvtftpwarm.h"
+#include <sys/types.h>
+#include <zlib.h>
+
+class TFTPInflatedFile
+{
+public:
+    enum {
+        CHUNK = 65536,          // bytes decompressed (and cached) at a time
+        SPAN = 1048576          // most output between two saved points
+    };
+
+    /** Returns a new reference to the entry in 'list' for the gzip file
+     * open on 'fd', creating it if needed: the file is mapped through
+     * 'maps', and up to 'nchunks' CHUNKs of its output are cached.  With a
+     * 'warmdir', all of the output is also kept in a TFTPWarmFile there, as
+     * long as that directory stays under 'warmlimit' bytes.  Returns NULL
+     * if it can't be mapped or isn't gzip.
+     */
+    static TFTPInflatedFile *get(TFTPInflatedFile *&list, int fd,
+                                 TFTPMappedFile *&maps, int nchunks,
+                                 const char *warmdir = NULL,
+                                 off_t warmlimit = 0);
+    void addref()
+        { refs++; }
+    void release();
+
+    /** The uncompressed size, from the gzip trailer.  Reading the end of
+     * the file fails if that turns out not to be the whole of it.
+     */
+    off_t size() const
+        { return usize; }
+
+    /** Copies up to 'len' bytes, from 'offset' in the uncompressed file,
+     * to 'buf'.  Returns the number copied, which is less than 'len' only
+     * at the end of the file, or -1 if the compressed data is bad.
+     */
+    ssize_t read(off_t offset, unsigned char *buf, size_t len);
+
+    // How many times a chunk had to be decompressed, how many of those
+    // restarted rather than carrying on, the output thrown away on the way
+    // to them, and how many chunks were already in the warm copy.
+    long long inflated, restarts, discarded, warmed;
+
+private:
+    TFTPInflatedFile();
+    ~TFTPInflatedFile();
+
+    struct Point
+    {
+        off_t out;              // uncompressed offset
+        off_t in;               // compressed offset of the next whole byte
+        int bits;               // bits of the byte before 'in' still to use
+        unsigned int wlen;
+        unsigned char window[32768];    // the output just before 'out'
+    };
+
+    struct Chunk
+    {
+        off_t start;            // -1 if unused
+        size_t len;
+        unsigned long used;     // when it was last wanted, for eviction
+        unsigned char *data;
+    };
+
+    dev_t dev;
+    ino_t ino;
+    off_t filesize;
+    time_t mtime;
+    off_t usize;
+    int refs;
+    TFTPInflatedFile **list, *next, *prev;
+
+    TFTPMappedFile *src;
+    TFTPWarmFile *warm;         // output kept across restarts, if any
+    z_stream strm;
+    bool live;                  // 'strm' is set up...
+    bool ended;                 // ...and has reached the end of the data
+    bool bad;
+    bool raw;                   // started from a point, so no gzip header
+    off_t outpos;               // uncompressed offset 'strm' is at
+    Point **points;
+    int npoints, maxpoints;
+    Chunk *chunks;
+    int nchunks;
+    unsigned long clock;
+    unsigned char *scratch;     // for output on the way to a chunk
+
+    Chunk *chunk(off_t start);
+    bool seek(off_t to);
+    ssize_t inflate_to(unsigned char *buf, size_t len);
+    bool at_end();
+    void save_point();
+};
+
+#endif // __WVTFTPINFLATE_H
@@ -0,0 +1,89 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpmcast.h"
+#include <assert.h>
+#include <sys/stat.h>
+
+TFTPMcastSession *TFTPMcastSession::find(TFTPMcastSession *list, int fd,
+                                         size_t blksize)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return NULL;
+
+    // Once the group has seen the whole file it's too late to join: the
+    // newcomer would get everything by unicast repair, one at a time.
+    for (TFTPMcastSession *s = list; s; s = s->next)
+    {
+        if (!s->pass_done && s->ino == st.st_ino && s->dev == st.st_dev
+            && s->blksize == blksize && s->filesize == st.st_size
+            && s->mtime == st.st_mtime)
+        {
+            s->refs++;
+            return s;
+        }
+    }
+    return NULL;
+}
+
+
+TFTPMcastSession *TFTPMcastSession::create(TFTPMcastSession *&list, int fd,
+                                           size_t blksize,
+                                           const WvIPPortAddr &group)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return NULL;
+
+    TFTPMcastSession *s = new TFTPMcastSession;
+    s->group = group;
+    s->sent = 0;
+    s->pass_done = false;
+    gettimeofday(&s->active, NULL);
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->filesize = st.st_size;
+    s->mtime = st.st_mtime;
+    s->blksize = blksize;
+    s->refs = 1;
+    s->list = &list;
+    s->prev = NULL;
+    s->next = list;
+    if (list)
+        list->prev = s;
+    list = s;
+    return s;
+}
+
+
+void TFTPMcastSession::release()
+{
+    assert(refs > 0);
+    if (--refs)
+        return;
+
+    if (prev)
+        prev->next = next;
+    else
+        *list = next;
+    if (next)
+        next->prev = prev;
+    delete this;
+}
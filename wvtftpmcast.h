@@ -0,0 +1,73 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPMcastSession, one RFC 2090 multicast transfer: a file, read in blocks
+ * of one size, sent once to a multicast group while one client at a time
+ * (the master) acknowledges it.  The protocol logic is in WvTFTPBase and
+ * WvTFTPServer; this only keeps track of who is in which session.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPMCAST_H
+#define __WVTFTPMCAST_H
+
+#include "wvaddr.h"
+#include <sys/time.h>
+#include <sys/types.h>
+
+class TFTPMcastSession
+{
+public:
+    /** Returns a new reference to the session in 'list' that is still
+     * multicasting the file open on 'fd' in blocks of 'blksize', or NULL.
+     */
+    static TFTPMcastSession *find(TFTPMcastSession *list, int fd,
+                                  size_t blksize);
+
+    /** Adds a session for the file open on 'fd' to 'list', sending to
+     * 'group', and returns it with one reference.  Returns NULL if 'fd'
+     * can't be fstat()ed.
+     */
+    static TFTPMcastSession *create(TFTPMcastSession *&list, int fd,
+                                    size_t blksize,
+                                    const WvIPPortAddr &group);
+
+    void addref()
+        { refs++; }
+    void release();
+
+    WvIPPortAddr group;
+    WvIPPortAddr master;        // the client acknowledging the group's data
+    int sent;                   // highest block sent to the group
+    bool pass_done;             // a master has had the whole file; nothing
+                                //     more goes to the group
+    struct timeval active;      // when the session last heard from a master
+    TFTPMcastSession *next;
+
+private:
+    TFTPMcastSession() { }
+
+    dev_t dev;
+    ino_t ino;
+    off_t filesize;
+    time_t mtime;
+    size_t blksize;
+    int refs;
+    TFTPMcastSession **list, *prev;
+};
+
+#endif // __WVTFTPMCAST_H
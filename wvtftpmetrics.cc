@@ -0,0 +1,253 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpmetrics.h"
+#include "wvtftpstats.h"
+#include "wvistreamlist.h"
+#include "wvstrutils.h"
+#include "wvtcplistener.h"
+#include "wvunixlistener.h"
+#include <stdio.h>
+
+static const char *direction_names[TFTPStats::NUM_DIRECTIONS] = {
+    "read", "write"
+};
+
+static const char *abort_names[TFTPStats::NUM_ABORT_REASONS] = {
+    "error_packet", "protocol", "timeouts", "idle", "restarted", "admin",
+    "read_error"
+};
+
+
+static void header(WvString &out, const char *name, const char *type,
+                   const char *help)
+{
+    out.append("# HELP wvtftp_%s %s\n# TYPE wvtftp_%s %s\n",
+               name, help, name, type);
+}
+
+
+static void value(WvString &out, const char *name, const char *labels,
+                  uint64_t val)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "wvtftp_%s%s %llu\n", name, labels,
+             (unsigned long long)val);
+    out.append(buf);
+}
+
+
+static void counter(WvString &out, const char *name, const char *help,
+                    uint64_t val)
+{
+    header(out, name, "counter", help);
+    value(out, name, "", val);
+}
+
+
+static void histogram(WvString &out, const char *name, const char *help,
+                      const TFTPHistogram &h)
+{
+    header(out, name, "histogram", help);
+
+    WvString bucket("%s_bucket", name);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < h.nbounds; i++)
+    {
+        char labels[64];
+        cumulative += h.counts[i];
+        snprintf(labels, sizeof(labels), "{le=\"%llu\"}",
+                 (unsigned long long)h.bounds[i]);
+        value(out, bucket, labels, cumulative);
+    }
+    cumulative += h.counts[h.nbounds];
+    value(out, bucket, "{le=\"+Inf\"}", cumulative);
+    value(out, WvString("%s_sum", name), "", h.sum);
+    value(out, WvString("%s_count", name), "", h.count);
+}
+
+
+WvString TFTPMetrics::format()
+{
+    TFTPStats s(false);
+    TFTPStats::collect(s);
+
+    WvString out("");
+    int i;
+
+    header(out, "transfers_started_total", "counter", "Transfers started.");
+    for (i = 0; i < TFTPStats::NUM_DIRECTIONS; i++)
+        value(out, "transfers_started_total",
+              WvString("{direction=\"%s\"}", direction_names[i]),
+              s.started[i]);
+
+    header(out, "transfers_completed_total", "counter",
+           "Transfers completed successfully.");
+    for (i = 0; i < TFTPStats::NUM_DIRECTIONS; i++)
+        value(out, "transfers_completed_total",
+              WvString("{direction=\"%s\"}", direction_names[i]),
+              s.completed[i]);
+
+    header(out, "transfers_aborted_total", "counter",
+           "Transfers aborted, by reason.");
+    for (i = 0; i < TFTPStats::NUM_ABORT_REASONS; i++)
+        value(out, "transfers_aborted_total",
+              WvString("{reason=\"%s\"}", abort_names[i]), s.aborted[i]);
+
+    counter(out, "requests_rejected_total",
+            "Requests refused before a transfer started.", s.rejected);
+    counter(out, "requests_duplicate_total",
+            "Resent requests answered by repeating the first reply.",
+            s.duplicate_requests);
+    counter(out, "sent_bytes_total",
+            "DATA payload bytes sent, including retransmits.",
+            s.bytes_sent);
+    counter(out, "received_bytes_total", "DATA payload bytes received.",
+            s.bytes_received);
+    counter(out, "data_retransmits_total",
+            "DATA packets resent after a timeout.", s.retransmits);
+    counter(out, "shared_blocks_total",
+            "DATA blocks another transfer of the same file had read.",
+            s.shared_blocks);
+    counter(out, "shared_misses_total",
+            "DATA blocks of a shared file that no other transfer had read.",
+            s.shared_misses);
+    counter(out, "mapped_blocks_total",
+            "DATA blocks sent from a memory-mapped file.", s.mapped_blocks);
+    counter(out, "inflated_blocks_total",
+            "DATA blocks decompressed from a gzipped file.",
+            s.inflated_blocks);
+    counter(out, "timeouts_total", "Retransmission timeouts.", s.timeouts);
+    counter(out, "prefetches_total",
+            "Files read ahead because clients usually ask for them next.",
+            s.prefetches);
+    counter(out, "prefetch_hits_total",
+            "Requests for the file we guessed the client would want.",
+            s.prefetch_hits);
+    counter(out, "prefetch_misses_total",
+            "Requests for something other than the file we guessed.",
+            s.prefetch_misses);
+
+    header(out, "active_connections", "gauge", "Transfers in progress.");
+    value(out, "active_connections", "", s.active);
+    header(out, "queued_requests", "gauge",
+           "Requests waiting for a transfer slot.");
+    value(out, "queued_requests", "", s.queued);
+    header(out, "scheduler_backlog_bytes", "gauge",
+           "Bytes waiting for the \"Max Rate KB\" limit.");
+    value(out, "scheduler_backlog_bytes", "", s.backlog);
+    header(out, "preload_pending_files", "gauge",
+           "Files from [TFTP/Preload] not read into memory yet.");
+    value(out, "preload_pending_files", "", s.preload_pending);
+    header(out, "preloaded_bytes", "gauge",
+           "Bytes of [TFTP/Preload] files read into memory.");
+    value(out, "preloaded_bytes", "", s.preloaded_bytes);
+    header(out, "preload_milliseconds", "gauge",
+           "How long reading in [TFTP/Preload] took.");
+    value(out, "preload_milliseconds", "", s.preload_ms);
+    header(out, "sequence_model_bytes", "gauge",
+           "Memory used learning the order files are asked for in.");
+    value(out, "sequence_model_bytes", "", s.sequence_bytes);
+
+    histogram(out, "rtt_milliseconds", "Round-trip time per ACK.", s.rtt);
+    histogram(out, "completion_milliseconds",
+              "Duration of completed transfers.", s.completion);
+    histogram(out, "window_packets",
+              "Window (prefetch) size at the end of each transfer.",
+              s.window);
+
+    return out;
+}
+
+
+IWvListener *TFTPMetrics::create_listener(const UniConf &cfg, WvLog &log)
+{
+    IWvListener *l = NULL;
+    AcceptCallback cb;
+
+    int port = cfg["TFTP/Metrics Port"].getmeint(0);
+    WvString sock = cfg["TFTP/Metrics Socket"].getme("");
+    if (port)
+    {
+        // Deliberately loopback only; put a real proxy in front of it if it
+        // must be reachable from elsewhere.
+        l = new WvTCPListener(WvIPPortAddr("127.0.0.1", port));
+        cb.http = true;
+    }
+    else if (!!sock)
+    {
+        unlink(sock);
+        l = new WvUnixListener(WvUnixAddr(sock), 0600);
+        cb.http = false;
+    }
+    else
+        return NULL;
+
+    if (!l->isok())
+    {
+        log(WvLog::Error, "Can't listen for metrics requests: %s\n",
+            l->errstr());
+        WVRELEASE(l);
+        return NULL;
+    }
+
+    l->onaccept(cb);
+    log(WvLog::Info, "Serving metrics on %s.\n",
+        port ? WvString("127.0.0.1:%s", port) : sock);
+    return l;
+}
+
+
+void TFTPMetrics::accept_plain(IWvStream *_s)
+{
+    WvStreamClone *s = new WvStreamClone(_s);
+    s->write(format());
+    s->flush_then_close(1000);
+    WvIStreamList::globallist.append(s, true, "TFTP metrics client");
+}
+
+
+void TFTPMetrics::accept_http(IWvStream *_s)
+{
+    WvStreamClone *s = new WvStreamClone(_s);
+    s->setcallback(wv::bind(&TFTPMetrics::http_cb, s));
+    WvIStreamList::globallist.append(s, true, "TFTP metrics client");
+}
+
+
+void TFTPMetrics::http_cb(WvStream *s)
+{
+    // Whatever was asked for, the answer is the same; just wait for the
+    // end of the request headers.
+    char *line;
+    while ((line = s->getline(0)) != NULL)
+    {
+        if (*trim_string(line))
+            continue;
+
+        WvString body(format());
+        s->print("HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %s\r\n"
+                 "Connection: close\r\n\r\n", body.len());
+        s->write(body);
+        s->flush_then_close(1000);
+        return;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPMetrics exports the TFTPStats of every server in the process in
+ * Prometheus text format, over loopback HTTP or a UNIX socket.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPMETRICS_H
+#define __WVTFTPMETRICS_H
+
+#include "wvstring.h"
+#include "wvlog.h"
+#include "uniconf.h"
+
+class IWvStream;
+class IWvListener;
+
+class TFTPMetrics
+{
+public:
+    /** Creates the listener configured in [TFTP], if any:
+     * "Metrics Port" serves HTTP on 127.0.0.1:<port>, and "Metrics Socket"
+     * writes the metrics to anyone who connects to that UNIX socket.
+     * Returns NULL if neither is set.  The caller owns the listener and
+     * must add it to a stream list.
+     */
+    static IWvListener *create_listener(const UniConf &cfg, WvLog &log);
+
+    /** Returns the current metrics in Prometheus text format. */
+    static WvString format();
+
+private:
+    static void accept_http(IWvStream *s);
+    static void accept_plain(IWvStream *s);
+    static void http_cb(WvStream *s);
+
+    struct AcceptCallback
+    {
+        bool http;
+        void operator()(IWvStream *s)
+        {
+            if (http)
+                accept_http(s);
+            else
+                accept_plain(s);
+        }
+    };
+};
+
+#endif // __WVTFTPMETRICS_H
@@ -0,0 +1,508 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftppacket.h"
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+TFTPPacket::TFTPPacket(TFTPPacketPool *_pool, size_t _size)
+{
+    pool = _pool;
+    mapped = NULL;
+    next = NULL;
+    refs = 0;
+    size = _size;
+    len = 0;
+    hdrlen = 4;
+    memset(hdr, 0, sizeof(hdr));
+    data = size ? new unsigned char[size] : NULL;
+}
+
+
+TFTPPacket::~TFTPPacket()
+{
+    if (data)
+        delete[] data;
+}
+
+
+int TFTPPacket::iovecs(struct iovec *iov) const
+{
+    iov[0].iov_base = (void *)hdr;
+    iov[0].iov_len = hdrlen;
+    if (!len)
+        return 1;
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    return 2;
+}
+
+
+void TFTPPacket::release()
+{
+    assert(refs > 0);
+    if (--refs)
+        return;
+
+    if (mapped)
+    {
+        mapped->release();
+        mapped = NULL;
+        data = NULL;
+    }
+    pool->put(this);
+}
+
+
+TFTPPacketPool::TFTPPacketPool(int _maxfree)
+{
+    classes = NULL;
+    maxfree = _maxfree;
+}
+
+
+TFTPPacketPool::~TFTPPacketPool()
+{
+    while (classes)
+    {
+        SizeClass *sc = classes;
+        classes = sc->next;
+        while (sc->free)
+        {
+            TFTPPacket *pkt = sc->free;
+            sc->free = pkt->next;
+            delete pkt;
+        }
+        delete sc;
+    }
+}
+
+
+TFTPPacketPool::SizeClass *TFTPPacketPool::find(size_t size)
+{
+    // There are only ever a handful of distinct blksizes in use, so a
+    // short list beats anything fancier.
+    SizeClass *sc;
+    for (sc = classes; sc; sc = sc->next)
+        if (sc->size == size)
+            return sc;
+
+    sc = new SizeClass;
+    sc->size = size;
+    sc->free = NULL;
+    sc->nfree = 0;
+    sc->next = classes;
+    classes = sc;
+    return sc;
+}
+
+
+TFTPPacket *TFTPPacketPool::get(size_t size)
+{
+    SizeClass *sc = find(size);
+    TFTPPacket *pkt;
+
+    if (sc->free)
+    {
+        pkt = sc->free;
+        sc->free = pkt->next;
+        sc->nfree--;
+    }
+    else
+        pkt = new TFTPPacket(this, size);
+
+    pkt->next = NULL;
+    pkt->refs = 1;
+    pkt->len = 0;
+    pkt->hdrlen = 4;
+    return pkt;
+}
+
+
+void TFTPPacketPool::put(TFTPPacket *pkt)
+{
+    SizeClass *sc = find(pkt->size);
+    if (sc->nfree >= maxfree)
+    {
+        delete pkt;
+        return;
+    }
+    pkt->next = sc->free;
+    sc->free = pkt;
+    sc->nfree++;
+}
+
+
+PktRing::PktRing(int _size)
+{
+    size = _size > 0 ? _size : 1;
+    nums = new int[size];
+    pkts = new TFTPPacket *[size];
+    for (int i = 0; i < size; i++)
+    {
+        nums[i] = -1;
+        pkts[i] = NULL;
+    }
+}
+
+
+PktRing::~PktRing()
+{
+    for (int i = 0; i < size; i++)
+        if (pkts[i])
+            pkts[i]->release();
+    delete[] pkts;
+    delete[] nums;
+}
+
+
+void PktRing::set(int pktnum, TFTPPacket *pkt)
+{
+    int slot = pktnum % size;
+    pkt->addref();
+    if (pkts[slot])
+        pkts[slot]->release();
+    pkts[slot] = pkt;
+    nums[slot] = pktnum;
+}
+
+
+TFTPPacket *PktRing::get(int pktnum)
+{
+    int slot = pktnum % size;
+    if (nums[slot] != pktnum)
+        return NULL;
+    return pkts[slot];
+}
+
+
+TFTPSharedFile *TFTPSharedFile::get(TFTPSharedFile *&list, int fd,
+                                    size_t blksize, int nblocks)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return NULL;
+
+    TFTPSharedFile *f;
+    for (f = list; f; f = f->next)
+    {
+        if (f->ino == st.st_ino && f->dev == st.st_dev
+            && f->blksize == blksize && f->filesize == st.st_size
+            && f->mtime == st.st_mtime)
+        {
+            // The ring stays once there is one, if readers come and go.
+            if (++f->refs == 2 && !f->ring)
+                f->ring = new PktRing(f->nblocks);
+            return f;
+        }
+    }
+
+    f = new TFTPSharedFile;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->filesize = st.st_size;
+    f->mtime = st.st_mtime;
+    f->blksize = blksize;
+    f->nblocks = nblocks;
+    f->refs = 1;
+    f->ring = NULL;
+    f->list = &list;
+    f->prev = NULL;
+    f->next = list;
+    if (list)
+        list->prev = f;
+    list = f;
+    return f;
+}
+
+
+TFTPSharedFile::~TFTPSharedFile()
+{
+    if (ring)
+        delete ring;
+}
+
+
+void TFTPSharedFile::release()
+{
+    assert(refs > 0);
+    if (--refs)
+        return;
+
+    if (prev)
+        prev->next = next;
+    else
+        *list = next;
+    if (next)
+        next->prev = prev;
+    delete this;
+}
+
+
+// Every mapping, so the SIGBUS handler can tell one of ours cut short from
+// a real bug.  Only the main thread adds and removes them.
+struct MappedRange
+{
+    unsigned char *base;
+    size_t len;
+    int faults;
+};
+
+static const int MAX_RANGES = 4096;
+static MappedRange ranges[MAX_RANGES];
+static int nranges;                     // slots ever used
+static bool catching;
+static long pagesize;
+static volatile unsigned char sink;
+
+
+static void on_sigbus(int sig, siginfo_t *si, void *)
+{
+    unsigned char *addr = (unsigned char *)si->si_addr;
+    int n = si->si_code == BUS_ADRERR
+        ? __atomic_load_n(&nranges, __ATOMIC_ACQUIRE) : 0;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned char *base =
+            __atomic_load_n(&ranges[i].base, __ATOMIC_ACQUIRE);
+        if (!base || addr < base || addr >= base + ranges[i].len)
+            continue;
+
+        // Carry on with a page of zeros where the file used to be, and
+        // leave it to whoever reads it to check truncated().
+        void *page = (void *)((uintptr_t)addr & ~(uintptr_t)(pagesize - 1));
+        if (mmap(page, pagesize, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+            == MAP_FAILED)
+            break;
+        __atomic_add_fetch(&ranges[i].faults, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // Not ours: die as we would have without the handler.
+    signal(sig, SIG_DFL);
+}
+
+
+void TFTPMappedFile::catch_truncation()
+{
+    pagesize = sysconf(_SC_PAGESIZE);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    catching = sigaction(SIGBUS, &sa, NULL) == 0;
+}
+
+
+bool TFTPMappedFile::truncated(off_t offset) const
+{
+    if (!catching || slot < 0)
+        return false;
+    if (offset >= 0 && offset < filesize)
+        sink = base[offset];
+    return __atomic_load_n(&ranges[slot].faults, __ATOMIC_ACQUIRE) > 0;
+}
+
+
+TFTPMappedFile *TFTPMappedFile::get(TFTPMappedFile *&list, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0
+        || (off_t)(size_t)st.st_size != st.st_size)
+        return NULL;
+
+    TFTPMappedFile *f;
+    for (f = list; f; f = f->next)
+    {
+        if (f->ino == st.st_ino && f->dev == st.st_dev
+            && f->filesize == st.st_size && f->mtime == st.st_mtime)
+        {
+            f->refs++;
+            return f;
+        }
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    // Transfers go through a file from start to end.
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    f = new TFTPMappedFile;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->filesize = st.st_size;
+    f->mtime = st.st_mtime;
+    f->base = (unsigned char *)base;
+    // With no slot left, a truncation is as fatal as it ever was.
+    for (f->slot = 0; f->slot < nranges; f->slot++)
+        if (!ranges[f->slot].base)
+            break;
+    if (f->slot < MAX_RANGES)
+    {
+        ranges[f->slot].len = st.st_size;
+        ranges[f->slot].faults = 0;
+        __atomic_store_n(&ranges[f->slot].base, f->base, __ATOMIC_RELEASE);
+        if (f->slot == nranges)
+            __atomic_store_n(&nranges, nranges + 1, __ATOMIC_RELEASE);
+    }
+    else
+        f->slot = -1;
+    f->refs = 1;
+    f->list = &list;
+    f->prev = NULL;
+    f->next = list;
+    if (list)
+        list->prev = f;
+    list = f;
+    return f;
+}
+
+
+TFTPMappedFile::~TFTPMappedFile()
+{
+    if (slot >= 0)
+        __atomic_store_n(&ranges[slot].base, (unsigned char *)NULL,
+                         __ATOMIC_RELEASE);
+    munmap(base, filesize);
+}
+
+
+void TFTPMappedFile::release()
+{
+    assert(refs > 0);
+    if (--refs)
+        return;
+
+    if (prev)
+        prev->next = next;
+    else
+        *list = next;
+    if (next)
+        next->prev = prev;
+    delete this;
+}
+
+
+TFTPPacket *TFTPMappedFile::slice(TFTPPacketPool &pool, off_t offset,
+                                  size_t len)
+{
+    // A packet without a buffer of its own, whose payload we point at.
+    TFTPPacket *pkt = pool.get(0);
+    if (offset >= 0 && offset < filesize)
+    {
+        pkt->data = base + offset;
+        pkt->len = filesize - offset < (off_t)len ? filesize - offset : len;
+    }
+    refs++;
+    pkt->mapped = this;
+    return pkt;
+}
+
+
+TFTPSendBatch::TFTPSendBatch()
+{
+    count = 0;
+}
+
+
+TFTPSendBatch::~TFTPSendBatch()
+{
+    for (int i = 0; i < count; i++)
+        pkts[i]->release();
+}
+
+
+void TFTPSendBatch::add(const struct sockaddr *sa, socklen_t salen,
+                        TFTPPacket *pkt)
+{
+    assert(count < MAX);
+    if (salen > sizeof(addrs[count]))
+        salen = sizeof(addrs[count]);
+    memcpy(&addrs[count], sa, salen);
+    addrlens[count] = salen;
+    pkt->addref();
+    pkts[count++] = pkt;
+}
+
+
+int TFTPSendBatch::flush(int fd)
+{
+    if (!count)
+        return 0;
+
+    struct msghdr hdrs[MAX];
+    for (int i = 0; i < count; i++)
+    {
+        memset(&hdrs[i], 0, sizeof(hdrs[i]));
+        hdrs[i].msg_name = &addrs[i];
+        hdrs[i].msg_namelen = addrlens[i];
+        hdrs[i].msg_iov = iovs[i];
+        hdrs[i].msg_iovlen = pkts[i]->iovecs(iovs[i]);
+    }
+
+    int failed = 0, err = 0;
+#ifdef __linux__
+    struct mmsghdr msgs[MAX];
+    for (int i = 0; i < count; i++)
+    {
+        msgs[i].msg_hdr = hdrs[i];
+        msgs[i].msg_len = 0;
+    }
+    // sendmmsg() stops at the first datagram it can't send; skip that one
+    // and carry on with the rest.
+    for (int sent = 0; sent < count; )
+    {
+        int n = sendmmsg(fd, msgs + sent, count - sent, 0);
+        if (n > 0)
+            sent += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+        {
+            err = errno;
+            failed++;
+            sent++;
+        }
+    }
+#else
+    for (int i = 0; i < count; i++)
+    {
+        if (sendmsg(fd, &hdrs[i], 0) < 0)
+        {
+            err = errno;
+            failed++;
+        }
+    }
+#endif
+
+    for (int i = 0; i < count; i++)
+        pkts[i]->release();
+    count = 0;
+    errno = err;
+    return failed;
+}
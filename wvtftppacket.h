@@ -0,0 +1,277 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPPacket and TFTPPacketPool.  Outgoing packets are built in
+ * reference-counted buffers instead of one shared array, so a block can be
+ * kept around for retransmission (or handed to several destinations) without
+ * being rebuilt or copied.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPPACKET_H
+#define __WVTFTPPACKET_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+class TFTPPacketPool;
+class TFTPMappedFile;
+
+/** A single outgoing TFTP packet.
+ * The opcode and block number (or error code) live in 'hdr' and the payload
+ * in 'data', so the two are handed to the kernel as separate iovecs and the
+ * payload never has to be shifted around to make room for a header.
+ */
+class TFTPPacket
+{
+public:
+    unsigned char hdr[4];       // opcode + block number / error code
+    size_t hdrlen;              // 4, or 2 for an OACK
+    unsigned char *data;        // payload
+    size_t len;                 // bytes of payload in use
+    size_t size;                // payload capacity
+
+    /** Sets up a DATA/ACK/ERROR style header. */
+    void sethdr(int opcode, int num)
+    {
+        hdr[0] = (opcode >> 8) & 0xff;
+        hdr[1] = opcode & 0xff;
+        hdr[2] = (num % 65536) / 256;
+        hdr[3] = (num % 65536) % 256;
+        hdrlen = 4;
+    }
+
+    /** Fills in 'iov' (which must have room for two entries) and returns
+     * the number of entries used.
+     */
+    int iovecs(struct iovec *iov) const;
+
+    size_t pktlen() const
+        { return hdrlen + len; }
+
+    void addref()
+        { refs++; }
+    /** Drops a reference; the last one hands the buffer back to its pool. */
+    void release();
+
+private:
+    friend class TFTPPacketPool;
+    friend class TFTPMappedFile;
+    TFTPPacket(TFTPPacketPool *_pool, size_t _size);
+    ~TFTPPacket();
+
+    TFTPPacketPool *pool;
+    TFTPMappedFile *mapped;     // whose pages 'data' points into, if they
+                                //     aren't our own
+    TFTPPacket *next;           // free list link
+    int refs;
+};
+
+
+/** A pool of TFTPPackets, kept in one free list per payload size.
+ * Every connection asks for buffers of its negotiated blksize, so after the
+ * first window the pool hands back recycled buffers instead of allocating.
+ */
+class TFTPPacketPool
+{
+public:
+    // _maxfree is the number of idle buffers kept for each size.
+    TFTPPacketPool(int _maxfree = 64);
+    ~TFTPPacketPool();
+
+    /** Returns a packet with room for 'size' bytes of payload and one
+     * reference, which belongs to the caller.
+     */
+    TFTPPacket *get(size_t size);
+
+private:
+    friend class TFTPPacket;
+    void put(TFTPPacket *pkt);
+
+    struct SizeClass
+    {
+        size_t size;
+        TFTPPacket *free;
+        int nfree;
+        SizeClass *next;
+    };
+
+    SizeClass *classes;
+    int maxfree;
+
+    SizeClass *find(size_t size);
+};
+
+
+/** Remembers the packets of the current window, so a retransmission can
+ * resend them as they were built instead of re-reading the file.
+ */
+class PktRing
+{
+public:
+    PktRing(int _size);
+    ~PktRing();
+
+    // Stores a new reference to 'pkt' as block 'pktnum'.
+    void set(int pktnum, TFTPPacket *pkt);
+    // Returns block 'pktnum' if it is still in the ring, or NULL.
+    TFTPPacket *get(int pktnum);
+
+private:
+    int size;
+    int *nums;
+    TFTPPacket **pkts;
+};
+
+
+/** The recently read blocks of one file, shared by every transfer reading
+ * it with the same blksize.  When a boot storm has dozens of clients a few
+ * blocks apart in the same image, each block is read once and the same
+ * packet goes to all of them.  Nothing is cached until a second reader
+ * turns up.
+ */
+class TFTPSharedFile
+{
+public:
+    /** Returns a new reference to the entry in 'list' for the file open on
+     * 'fd', read in blocks of 'blksize', creating it if needed.  Up to
+     * 'nblocks' blocks are kept.  Returns NULL if 'fd' can't be fstat()ed.
+     */
+    static TFTPSharedFile *get(TFTPSharedFile *&list, int fd,
+                               size_t blksize, int nblocks);
+    void release();
+
+    /** Returns block 'num' if it is cached, or NULL.  No reference is
+     * added.
+     */
+    TFTPPacket *block(int num)
+        { return ring ? ring->get(num) : NULL; }
+    /** Caches a new reference to 'pkt' as block 'num'. */
+    void set(int num, TFTPPacket *pkt)
+        { if (ring) ring->set(num, pkt); }
+
+private:
+    TFTPSharedFile() { }
+    ~TFTPSharedFile();
+
+    // A file that changes gets a new entry, as its size or mtime differ.
+    dev_t dev;
+    ino_t ino;
+    off_t filesize;
+    time_t mtime;
+    size_t blksize;
+    int nblocks;
+    int refs;
+    PktRing *ring;
+    TFTPSharedFile **list, *next, *prev;
+};
+
+
+/** A whole file mapped into memory, shared by every transfer reading it
+ * (or reading a member of it, if it's an archive).  Since the header goes
+ * out as an iovec of its own, any block of any blksize is just a slice of
+ * the mapping: sending it takes no read() and no copy.  Each packet made
+ * from it keeps it mapped until it is gone.
+ */
+class TFTPMappedFile
+{
+public:
+    /** Returns a new reference to the mapping in 'list' of the file open on
+     * 'fd', mapping it if needed.  Returns NULL if it can't be mapped: it is
+     * empty, not a regular file, or mmap() fails.
+     */
+    static TFTPMappedFile *get(TFTPMappedFile *&list, int fd);
+    void addref()
+        { refs++; }
+    void release();
+
+    /** Returns a packet from 'pool', with one reference, whose payload is
+     * the 'len' bytes at 'offset' in place, or as many of them as the file
+     * has.
+     */
+    TFTPPacket *slice(TFTPPacketPool &pool, off_t offset, size_t len);
+
+    const unsigned char *bytes() const
+        { return base; }
+    off_t size() const
+        { return filesize; }
+
+    /** Installs a SIGBUS handler, so that reading pages of a mapped file
+     * that has since been truncated finds zeros instead of killing the
+     * process.  Call it once, before any threads start.
+     */
+    static void catch_truncation();
+
+    /** Reads the byte at 'offset' and returns true if this, or anything
+     * before it, found the file cut short since it was mapped.  Data read
+     * from the mapping is only good if this is false afterwards.  Always
+     * false unless catch_truncation() has been called.
+     */
+    bool truncated(off_t offset) const;
+
+private:
+    TFTPMappedFile() { }
+    ~TFTPMappedFile();
+
+    // A file replaced by rename() gets a new entry, as its inode, size or
+    // mtime differ; one changed in place is caught by truncated().
+    dev_t dev;
+    ino_t ino;
+    off_t filesize;
+    time_t mtime;
+    unsigned char *base;
+    int slot;                   // in the table the SIGBUS handler checks
+    int refs;
+    TFTPMappedFile **list, *next, *prev;
+};
+
+
+/** Datagrams waiting to be handed to the kernel, so a burst of them (a
+ * window, or the same block for many clients) costs one sendmmsg() call
+ * instead of one sendmsg() each.
+ */
+class TFTPSendBatch
+{
+public:
+    enum { MAX = 64 };
+
+    TFTPSendBatch();
+    ~TFTPSendBatch();
+
+    bool full() const
+        { return count == MAX; }
+
+    /** Keeps a new reference to 'pkt', to be sent to 'sa'. */
+    void add(const struct sockaddr *sa, socklen_t salen, TFTPPacket *pkt);
+
+    /** Sends everything on 'fd' and empties the batch.  Returns the number
+     * of datagrams that couldn't be sent, with errno set for the last.
+     */
+    int flush(int fd);
+
+private:
+    int count;
+    TFTPPacket *pkts[MAX];
+    struct sockaddr_storage addrs[MAX];
+    socklen_t addrlens[MAX];
+    struct iovec iovs[MAX][2];
+};
+
+#endif // __WVTFTPPACKET_H
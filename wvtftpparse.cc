@@ -0,0 +1,195 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpparse.h"
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+
+static const char *option_names[TFTP_NUM_OPTIONS] = {
+    "blksize", "tsize", "timeout", "multicast", "blkoffset"
+};
+
+static const char *mode_names[] = {
+    "netascii", "octet", "mail"
+};
+
+#define NUM_MODES (int)(sizeof(mode_names) / sizeof(*mode_names))
+
+// The hash only looks at the length and the first letter.  It happens to
+// be perfect for the names above (and leaves room for a few more); the
+// constructor below checks that whenever one is added.
+#define HASH_SIZE 16
+
+static inline unsigned int name_hash(const char *s, size_t len)
+{
+    return (len * 3 + (s[0] | 0x20)) & (HASH_SIZE - 1);
+}
+
+
+struct HashTables
+{
+    signed char options[HASH_SIZE];
+    signed char modes[HASH_SIZE];
+
+    HashTables()
+    {
+        memset(options, -1, sizeof(options));
+        memset(modes, -1, sizeof(modes));
+        for (int i = 0; i < TFTP_NUM_OPTIONS; i++)
+        {
+            unsigned int h = name_hash(option_names[i],
+                                       strlen(option_names[i]));
+            assert(options[h] < 0);
+            options[h] = i;
+        }
+        for (int i = 0; i < NUM_MODES; i++)
+        {
+            unsigned int h = name_hash(mode_names[i], strlen(mode_names[i]));
+            assert(modes[h] < 0);
+            modes[h] = i;
+        }
+    }
+};
+
+// Built on first use, so lookups work even from other static constructors.
+static const HashTables &tables()
+{
+    static const HashTables t;
+    return t;
+}
+
+
+static int lookup(const signed char *table, const char **names,
+                  const char *name, size_t len)
+{
+    if (!len)
+        return -1;
+    int i = table[name_hash(name, len)];
+    if (i < 0 || strlen(names[i]) != len || strncasecmp(name, names[i], len))
+        return -1;
+    return i;
+}
+
+
+TFTPOptionId tftp_option_id(const char *name, size_t len)
+{
+    return (TFTPOptionId)lookup(tables().options, option_names, name, len);
+}
+
+
+TFTPModeId tftp_mode_id(const char *name, size_t len)
+{
+    return (TFTPModeId)lookup(tables().modes, mode_names, name, len);
+}
+
+
+const char *tftp_option_name(TFTPOptionId id)
+{
+    if (id < 0 || id >= TFTP_NUM_OPTIONS)
+        return "";
+    return option_names[id];
+}
+
+
+bool tftp_parse_uint(const TFTPStrView &v, unsigned long long max,
+                     unsigned long long &out)
+{
+    if (!v.len)
+        return false;
+
+    unsigned long long val = 0;
+    for (size_t i = 0; i < v.len; i++)
+    {
+        unsigned int digit = (unsigned char)v.str[i] - '0';
+        if (digit > 9 || val > (max - digit) / 10)
+            return false;
+        val = val * 10 + digit;
+    }
+    out = val;
+    return true;
+}
+
+
+// Returns the string starting at 'p', which must be NUL-terminated before
+// 'end', and moves 'p' past its NUL.
+static inline TFTPStrView next_string(const char *&p, const char *end)
+{
+    TFTPStrView v;
+    const char *nul = (const char *)memchr(p, 0, end - p);
+    v.str = p;
+    v.len = nul - p;
+    p = nul + 1;
+    return v;
+}
+
+
+int tftp_parse_request(const char *pkt, size_t len, TFTPRequest &req)
+{
+    req.filename.str = req.mode_str.str = NULL;
+    req.filename.len = req.mode_str.len = 0;
+    req.mode = TFTP_MODE_UNKNOWN;
+    req.nopts = 0;
+    for (int i = 0; i < TFTP_NUM_OPTIONS; i++)
+        req.known[i] = -1;
+
+    if (len < 2)
+        return -1;
+    req.opcode = (unsigned char)pkt[0] << 8 | (unsigned char)pkt[1];
+    if (req.opcode != 1 && req.opcode != 2)
+        return -1;
+
+    // Since the last byte is a NUL, every scan below is sure to stop.
+    if (len < 4 || len > TFTP_MAX_REQUEST || pkt[len - 1])
+        return 4;
+
+    const char *p = pkt + 2, *end = pkt + len;
+    req.filename = next_string(p, end);
+    if (p == end)
+        return 4;
+    req.mode_str = next_string(p, end);
+    req.mode = tftp_mode_id(req.mode_str.str, req.mode_str.len);
+    if (req.mode == TFTP_MODE_UNKNOWN)
+        return 4;
+
+    while (p < end)
+    {
+        TFTPStrView name = next_string(p, end);
+        if (!name.len)
+            break;              // some clients pad requests with NULs
+        if (p == end)
+            return 8;           // a name without a value
+        TFTPStrView value = next_string(p, end);
+
+        TFTPOptionId id = tftp_option_id(name.str, name.len);
+        if (id != TFTP_OPT_UNKNOWN && req.known[id] >= 0)
+            continue;
+        if (req.nopts == TFTP_MAX_OPTIONS)
+            continue;
+
+        if (id != TFTP_OPT_UNKNOWN)
+            req.known[id] = req.nopts;
+        TFTPOption &o = req.opts[req.nopts++];
+        o.id = id;
+        o.name = name;
+        o.value = value;
+    }
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * A single-pass, zero-copy parser for TFTP read and write requests.
+ *
+ * The results point straight into the datagram, which is never modified;
+ * every string they point to is NUL-terminated there.  Mode and option
+ * names are recognized case-insensitively through small perfect hash
+ * tables.  Packets that are obviously junk (wrong opcode, oversized, or
+ * not NUL-terminated) are rejected before looking at anything past their
+ * first two and last bytes.
+ *
+ * This file deliberately uses nothing from WvStreams, so it can be built
+ * on its own for fuzzing (see fuzz/).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPPARSE_H
+#define __WVTFTPPARSE_H
+
+#include <stddef.h>
+
+// RFC 2347 limits requests to 512 bytes, but some clients send long paths
+// anyway; anything past this is certainly not a request.
+#define TFTP_MAX_REQUEST 1024
+
+// Options beyond this many are ignored.
+#define TFTP_MAX_OPTIONS 16
+
+struct TFTPStrView
+{
+    const char *str;            // NUL-terminated, inside the packet
+    size_t len;
+};
+
+// Values match WvTFTPBase::TFTPMode.
+enum TFTPModeId
+{
+    TFTP_MODE_UNKNOWN = -1,
+    TFTP_MODE_NETASCII = 0,
+    TFTP_MODE_OCTET,
+    TFTP_MODE_MAIL
+};
+
+enum TFTPOptionId
+{
+    TFTP_OPT_UNKNOWN = -1,
+    TFTP_OPT_BLKSIZE = 0,       // RFC 2348
+    TFTP_OPT_TSIZE,             // RFC 2349
+    TFTP_OPT_TIMEOUT,           // RFC 2349
+    TFTP_OPT_MULTICAST,         // RFC 2090
+    TFTP_OPT_BLKOFFSET,         // ours: resume at a block
+    TFTP_NUM_OPTIONS
+};
+
+struct TFTPOption
+{
+    TFTPOptionId id;
+    TFTPStrView name, value;
+};
+
+struct TFTPRequest
+{
+    int opcode;                 // 1 (RRQ) or 2 (WRQ)
+    TFTPStrView filename;
+    TFTPStrView mode_str;
+    TFTPModeId mode;
+
+    // Options in the order they were sent.  A known option sent more than
+    // once appears only the first time.
+    int nopts;
+    TFTPOption opts[TFTP_MAX_OPTIONS];
+
+    // Index into 'opts' of each known option, or -1 if it wasn't sent.
+    int known[TFTP_NUM_OPTIONS];
+};
+
+/** Parses the request in the 'len' bytes at 'pkt' into 'req'.
+ * Returns 0 if it's a well-formed request, a TFTP error code to answer
+ * with if it's a malformed one (4 for a bad filename or mode, 8 for bad
+ * options), or -1 if it isn't a request at all and should be dropped
+ * without a reply.  When the mode is the problem, 'req.mode_str' is set
+ * and 'req.mode' is TFTP_MODE_UNKNOWN.
+ */
+int tftp_parse_request(const char *pkt, size_t len, TFTPRequest &req);
+
+/** Looks up an option or mode name, ignoring case. */
+TFTPOptionId tftp_option_id(const char *name, size_t len);
+TFTPModeId tftp_mode_id(const char *name, size_t len);
+
+/** Returns the canonical (lower case) name of a known option. */
+const char *tftp_option_name(TFTPOptionId id);
+
+/** Parses a plain decimal number no larger than 'max' into 'out'.  Signs,
+ * spaces, empty strings and overflow are all errors.
+ */
+bool tftp_parse_uint(const TFTPStrView &v, unsigned long long max,
+                     unsigned long long &out);
+
+#endif // __WVTFTPPARSE_H
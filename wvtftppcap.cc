@@ -0,0 +1,224 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftppcap.h"
+#include <stdint.h>
+#include <string.h>
+
+// LINKTYPE_IPV4 is the same thing as LINKTYPE_RAW, under a newer number.
+#define TFTP_PCAP_LINKTYPE_IPV4 228
+
+struct PcapFileHeader
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct PcapRecordHeader
+{
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+static const size_t IP_HDRLEN = 20, UDP_HDRLEN = 8;
+
+
+static uint32_t swap32(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000)
+        | (x << 24);
+}
+
+
+static void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+
+TFTPPcapWriter::TFTPPcapWriter(WvStringParm filename)
+{
+    f = fopen(filename, "wb");
+    if (!f)
+        return;
+
+    PcapFileHeader hdr;
+    hdr.magic = TFTP_PCAP_MAGIC;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone = 0;
+    hdr.sigfigs = 0;
+    hdr.snaplen = 65535;
+    hdr.linktype = TFTP_PCAP_LINKTYPE_RAW;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+    {
+        fclose(f);
+        f = NULL;
+    }
+}
+
+
+TFTPPcapWriter::~TFTPPcapWriter()
+{
+    if (f)
+        fclose(f);
+}
+
+
+void TFTPPcapWriter::record(const struct timeval &tv,
+                            const WvIPPortAddr &src, const WvIPPortAddr &dst,
+                            const void *data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    recordv(tv, src, dst, &iov, 1);
+}
+
+
+void TFTPPcapWriter::recordv(const struct timeval &tv,
+                             const WvIPPortAddr &src,
+                             const WvIPPortAddr &dst,
+                             const struct iovec *iov, int iovcnt)
+{
+    if (!f)
+        return;
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len > 65535 - IP_HDRLEN - UDP_HDRLEN)
+        return;
+
+    unsigned char h[IP_HDRLEN + UDP_HDRLEN];
+    memset(h, 0, sizeof(h));
+    h[0] = 0x45;                                // IPv4, 20 byte header
+    put16(h + 2, IP_HDRLEN + UDP_HDRLEN + len);
+    h[6] = 0x40;                                // don't fragment
+    h[8] = 64;                                  // TTL
+    h[9] = 17;                                  // UDP
+    memcpy(h + 12, src.rawdata(), 4);
+    memcpy(h + 16, dst.rawdata(), 4);
+
+    uint32_t sum = 0;
+    for (size_t i = 0; i < IP_HDRLEN; i += 2)
+        sum += h[i] << 8 | h[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    put16(h + 10, ~sum & 0xffff);
+
+    put16(h + IP_HDRLEN, src.port);
+    put16(h + IP_HDRLEN + 2, dst.port);
+    put16(h + IP_HDRLEN + 4, UDP_HDRLEN + len);
+    // A zero UDP checksum means "not computed", which is legal for IPv4.
+
+    PcapRecordHeader rec;
+    rec.ts_sec = tv.tv_sec;
+    rec.ts_usec = tv.tv_usec;
+    rec.incl_len = rec.orig_len = sizeof(h) + len;
+
+    fwrite(&rec, sizeof(rec), 1, f);
+    fwrite(h, sizeof(h), 1, f);
+    for (int i = 0; i < iovcnt; i++)
+        fwrite(iov[i].iov_base, iov[i].iov_len, 1, f);
+}
+
+
+TFTPPcapReader::TFTPPcapReader(WvStringParm filename)
+{
+    swapped = false;
+    f = fopen(filename, "rb");
+    if (!f)
+        return;
+
+    PcapFileHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) == 1)
+    {
+        if (hdr.magic == swap32(TFTP_PCAP_MAGIC))
+        {
+            swapped = true;
+            hdr.linktype = swap32(hdr.linktype);
+        }
+        if ((hdr.magic == TFTP_PCAP_MAGIC || swapped)
+            && (hdr.linktype == TFTP_PCAP_LINKTYPE_RAW
+                || hdr.linktype == TFTP_PCAP_LINKTYPE_IPV4))
+            return;
+    }
+
+    fclose(f);
+    f = NULL;
+}
+
+
+TFTPPcapReader::~TFTPPcapReader()
+{
+    if (f)
+        fclose(f);
+}
+
+
+bool TFTPPcapReader::next(struct timeval &tv, WvIPPortAddr &src,
+                          WvIPPortAddr &dst, const unsigned char *&data,
+                          size_t &len)
+{
+    if (!f)
+        return false;
+
+    PcapRecordHeader rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        if (swapped)
+        {
+            rec.ts_sec = swap32(rec.ts_sec);
+            rec.ts_usec = swap32(rec.ts_usec);
+            rec.incl_len = swap32(rec.incl_len);
+        }
+        if (rec.incl_len > sizeof(buf)
+            || fread(buf, rec.incl_len, 1, f) != 1)
+            return false;
+
+        size_t ihl = (buf[0] & 0x0f) * 4;
+        if (rec.incl_len < IP_HDRLEN + UDP_HDRLEN || (buf[0] >> 4) != 4
+            || buf[9] != 17 || ihl < IP_HDRLEN
+            || rec.incl_len < ihl + UDP_HDRLEN)
+            continue;
+
+        const unsigned char *udp = buf + ihl;
+        size_t udplen = udp[4] << 8 | udp[5];
+        if (udplen < UDP_HDRLEN || ihl + udplen > rec.incl_len)
+            continue;
+
+        tv.tv_sec = rec.ts_sec;
+        tv.tv_usec = rec.ts_usec;
+        src = WvIPPortAddr(WvIPAddr(buf + 12), udp[0] << 8 | udp[1]);
+        dst = WvIPPortAddr(WvIPAddr(buf + 16), udp[2] << 8 | udp[3]);
+        data = udp + UDP_HDRLEN;
+        len = udplen - UDP_HDRLEN;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,84 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPPcapWriter and TFTPPcapReader: per-transfer packet captures in
+ * classic pcap format (LINKTYPE_RAW), readable by tcpdump and Wireshark and
+ * replayable with bench/tftpreplay.  The IPv4 and UDP headers are
+ * synthesized from the addresses we know, since the socket never shows us
+ * the real ones.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPPCAP_H
+#define __WVTFTPPCAP_H
+
+#include "wvstring.h"
+#include "wvaddr.h"
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#define TFTP_PCAP_MAGIC 0xa1b2c3d4
+#define TFTP_PCAP_LINKTYPE_RAW 101
+
+class TFTPPcapWriter
+{
+public:
+    /** Creates (or truncates) 'filename' and writes the pcap header. */
+    TFTPPcapWriter(WvStringParm filename);
+    ~TFTPPcapWriter();
+
+    bool isok() const
+        { return f != NULL; }
+
+    /** Records a UDP datagram from 'src' to 'dst' whose payload is the
+     * concatenation of 'iov'.
+     */
+    void recordv(const struct timeval &tv, const WvIPPortAddr &src,
+                 const WvIPPortAddr &dst, const struct iovec *iov,
+                 int iovcnt);
+    void record(const struct timeval &tv, const WvIPPortAddr &src,
+                const WvIPPortAddr &dst, const void *data, size_t len);
+
+private:
+    FILE *f;
+};
+
+
+class TFTPPcapReader
+{
+public:
+    TFTPPcapReader(WvStringParm filename);
+    ~TFTPPcapReader();
+
+    bool isok() const
+        { return f != NULL; }
+
+    /** Reads the next UDP/IPv4 datagram, skipping anything else in the
+     * file.  'data' points into the reader and is valid until the next
+     * call.  Returns false at the end of the file.
+     */
+    bool next(struct timeval &tv, WvIPPortAddr &src, WvIPPortAddr &dst,
+              const unsigned char *&data, size_t &len);
+
+private:
+    FILE *f;
+    bool swapped;
+    unsigned char buf[65536 + 64];
+};
+
+#endif // __WVTFTPPCAP_H
@@ -0,0 +1,187 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftppreload.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Read in (or locked) at a time, between checks for being told to stop.
+static const off_t STEP = 8 * 1024 * 1024;
+
+// Where touched pages are read to, so the reads can't be left out.
+static volatile unsigned char sink;
+
+TFTPPreload::TFTPPreload(TFTPMappedFile *&_maps, bool _lock, bool _huge)
+    : maps(_maps)
+{
+    lock = _lock;
+    huge = _huge;
+    files = NULL;
+    nfiles = 0;
+    total = 0;
+    started = false;
+    pthread_mutex_init(&mutex, NULL);
+    stop = done = false;
+    pending = elapsed = unlocked = 0;
+    loaded = 0;
+}
+
+
+TFTPPreload::~TFTPPreload()
+{
+    if (started)
+    {
+        pthread_mutex_lock(&mutex);
+        stop = true;
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, NULL);
+    }
+    while (files)
+    {
+        File *f = files;
+        files = f->next;
+        f->map->release();
+        delete f;
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+
+bool TFTPPreload::add(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    TFTPMappedFile *map = TFTPMappedFile::get(maps, fd);
+    close(fd);
+    if (!map)
+        return false;
+
+    // Two patterns may well name the same file.
+    for (File *f = files; f; f = f->next)
+    {
+        if (f->map == map)
+        {
+            map->release();
+            return true;
+        }
+    }
+
+    File *f = new File;
+    f->map = map;
+    f->next = files;
+    files = f;
+    nfiles++;
+    total += map->size();
+    return true;
+}
+
+
+bool TFTPPreload::start()
+{
+    pending = nfiles;
+    if (pthread_create(&thread, NULL, run, this) != 0)
+        return false;
+    started = true;
+    return true;
+}
+
+
+bool TFTPPreload::progress(int &_pending, off_t &_loaded, int &ms,
+                           int &_unlocked)
+{
+    pthread_mutex_lock(&mutex);
+    _pending = pending;
+    _loaded = loaded;
+    ms = elapsed;
+    _unlocked = unlocked;
+    bool ret = done;
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+
+void *TFTPPreload::run(void *arg)
+{
+    TFTPPreload *p = (TFTPPreload *)arg;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // Nothing but the thread touches the list once it has started.
+    for (File *f = p->files; f; f = f->next)
+        p->load(f);
+
+    gettimeofday(&end, NULL);
+    pthread_mutex_lock(&p->mutex);
+    p->elapsed = (end.tv_sec - start.tv_sec) * 1000
+        + (end.tv_usec - start.tv_usec) / 1000;
+    p->done = true;
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+
+void TFTPPreload::load(File *f)
+{
+    unsigned char *base = (unsigned char *)f->map->bytes();
+    off_t size = f->map->size();
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+#ifdef MADV_HUGEPAGE
+    if (huge)
+        madvise(base, size, MADV_HUGEPAGE);
+#endif
+
+    bool locking = lock;
+    for (off_t pos = 0; pos < size; pos += STEP)
+    {
+        pthread_mutex_lock(&mutex);
+        bool stopping = stop;
+        pthread_mutex_unlock(&mutex);
+        if (stopping)
+            return;
+
+        size_t len = size - pos < STEP ? size - pos : STEP;
+        if (locking && mlock(base + pos, len) < 0)
+        {
+            // Probably RLIMIT_MEMLOCK; the pages can still be read in.
+            locking = false;
+            pthread_mutex_lock(&mutex);
+            unlocked++;
+            pthread_mutex_unlock(&mutex);
+        }
+        if (!locking)
+        {
+            madvise(base + pos, len, MADV_WILLNEED);
+            // Waits for the reads that started.
+            for (size_t i = 0; i < len; i += pagesize)
+                sink = base[pos + i];
+        }
+
+        pthread_mutex_lock(&mutex);
+        loaded += len;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    pthread_mutex_lock(&mutex);
+    pending--;
+    pthread_mutex_unlock(&mutex);
+}
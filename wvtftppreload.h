@@ -0,0 +1,91 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPPreload, the files a boot storm is going to want, mapped at startup
+ * and read into memory by a thread of their own so that the first clients
+ * after a restart don't wait on the disk inside the packet loop.  The
+ * mappings are the same TFTPMappedFiles the transfers use, and they stay
+ * for as long as the TFTPPreload does.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPPRELOAD_H
+#define __WVTFTPPRELOAD_H
+
+#include "wvtftppacket.h"
+#include <pthread.h>
+#include <sys/types.h>
+
+class TFTPPreload
+{
+public:
+    /** Files go through 'maps'.  With 'lock', their pages are mlock()ed
+     * so they can't be evicted again; with 'huge', the kernel is asked to
+     * back them with huge pages where it can.
+     */
+    TFTPPreload(TFTPMappedFile *&maps, bool lock, bool huge);
+    /** Stops the thread (between pages) and lets go of the files. */
+    ~TFTPPreload();
+
+    /** Maps the file at 'path' to be read in.  Returns false if it can't
+     * be opened or mapped.  Only before start().
+     */
+    bool add(const char *path);
+
+    /** Starts reading in everything add()ed.  Returns false if the thread
+     * can't be started, in which case the files are read in on first use
+     * as usual.
+     */
+    bool start();
+
+    /** Progress so far: files not read in yet, and bytes that have been.
+     * Returns true once the thread is done, with how long it took in
+     * 'ms' and the number of files that couldn't be locked in 'unlocked'.
+     */
+    bool progress(int &pending, off_t &loaded, int &ms, int &unlocked);
+
+    int count() const
+        { return nfiles; }
+    off_t bytes() const
+        { return total; }
+
+private:
+    struct File
+    {
+        TFTPMappedFile *map;
+        File *next;
+    };
+
+    TFTPMappedFile *&maps;
+    bool lock, huge;
+    File *files;
+    int nfiles;
+    off_t total;
+
+    pthread_t thread;
+    bool started;
+    // The rest is shared with the thread, under 'mutex'.
+    pthread_mutex_t mutex;
+    bool stop, done;
+    int pending, elapsed, unlocked;
+    off_t loaded;
+
+    static void *run(void *arg);
+    void load(File *f);
+};
+
+#endif // __WVTFTPPRELOAD_H
@@ -0,0 +1,215 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpsched.h"
+#include <string.h>
+
+TFTPSchedFlow::TFTPSchedFlow(TFTPScheduler *_sched,
+                             const WvIPPortAddr &_dest, int _weight)
+    : dest(_dest)
+{
+    sched = _sched;
+    weight = _weight > 0 ? _weight : 1;
+    queue = NULL;
+    size = head = count = 0;
+    deficit = 0;
+    next = prev = NULL;
+}
+
+
+TFTPSchedFlow::~TFTPSchedFlow()
+{
+    if (count)
+        sched->deactivate(this);
+    for (; count; count--)
+    {
+        sched->queued -= queue[head].cost;
+        queue[head].pkt->release();
+        head = (head + 1) % size;
+    }
+    if (queue)
+        delete[] queue;
+}
+
+
+void TFTPSchedFlow::enqueue(TFTPPacket *pkt, size_t cost, int num)
+{
+    if (count == size)
+    {
+        int newsize = size ? size * 2 : 8;
+        Entry *q = new Entry[newsize];
+        for (int i = 0; i < count; i++)
+            q[i] = queue[(head + i) % size];
+        if (queue)
+            delete[] queue;
+        queue = q;
+        size = newsize;
+        head = 0;
+    }
+
+    Entry &e = queue[(head + count) % size];
+    pkt->addref();
+    e.pkt = pkt;
+    e.cost = cost;
+    e.num = num;
+    sched->queued += cost;
+    if (count++ == 0)
+        sched->activate(this);
+}
+
+
+TFTPScheduler::TFTPScheduler()
+{
+    rate = burst = 0;
+    tokens = 0;
+    memset(&last, 0, sizeof(last));
+    quantum = 1500;
+    queued = 0;
+    current = NULL;
+}
+
+
+TFTPScheduler::~TFTPScheduler()
+{
+    // Every flow must be gone by now; they point back at us.
+}
+
+
+void TFTPScheduler::set_rate(long long _rate, long long _burst)
+{
+    rate = _rate > 0 ? _rate : 0;
+    burst = _burst > 0 ? _burst : 1;
+    if (tokens > burst)
+        tokens = burst;
+}
+
+
+void TFTPScheduler::refill(const struct timeval &now)
+{
+    if (!last.tv_sec && !last.tv_usec)
+        tokens = burst;
+    else
+    {
+        long long us = (now.tv_sec - last.tv_sec) * 1000000LL
+            + (now.tv_usec - last.tv_usec);
+        if (us <= 0)
+            return;
+        tokens += (double)rate * us / 1000000;
+        if (tokens > burst)
+            tokens = burst;
+    }
+    last = now;
+}
+
+
+void TFTPScheduler::activate(TFTPSchedFlow *f)
+{
+    if (!current)
+    {
+        f->next = f->prev = f;
+        f->deficit = quantum * f->weight;
+        current = f;
+        return;
+    }
+
+    // Join at the end of the round; the first turn brings a quantum.
+    f->deficit = 0;
+    f->next = current;
+    f->prev = current->prev;
+    current->prev->next = f;
+    current->prev = f;
+}
+
+
+void TFTPScheduler::deactivate(TFTPSchedFlow *f)
+{
+    // An idle flow may not save up its share for later.
+    f->deficit = 0;
+    if (f->next == f)
+        current = NULL;
+    else
+    {
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+        if (current == f)
+        {
+            current = f->prev;
+            next_turn();
+        }
+    }
+    f->next = f->prev = NULL;
+}
+
+
+void TFTPScheduler::next_turn()
+{
+    current = current->next;
+    current->deficit += quantum * current->weight;
+}
+
+
+TFTPPacket *TFTPScheduler::dequeue(const struct timeval &now,
+                                   WvIPPortAddr &dest, int &num)
+{
+    if (!current)
+        return NULL;
+
+    // Each turn adds to a deficit, so this ends even for packets much
+    // bigger than the quantum.
+    while (current->deficit < (long long)current->queue[current->head].cost)
+        next_turn();
+
+    TFTPSchedFlow *f = current;
+    TFTPSchedFlow::Entry &e = f->queue[f->head];
+    if (rate)
+    {
+        refill(now);
+        // A packet costing more than the whole bucket goes when it's full.
+        double need = (long long)e.cost < burst ? e.cost : burst;
+        if (tokens < need)
+            return NULL;
+        tokens -= e.cost;
+    }
+
+    TFTPPacket *pkt = e.pkt;
+    dest = f->dest;
+    num = e.num;
+    f->deficit -= e.cost;
+    queued -= e.cost;
+    f->head = (f->head + 1) % f->size;
+    if (--f->count == 0)
+        deactivate(f);
+    return pkt;
+}
+
+
+int TFTPScheduler::wait(const struct timeval &now)
+{
+    if (!current)
+        return -1;
+    if (!rate)
+        return 0;
+
+    refill(now);
+    long long cost = current->queue[current->head].cost;
+    double need = (cost < burst ? cost : burst) - tokens;
+    if (need <= 0)
+        return 0;
+    return (int)(need * 1000 / rate) + 1;
+}
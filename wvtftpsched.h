@@ -0,0 +1,127 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPScheduler, a server-wide egress scheduler.  The window logic decides
+ * which packets a transfer may send; the scheduler decides when they
+ * actually go out.  Each transfer is a flow with its own queue, backlogged
+ * flows take turns by deficit round-robin (each turn is worth 'quantum'
+ * times the flow's weight in bytes), and a token bucket holds the total to
+ * 'rate' bytes per second.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPSCHED_H
+#define __WVTFTPSCHED_H
+
+#include "wvaddr.h"
+#include "wvtftppacket.h"
+#include <sys/time.h>
+
+class TFTPScheduler;
+
+/** The queue of one transfer.  Deleting it drops whatever it still holds
+ * and takes it out of its scheduler's rotation.
+ */
+class TFTPSchedFlow
+{
+public:
+    TFTPSchedFlow(TFTPScheduler *_sched, const WvIPPortAddr &_dest,
+                  int _weight);
+    ~TFTPSchedFlow();
+
+    /** Queues a new reference to 'pkt', which is block (or ACK) 'num'.
+     * 'cost' is what it counts for against the flow's share and the rate;
+     * usually its length, but an ACK asking for the next block of an
+     * upload costs that block.
+     */
+    void enqueue(TFTPPacket *pkt, size_t cost, int num);
+
+    /** Returns the number of packets not sent yet. */
+    int pending() const
+        { return count; }
+
+    WvIPPortAddr dest;
+    int weight;
+
+private:
+    friend class TFTPScheduler;
+
+    struct Entry
+    {
+        TFTPPacket *pkt;
+        size_t cost;
+        int num;
+    };
+
+    TFTPScheduler *sched;
+    Entry *queue;               // ring of 'size' entries
+    int size, head, count;
+    long long deficit;
+    TFTPSchedFlow *next, *prev; // backlogged flows, in a circle
+};
+
+
+class TFTPScheduler
+{
+public:
+    TFTPScheduler();
+    ~TFTPScheduler();
+
+    /** Limits the total to 'rate' bytes/s, with bursts of up to 'burst'
+     * bytes.  A rate of 0 turns the limit (and the scheduler) off.
+     */
+    void set_rate(long long _rate, long long _burst);
+    bool enabled() const
+        { return rate > 0; }
+
+    /** The bytes each turn is worth for a flow of weight 1. */
+    void set_quantum(size_t _quantum)
+        { quantum = _quantum ? _quantum : 1; }
+
+    /** Returns the next packet that may be sent at 'now' (a reference the
+     * caller must release), setting 'dest' and 'num' from its queue entry;
+     * or NULL if nothing may be sent yet.
+     */
+    TFTPPacket *dequeue(const struct timeval &now, WvIPPortAddr &dest,
+                        int &num);
+
+    /** Returns the ms until dequeue() will have something, or -1 if every
+     * queue is empty.
+     */
+    int wait(const struct timeval &now);
+
+    /** Returns the total cost of everything queued, in bytes. */
+    long long backlog() const
+        { return queued; }
+
+private:
+    friend class TFTPSchedFlow;
+
+    long long rate, burst;
+    double tokens;
+    struct timeval last;
+    size_t quantum;
+    long long queued;
+    TFTPSchedFlow *current;     // whose turn it is, or NULL if all idle
+
+    void refill(const struct timeval &now);
+    void activate(TFTPSchedFlow *f);
+    void deactivate(TFTPSchedFlow *f);
+    void next_turn();
+};
+
+#endif // __WVTFTPSCHED_H
@@ -0,0 +1,220 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpsequence.h"
+#include <string.h>
+
+static unsigned int name_hash(const char *s)
+{
+    // FNV-1a
+    unsigned int h = 2166136261U;
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619U;
+    return h;
+}
+
+
+TFTPSequence::TFTPSequence(size_t _budget, int _min_percent)
+{
+    budget = _budget;
+    min_percent = _min_percent;
+    memset(names, 0, sizeof(names));
+    memset(edges, 0, sizeof(edges));
+    nedges = 0;
+    memset(clients, 0, sizeof(clients));
+    used = sizeof(*this);
+}
+
+
+TFTPSequence::~TFTPSequence()
+{
+    for (int i = 0; i < EDGE_BUCKETS; i++)
+    {
+        while (edges[i])
+        {
+            Edge *e = edges[i];
+            edges[i] = e->next;
+            release(e->from);
+            release(e->to);
+            delete e;
+        }
+    }
+    for (int i = 0; i < CLIENTS; i++)
+    {
+        if (clients[i].last)
+            release(clients[i].last);
+        if (clients[i].guess)
+            release(clients[i].guess);
+    }
+}
+
+
+TFTPSequence::Name *TFTPSequence::intern(const char *str)
+{
+    unsigned int h = name_hash(str);
+    Name *n;
+    for (n = names[h % NAME_BUCKETS]; n; n = n->next)
+    {
+        if (n->hash == h && !strcmp(n->str, str))
+        {
+            n->refs++;
+            return n;
+        }
+    }
+
+    size_t len = strlen(str);
+    n = new Name;
+    n->hash = h;
+    n->refs = 1;
+    n->str = new char[len + 1];
+    memcpy(n->str, str, len + 1);
+    n->next = names[h % NAME_BUCKETS];
+    names[h % NAME_BUCKETS] = n;
+    used += sizeof(Name) + len + 1;
+    return n;
+}
+
+
+void TFTPSequence::release(Name *n)
+{
+    if (--n->refs > 0)
+        return;
+    Name **p = &names[n->hash % NAME_BUCKETS];
+    while (*p != n)
+        p = &(*p)->next;
+    *p = n->next;
+    used -= sizeof(Name) + strlen(n->str) + 1;
+    delete[] n->str;
+    delete n;
+}
+
+
+unsigned int TFTPSequence::edge_hash(uint32_t cls, const Name *from)
+{
+    return (from->hash ^ (cls * 2654435761U)) % EDGE_BUCKETS;
+}
+
+
+void TFTPSequence::learn(uint32_t cls, Name *from, Name *to)
+{
+    Edge **bucket = &edges[edge_hash(cls, from)];
+    for (Edge *e = *bucket; e; e = e->next)
+    {
+        if (e->cls == cls && e->from == from && e->to == to)
+        {
+            e->count++;
+            return;
+        }
+    }
+
+    if (used + sizeof(Edge) > budget)
+    {
+        age();
+        bucket = &edges[edge_hash(cls, from)];
+        if (used + sizeof(Edge) > budget)
+            return;
+    }
+
+    Edge *e = new Edge;
+    e->cls = cls;
+    e->from = from;
+    e->to = to;
+    from->refs++;
+    to->refs++;
+    e->count = 1;
+    e->next = *bucket;
+    *bucket = e;
+    nedges++;
+    used += sizeof(Edge);
+}
+
+
+TFTPSequence::Name *TFTPSequence::guess(uint32_t cls, Name *from)
+{
+    Edge *best = NULL;
+    unsigned int total = 0;
+    for (Edge *e = edges[edge_hash(cls, from)]; e; e = e->next)
+    {
+        if (e->cls != cls || e->from != from)
+            continue;
+        total += e->count;
+        if (!best || e->count > best->count)
+            best = e;
+    }
+    if (!best || total < MIN_SEEN
+        || best->count * 100 < total * (unsigned int)min_percent)
+        return NULL;
+    return best->to;
+}
+
+
+void TFTPSequence::age()
+{
+    // Halving everything keeps the proportions of what is common, and
+    // whatever was only seen once goes.
+    for (int i = 0; i < EDGE_BUCKETS; i++)
+    {
+        Edge **p = &edges[i];
+        while (*p)
+        {
+            Edge *e = *p;
+            e->count /= 2;
+            if (e->count)
+            {
+                p = &e->next;
+                continue;
+            }
+            *p = e->next;
+            release(e->from);
+            release(e->to);
+            delete e;
+            nedges--;
+            used -= sizeof(Edge);
+        }
+    }
+}
+
+
+const char *TFTPSequence::request(uint32_t addr, uint32_t cls,
+                                  const char *name, time_t now,
+                                  Outcome &outcome)
+{
+    Name *n = intern(name);
+
+    // One slot per client; a busy subnet just pushes out the odd boot.
+    Client &c = clients[(addr * 2654435761U) % CLIENTS];
+    bool same = c.last && c.addr == addr && now - c.when <= MAX_GAP;
+    outcome = UNPREDICTED;
+    if (same && c.guess)
+        outcome = c.guess == n ? HIT : MISS;
+    if (same && c.last != n)
+        learn(cls, c.last, n);
+
+    if (c.last)
+        release(c.last);
+    if (c.guess)
+        release(c.guess);
+    c.addr = addr;
+    c.when = now;
+    c.last = n;
+    c.guess = guess(cls, n);
+    if (c.guess)
+        c.guess->refs++;
+    return c.guess ? c.guess->str : NULL;
+}
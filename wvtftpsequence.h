@@ -0,0 +1,122 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPSequence, what the server has learned about the order clients ask
+ * for files in.  A PXE boot asks for much the same files in much the same
+ * order every time (pxelinux.0, ldlinux.c32, pxelinux.cfg/default, the
+ * kernel, the initrd), so having seen a class of clients (a subnet, say)
+ * go from one file to the next often enough, we can guess where the next
+ * client is going and have the file ready before it asks.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPSEQUENCE_H
+#define __WVTFTPSEQUENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+class TFTPSequence
+{
+public:
+    enum Outcome {
+        UNPREDICTED = 0,        // we had no guess for this client
+        HIT,                    // it asked for what we guessed
+        MISS                    // it asked for something else
+    };
+
+    /** Learns in at most 'budget' bytes, forgetting the rarest transitions
+     * when it runs out.  A guess needs at least 'min_percent' of the
+     * requests that followed the same file.
+     */
+    TFTPSequence(size_t _budget, int _min_percent);
+    ~TFTPSequence();
+
+    void set_budget(size_t _budget)
+        { budget = _budget; }
+    void set_min_percent(int _min_percent)
+        { min_percent = _min_percent; }
+
+    /** Notes that client 'addr', in class 'cls', asked for 'name' at
+     * 'now', learning from the file it asked for last, and sets 'outcome'
+     * by what we guessed it would ask for.  Returns our guess at what it
+     * asks for next, valid until the next call, or NULL if there's none.
+     */
+    const char *request(uint32_t addr, uint32_t cls, const char *name,
+                        time_t now, Outcome &outcome);
+
+    /** Bytes in use, which is never much over the budget. */
+    size_t memory() const
+        { return used; }
+
+    /** Transitions remembered. */
+    int count() const
+        { return nedges; }
+
+private:
+    // A file name, shared by everything that refers to it.
+    struct Name
+    {
+        Name *next;             // in the same hash bucket
+        unsigned int hash;
+        int refs;
+        char *str;
+    };
+
+    // How often a client in 'cls' asked for 'to' right after 'from'.
+    struct Edge
+    {
+        Edge *next;             // in the same hash bucket
+        uint32_t cls;
+        Name *from, *to;
+        unsigned int count;
+    };
+
+    // The last request from one client, and what we guessed would follow.
+    struct Client
+    {
+        uint32_t addr;
+        time_t when;
+        Name *last;
+        Name *guess;
+    };
+
+    enum {
+        NAME_BUCKETS = 256,
+        EDGE_BUCKETS = 1024,
+        CLIENTS = 1024,         // clients remembered at once
+        MAX_GAP = 300,          // seconds; more and it's a new boot
+        MIN_SEEN = 2            // transitions seen before we guess
+    };
+
+    size_t budget, used;
+    int min_percent;
+    Name *names[NAME_BUCKETS];
+    Edge *edges[EDGE_BUCKETS];
+    int nedges;
+    Client clients[CLIENTS];
+
+    Name *intern(const char *str);
+    void release(Name *n);
+    static unsigned int edge_hash(uint32_t cls, const Name *from);
+    void learn(uint32_t cls, Name *from, Name *to);
+    Name *guess(uint32_t cls, Name *from);
+    void age();
+};
+
+#endif // __WVTFTPSEQUENCE_H
@@ -18,21 +18,48 @@
  */
 
 #include "wvtftpserver.h"
+#include "wvtftptrace.h"
 #include "wvstrutils.h"
 #include "wvtimeutils.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <limits.h>
 #include <unistd.h>
 
-WvTFTPServer::WvTFTPServer(UniConf &_cfg, int _tftp_tick)
-    : WvTFTPBase(_tftp_tick, _cfg["TFTP/Port"].getmeint(69)), cfg(_cfg)
+WvTFTPServer *WvTFTPServer::servers = NULL;
+
+
+WvTFTPServer::WvTFTPServer(UniConf &_cfg, int _tftp_tick, int inherit_fd)
+    : WvTFTPBase(_tftp_tick,
+                 inherit_fd >= 0 ? 0 : _cfg["TFTP/Port"].getmeint(69)),
+      cfg(_cfg),
+      nqueued(0), mcast_sessions(NULL), archive(NULL), preload(NULL),
+      preload_reported(false), sequence(NULL), last_prefetch_time(0)
 {
+    next = servers;
+    servers = this;
+    memset(&archive_checked, 0, sizeof(archive_checked));
+
     bool updated = update_cfg("TFTP Aliases", "TFTP/Aliases");
     updated |= update_cfg("TFTP Alias Once", "TFTP/Alias Once");
     if (updated)
 	log(WvLog::Info, "Converted old-style TFTP configuration.\n");
 
+    tftp_trace.set_path(cfg["TFTP/Trace File"].getme(tftp_trace.getpath()));
+    update_archive();
+    start_preload();
+
+    if (inherit_fd >= 0)
+        adopt_socket(inherit_fd);
+
     if (isok())
         log(WvLog::Info, "WvTFTP listening on %s.\n", *local());
     else
@@ -45,10 +72,300 @@ WvTFTPServer::WvTFTPServer(UniConf &_cfg, int _tftp_tick)
 
 WvTFTPServer::~WvTFTPServer()
 {
+    WvTFTPServer **s;
+    for (s = &servers; *s; s = &(*s)->next)
+    {
+        if (*s == this)
+        {
+            *s = next;
+            break;
+        }
+    }
+    if (preload)
+        delete preload;
+    if (sequence)
+        delete sequence;
+    if (archive)
+        delete archive;
     log(WvLog::Info, "WvTFTP shutting down.\n");
 }
 
 
+void WvTFTPServer::reload()
+{
+    bool updated = update_cfg("TFTP Aliases", "TFTP/Aliases");
+    updated |= update_cfg("TFTP Alias Once", "TFTP/Alias Once");
+    if (updated)
+	log(WvLog::Info, "Converted old-style TFTP configuration.\n");
+
+    tftp_trace.set_path(cfg["TFTP/Trace File"].getme(tftp_trace.getpath()));
+
+    // Look for a new archive now rather than on the next request.
+    memset(&archive_checked, 0, sizeof(archive_checked));
+    update_archive();
+
+    if (preload)
+        delete preload;
+    preload = NULL;
+    preload_reported = false;
+    start_preload();
+
+    // Everything else is read as it's needed.  The socket, though, stays
+    // bound where it was.
+    int port = cfg["TFTP/Port"].getmeint(69);
+    if (port != localaddr.port)
+        log(WvLog::Warning, "Still listening on port %s; restart to move "
+            "to port %s.\n", localaddr.port, port);
+
+    log(WvLog::Info, "Reloaded configuration; %s transfers carry on.\n",
+        conns.count());
+}
+
+
+int WvTFTPServer::save_transfers(int fd)
+{
+    // Whatever is still in the batch would otherwise never be sent.
+    flush_sends();
+    // The other process reads the configuration afresh.
+    cfg.commit();
+
+    WvString out("");
+    int n = 0;
+    TFTPConnDict::Iter i(conns);
+    for (i.rewind(); i.next(); )
+    {
+        // A queued client just asks again, and multicast sessions are
+        // shared between connections; neither is worth carrying over.
+        if (i->queued || i->mcast)
+            continue;
+
+        // Blocks the new process takes up from have to be on disk.
+        if (i->direction == tftpwrite && fflush(i->tftpfile) != 0)
+            continue;
+
+        char oack[1024 + 1] = "-";
+        if (i->send_oack && i->oack && i->oack->len <= 512)
+            for (size_t b = 0; b < i->oack->len; b++)
+                sprintf(oack + b * 2, "%02x", i->oack->data[b]);
+
+        out.append("%s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s %s\n",
+                   i->remote, i->direction == tftpread ? "r" : "w",
+                   (int)i->mode, i->blksize, i->tsize, i->filesize,
+                   i->pktclump, i->pkttimes->size(), i->unack, i->lastsent,
+                   (int)i->donefile, (int)i->send_oack, oack, i->bytes,
+                   i->retransmits, (long long)i->start_time.tv_sec,
+                   i->filename);
+        n++;
+    }
+
+    const char *p = out;
+    size_t left = out.len();
+    while (left)
+    {
+        ssize_t w = ::write(fd, p, left);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        left -= w;
+    }
+    return n;
+}
+
+
+int WvTFTPServer::resume_transfers(int fd)
+{
+    FILE *f = fdopen(dup(fd), "r");
+    if (!f)
+        return 0;
+
+    int n = 0;
+    char line[PATH_MAX + 2048];
+    while (fgets(line, sizeof(line), f))
+    {
+        char *nl = strchr(line, '\n');
+        if (nl)
+            *nl = 0;
+        TFTPConn *c = resume_conn(line);
+        if (!c)
+        {
+            log(WvLog::Warning, "Can't carry on transfer: %s\n", line);
+            continue;
+        }
+        log(WvLog::Info, "Carrying on %s of '%s' with %s at block %s.\n",
+            c->direction == tftpread ? "read" : "write", c->filename,
+            c->remote, c->lastsent);
+        stats.started[c->direction == tftpread ? TFTPStats::READ
+                                               : TFTPStats::WRITE]++;
+        conns.add(c, true);
+        n++;
+    }
+    fclose(f);
+
+    // Nothing is resent now: the client's next ACK is already waiting on
+    // the socket, and if not, the timeout takes care of it.
+    if (n)
+        alarm(tftp_tick);
+    return n;
+}
+
+
+WvTFTPBase::TFTPConn *WvTFTPServer::resume_conn(const char *line)
+{
+    char remote[64], dir, oack[1024 + 1];
+    int mode, pktclump, ring, unack, lastsent, donefile, send_oack;
+    int retransmits, namepos = 0;
+    unsigned long blksize;
+    long long tsize, filesize, bytes, started;
+    if (sscanf(line, "%63s %c %d %lu %lld %lld %d %d %d %d %d %d %1024s "
+               "%lld %d %lld %n", remote, &dir, &mode, &blksize, &tsize,
+               &filesize, &pktclump, &ring, &unack, &lastsent, &donefile,
+               &send_oack, oack, &bytes, &retransmits, &started,
+               &namepos) < 16
+        || !namepos || !line[namepos]
+        || (dir != 'r' && dir != 'w') || mode < netascii || mode > mail
+        || blksize < 8 || blksize > 65464 || ring < 1 || pktclump < 1
+        || pktclump > ring || lastsent < 0)
+        return NULL;
+
+    TFTPConn *c = new TFTPConn;
+    c->remote = WvIPPortAddr(remote);
+    c->filename = line + namepos;
+    c->direction = dir == 'r' ? tftpread : tftpwrite;
+    c->mode = static_cast<TFTPMode>(mode);
+    c->blksize = blksize;
+    c->tsize = tsize;
+    c->pktclump = pktclump;
+    c->unack = unack;
+    c->lastsent = lastsent;
+    c->donefile = donefile;
+    c->send_oack = send_oack;
+    c->bytes = bytes;
+    c->retransmits = retransmits;
+    c->numtimeouts = 0;
+    c->rtt = 1000;
+    c->total_packets = 1;
+    c->mult = 1;
+    // The blocks in flight were timed by the other process.
+    c->timed_out_ignore = lastsent;
+    c->last_received = now();
+    c->start_time.tv_sec = started;
+    c->start_time.tv_usec = 0;
+    c->pkttimes = new PktTime(ring);
+    c->pkts = new PktRing(ring);
+    for (int i = lastsent - ring + 1; i <= lastsent; i++)
+        if (i >= 0)
+            c->pkttimes->set(i, c->last_received);
+
+    if (strcmp(oack, "-"))
+    {
+        c->oack = pool.get(512);
+        c->oack->hdr[0] = 0;
+        c->oack->hdr[1] = 6;
+        c->oack->hdrlen = 2;
+        c->oack->len = 0;
+        for (const char *p = oack; p[0] && p[1]; p += 2)
+        {
+            unsigned int b;
+            if (sscanf(p, "%2x", &b) != 1)
+                break;
+            c->oack->data[c->oack->len++] = b;
+        }
+    }
+
+    if (c->direction == tftpread)
+    {
+        // The file must not have changed under the client.
+        if (!open_read(c) || c->filesize != filesize)
+        {
+            delete c;
+            return NULL;
+        }
+    }
+    else
+    {
+        // Anything after the last block we acknowledged gets sent again.
+        off_t written = (off_t)lastsent * blksize;
+        c->tftpfile = fopen(c->filename, c->mode == netascii ? "r+" : "r+b");
+        if (!c->tftpfile || ftruncate(fileno(c->tftpfile), written) < 0
+            || fseeko(c->tftpfile, written, SEEK_SET) < 0)
+        {
+            delete c;
+            return NULL;
+        }
+    }
+
+    setup_transfer(c);
+    if (c->direction == tftpread && c->tftpfile && !c->shared && !c->mapped
+        && !c->inflated)
+        fseeko(c->tftpfile, (off_t)lastsent * blksize, SEEK_SET);
+    return c;
+}
+
+
+void WvTFTPServer::list_conns(WvString &out)
+{
+    struct timeval tv = now();
+    TFTPConnDict::Iter i(conns);
+    for (i.rewind(); i.next(); )
+    {
+        time_t elapsed = msecdiff(tv, i->start_time);
+        out.append("%s %s %s %s %s %s/%s %s %s %s\n",
+                   i->remote, i->direction == tftpread ? "read" : "write",
+                   i->filename, i->blksize, i->pktclump,
+                   i->unack, i->lastsent, current_timeout(&i()),
+                   i->retransmits,
+                   elapsed > 0 ? i->bytes * 1000 / elapsed : 0);
+    }
+}
+
+
+bool WvTFTPServer::abort_conn(const WvIPPortAddr &remote)
+{
+    TFTPConn *c = conns[remote];
+    if (!c)
+        return false;
+
+    log(WvLog::Info, "Transfer to %s aborted by administrator.\n", remote);
+    tftp_trace.add(TRACE_ABORT, c->remote, c->lastsent);
+    // A queued request never started, so it was refused rather than aborted.
+    if (c->queued)
+        stats.rejected++;
+    else
+        stats.aborted[TFTPStats::ABORT_ADMIN]++;
+    setdest(c->remote);
+    send_err(0, "Transfer aborted by server administrator.");
+    conns.remove(c);
+    if (nqueued)
+        admit_queued();
+    mcast_check();
+    flush_sched();
+    flush_sends();
+    return true;
+}
+
+
+int WvTFTPServer::set_window(const WvIPPortAddr &remote, int window)
+{
+    TFTPConn *c = conns[remote];
+    if (!c)
+        return 0;
+
+    // The per-block bookkeeping was sized for the original window.
+    if (window > c->pkttimes->size())
+        window = c->pkttimes->size();
+    if (window < 1)
+        window = 1;
+
+    log(WvLog::Info, "Window for %s changed from %s to %s.\n",
+        remote, c->pktclump, window);
+    c->pktclump = window;
+    tftp_trace.add(TRACE_WINDOW, c->remote, c->unack, window);
+    return window;
+}
+
+
 bool WvTFTPServer::update_cfg(WvStringParm oldsect, WvStringParm newsect)
 {
     bool updated = false;
@@ -80,31 +397,379 @@ void WvTFTPServer::execute()
 
     check_timeouts();
 
-    if (!conns.isempty())
+    // Keep looking in until the preload is done, to say so.
+    if (preload && !preload_reported)
+        check_preload();
+
+    if (!conns.isempty() || (preload && !preload_reported))
         alarm(tftp_tick);
 
     packetsize = read(packet, MAX_PACKET_SIZE);
     if (packetsize > 0)
+        process_packet();
+
+    // Come back as soon as the scheduler can send again.
+    int wait = sched.wait(now());
+    if (wait >= 0 && wait < tftp_tick)
+        alarm(wait);
+
+    stats.active = conns.count() - nqueued;
+    stats.queued = nqueued;
+    stats.backlog = sched.backlog();
+}
+
+
+void WvTFTPServer::process_packet()
+{
+    dump_pkt();
+    size_t count = conns.count();
+    TFTPConn *c = conns[remaddr];
+    if (!c)
+        new_connection();
+    else
     {
-        dump_pkt();
-        if (!conns[remaddr])
+        if (c->capture)
+            c->capture->record(now(), remaddr, localaddr, packet, packetsize);
+
+        TFTPOpcode opcode = (TFTPOpcode)(packet[0] * 256 + packet[1]);
+
+        if ((opcode == RRQ || opcode == WRQ) && resend_first_reply(c))
+        {
+            // Answered in place; the reply goes out with the rest below.
+        }
+        else if (opcode == RRQ)
+        {
+            // last transaction was interrupted, and they're starting over,
+            // I guess.
+            TFTPLOG(WvLog::Debug1, "New request on %s; resetting.\n", remaddr);
+            stats.aborted[TFTPStats::ABORT_RESTARTED]++;
+            conns.remove(c);
             new_connection();
+        }
+        else if (c->queued && opcode != ERROR)
+            TFTPLOG(WvLog::Debug1, "%s is still queued; packet ignored.\n",
+                    remaddr);
+        else if (c->passive && opcode != ERROR)
+            TFTPLOG(WvLog::Debug1, "%s is not the multicast master; packet "
+                    "ignored.\n", remaddr);
         else
-	{
-	    TFTPOpcode opcode = (TFTPOpcode)(packet[0] * 256 + packet[1]);
-	    
-	    if (opcode == RRQ)
-	    {
-		// last transaction was interrupted, and they're starting over,
-		// I guess.
-                log(WvLog::Debug1, "New request on %s; resetting.\n", remaddr);
-		conns.remove(conns[remaddr]);
-		new_connection();
-	    }
-	    else
-		handle_packet();
-	}
+            handle_packet();
+    }
+
+    // A finished transfer may make room for a queued one.
+    if (nqueued && conns.count() < count)
+        admit_queued();
+
+    mcast_check();
+    flush_sched();
+    flush_sends();
+}
+
+
+bool WvTFTPServer::resend_first_reply(TFTPConn *c)
+{
+    if (packetsize != c->requestlen
+        || memcmp(packet, c->request, packetsize))
+        return false;
+
+    // Once a block has been acknowledged the client has clearly seen our
+    // reply, so a request now really is a new one.
+    if (c->direction == tftpread ? c->unack > c->blkoffset + 1
+                                 : c->lastsent > c->blkoffset)
+        return false;
+
+    stats.duplicate_requests++;
+    c->last_received = now();
+
+    // There is no TFTP reply meaning "wait", so a queued client just keeps
+    // resending; all it costs us is the memcmp() above.
+    if (c->queued)
+        return true;
+
+    TFTPLOG(WvLog::Debug1, "Request from %s resent; repeating reply.\n",
+            remaddr);
+    if (c->send_oack)
+    {
+        send_pkt(c->remote, c->oack);
+        tftp_trace.add(TRACE_OACK, c->remote, 0);
+    }
+    else if (c->direction == tftpread)
+    {
+        if (!send_data(c, true))
+        {
+            conns.remove(c);
+            return true;
+        }
+    }
+    else
+        send_ack(c, true);
+
+    // The ACKs that follow could be for either copy, so they can't be
+    // used to measure the rtt.
+    c->timed_out_ignore = c->lastsent;
+    return true;
+}
+
+
+bool WvTFTPServer::open_read(TFTPConn *c)
+{
+    const TFTPArchive::Member *member = archive_member(c->filename);
+    if (member)
+    {
+        // Nothing to open: the file is a range of the mapped archive.
+        c->mapped = archive->mapping();
+        c->mapped->addref();
+        c->map_start = member->offset;
+        c->filesize = member->size;
+        return true;
+    }
+
+    if (c->mode != netascii && c->mode != octet)
+        return false;
+    c->tftpfile = fopen(c->filename, c->mode == netascii ? "r" : "rb");
+
+    // Only a file that isn't there at all might be there gzipped.
+    if (!c->tftpfile)
+        return errno == ENOENT && open_compressed(c);
+
+    struct stat st;
+    if (fstat(fileno(c->tftpfile), &st) == 0)
+        c->filesize = st.st_size;
+    return true;
+}
+
+
+bool WvTFTPServer::open_compressed(TFTPConn *c)
+{
+    if (!cfg["TFTP"]["Decompress"].getmeint(1))
+        return false;
+
+    WvString gzname("%s.gz", c->filename);
+    int fd = ::open(gzname, O_RDONLY);
+    if (fd < 0)
+        return false;
+    int kb = cfg["TFTP"]["Decompress Cache KB"].getmeint(1024);
+    off_t warm_limit = cfg["TFTP"]["Warm Cache MB"].getmeint(0) * 1048576LL;
+    WvString warm_dir = cfg["TFTP"]["Warm Cache Dir"].getme("/run/wvtftpd");
+    c->inflated = TFTPInflatedFile::get(inflated_files, fd, mapped_files,
+                                        kb * 1024 / TFTPInflatedFile::CHUNK,
+                                        warm_limit ? warm_dir.cstr() : NULL,
+                                        warm_limit);
+    ::close(fd);
+    if (!c->inflated)
+    {
+        log(WvLog::Warning, "%s is not gzip data.\n", gzname);
+        return false;
+    }
+
+    c->filesize = c->inflated->size();
+    log(WvLog::Debug, "Serving %s uncompressed (%s bytes).\n", gzname,
+        c->filesize);
+    return true;
+}
+
+
+void WvTFTPServer::update_archive()
+{
+    // A stat() a second is plenty to notice a new archive, and keeps it out
+    // of the way of requests.
+    struct timeval tv = now();
+    if ((archive_checked.tv_sec || archive_checked.tv_usec)
+        && msecdiff(tv, archive_checked) < 1000)
+        return;
+    archive_checked = tv;
+
+    WvString basedir = cfg["TFTP"]["Base dir"].getme("/tftpboot/");
+    struct stat st;
+    if (stat(basedir, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if (archive)
+        {
+            log(WvLog::Info, "No longer serving from an archive.\n");
+            delete archive;
+            archive = NULL;
+        }
+        return;
+    }
+    if (archive && archive->same_file(st))
+        return;
+
+    // Transfers already under way keep their references to the old one.
+    TFTPArchive *a = new TFTPArchive(basedir, mapped_files);
+    if (!a->isok())
+    {
+        log(WvLog::Error, "Can't serve from archive %s: %s\n", basedir,
+            a->errstr());
+        delete a;
+        return;
+    }
+    log(WvLog::Info, "Serving %s files from archive %s.\n", a->count(),
+        basedir);
+    if (archive)
+        delete archive;
+    archive = a;
+}
+
+
+void WvTFTPServer::start_preload()
+{
+    WvString basedir = cfg["TFTP"]["Base dir"].getme("/tftpboot/");
+    if (basedir[basedir.len() -1] != '/')
+        basedir.append("/");
+
+    preload = new TFTPPreload(mapped_files,
+                              cfg["TFTP/Preload Lock"].getmeint(0),
+                              cfg["TFTP/Preload Huge Pages"].getmeint(0));
+    UniConf patterns(cfg["TFTP/Preload"]);
+    UniConf::RecursiveIter i(patterns);
+    for (i.rewind(); i.next(); )
+    {
+        if (i().haschildren() || !i().getmeint(1))
+            continue;
+        WvString pattern("%s%s", basedir,
+                         i().fullkey(patterns.fullkey()).printable());
+        glob_t g;
+        if (glob(pattern, 0, NULL, &g) != 0)
+        {
+            log(WvLog::Warning, "Nothing to preload matches %s.\n", pattern);
+            continue;
+        }
+        for (size_t n = 0; n < g.gl_pathc; n++)
+            if (!preload->add(g.gl_pathv[n]))
+                log(WvLog::Debug, "Not preloading %s: it can't be mapped.\n",
+                    g.gl_pathv[n]);
+        globfree(&g);
+    }
+
+    if (preload->count() && preload->start())
+        log(WvLog::Info, "Preloading %s files (%s KB).\n", preload->count(),
+            preload->bytes() / 1024);
+    else
+    {
+        if (preload->count())
+            log(WvLog::Warning, "Can't start the preload thread.\n");
+        delete preload;
+        preload = NULL;
+    }
+}
+
+
+void WvTFTPServer::check_preload()
+{
+    int pending, ms, unlocked;
+    off_t loaded;
+    bool done = preload->progress(pending, loaded, ms, unlocked);
+    stats.preload_pending = pending;
+    stats.preloaded_bytes = loaded;
+    if (!done)
+        return;
+
+    stats.preload_ms = ms;
+    preload_reported = true;
+    log(WvLog::Info, "Preloaded %s files (%s KB) in %s ms.\n",
+        preload->count(), loaded / 1024, ms);
+    if (unlocked)
+        log(WvLog::Warning, "%s preloaded files couldn't be locked in "
+            "memory (see RLIMIT_MEMLOCK).\n", unlocked);
+}
+
+
+void WvTFTPServer::learn_sequence(TFTPConn *c)
+{
+    int kb = cfg["TFTP/Learn Sequence KB"].getmeint(0);
+    if (kb <= 0)
+    {
+        if (sequence)
+            delete sequence;
+        sequence = NULL;
+        stats.sequence_bytes = 0;
+        return;
+    }
+    int min_percent = cfg["TFTP/Learn Sequence Percent"].getmeint(50);
+    if (!sequence)
+        sequence = new TFTPSequence(kb * 1024, min_percent);
+    sequence->set_budget(kb * 1024);
+    sequence->set_min_percent(min_percent);
+
+    // Clients are classed by subnet; each boots on its own, though.
+    WvIPAddr ip(static_cast<WvIPAddr>(c->remote));
+    uint32_t addr = (uint32_t)ip.binaddr[0] << 24 | ip.binaddr[1] << 16
+        | ip.binaddr[2] << 8 | ip.binaddr[3];
+    int bits = cfg["TFTP/Learn Prefix"].getmeint(24);
+    uint32_t cls = bits <= 0 ? 0
+        : bits >= 32 ? addr : addr & ~(0xffffffffU >> bits);
+
+    struct timeval tv = now();
+    TFTPSequence::Outcome outcome;
+    const char *next = sequence->request(addr, cls, c->filename, tv.tv_sec,
+                                         outcome);
+    if (outcome == TFTPSequence::HIT)
+        stats.prefetch_hits++;
+    else if (outcome == TFTPSequence::MISS)
+        stats.prefetch_misses++;
+    stats.sequence_bytes = sequence->memory();
+
+    // The whole subnet booting at once would otherwise read ahead the same
+    // file for every client.
+    if (!next || (last_prefetch == next && tv.tv_sec - last_prefetch_time < 2))
+        return;
+    last_prefetch = next;
+    last_prefetch_time = tv.tv_sec;
+
+    // Found where open_read() will find it.  The first windows come in
+    // behind our back while this transfer runs.
+    off_t len = cfg["TFTP/Learn Prefetch KB"].getmeint(256) * 1024LL;
+    const TFTPArchive::Member *member = archive_member(next);
+    if (member)
+    {
+        // Already mapped, and madvise() wants a page boundary.
+        off_t start = member->offset - member->offset % getpagesize();
+        off_t end = member->offset + (member->size < len ? member->size : len);
+        madvise((void *)(archive->mapping()->bytes() + start), end - start,
+                MADV_WILLNEED);
+    }
+    else
+    {
+        // Opening it brings in its inode and directory entries too.  A file
+        // that is only there gzipped starts with what the start of it
+        // decompresses from.
+        int fd = ::open(next, O_RDONLY | O_NONBLOCK);
+        if (fd < 0 && errno == ENOENT && cfg["TFTP"]["Decompress"].getmeint(1))
+            fd = ::open(WvString("%s.gz", next), O_RDONLY | O_NONBLOCK);
+        if (fd < 0)
+            return;
+        posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+        ::close(fd);
     }
+    stats.prefetches++;
+    TFTPLOG(WvLog::Debug1, "Reading ahead %s for %s.\n", next, c->remote);
+}
+
+
+const TFTPArchive::Member *WvTFTPServer::archive_member(const char *filename)
+{
+    if (!archive)
+        return NULL;
+
+    WvString basedir = cfg["TFTP"]["Base dir"].getme("/tftpboot/");
+    if (strncmp(filename, basedir, basedir.len()))
+        return NULL;
+    const char *name = filename + basedir.len();
+    while (*name == '/')
+        name++;
+    return archive->find(name);
+}
+
+
+time_t WvTFTPServer::current_timeout(TFTPConn *c)
+{
+    time_t timeout = cfg["TFTP"]["Min Timeout"].getmeint(100);
+
+    if (!c->total_packets)
+        timeout = 1000;
+    else if ((c->mult * c->mult * c->rtt / c->total_packets) > timeout)
+        timeout = c->mult * c->mult * c->rtt / c->total_packets;
+    return timeout;
 }
 
 
@@ -112,19 +777,43 @@ void WvTFTPServer::check_timeouts()
 {
     time_t timeout, sec_timeout = cfg["TFTP"]
                                      ["Total Timeout Seconds"].getmeint();
+    time_t queue_timeout = cfg["TFTP/Queue Timeout Seconds"].getmeint(30);
+    size_t count = conns.count();
 
     TFTPConnDict::Iter i(conns);
     for (i.rewind(); i.next(); )
     {
-        struct timeval tv = wvtime();
+        struct timeval tv = now();
         int expect_packet = (i->direction == tftpwrite) ? i->lastsent :
             i->unack;
 
-        if (sec_timeout && (msecdiff(tv, i->last_received) >=
-                            sec_timeout * 1000))
+        if (i->queued)
+        {
+            // Nothing has been sent, so nothing can time out; but a client
+            // that has stopped resending its request has given up on us.
+            if (msecdiff(tv, i->last_received) >= queue_timeout * 1000)
+            {
+                log(WvLog::Info, "%s gave up while queued.\n", i->remote);
+                stats.aborted[TFTPStats::ABORT_IDLE]++;
+                conns.remove(&i());
+                i.rewind();
+            }
+            continue;
+        }
+
+        // A passive multicast client never says anything, so it has been
+        // idle for as long as its session has; a session whose master has
+        // gone quiet is given up on as a whole.
+        struct timeval last = i->last_received;
+        if (i->passive && timercmp(&i->mcast->active, &last, >))
+            last = i->mcast->active;
+
+        if (sec_timeout && (msecdiff(tv, last) >= sec_timeout * 1000))
         {
             log(WvLog::Info,"%s seconds elapsed since the last packet was "
                 "received; aborting transfer.\n", sec_timeout);
+            tftp_trace.add(TRACE_ABORT, i->remote, expect_packet);
+            stats.aborted[TFTPStats::ABORT_IDLE]++;
             setdest(i->remote);
             send_err(0, "Operation timed out.");
             conns.remove(&i());
@@ -132,34 +821,44 @@ void WvTFTPServer::check_timeouts()
             continue;
         }
 
-        timeout = cfg["TFTP"]["Min Timeout"].getmeint(100);
+        // It gets retransmission timers when it becomes the master.
+        if (i->passive)
+            continue;
+
+        // Whatever hasn't left the scheduler yet can hardly be late.
+        if (i->flow && i->flow->pending())
+            continue;
 
-        if (!i->total_packets)
-            timeout = 1000;
-        else if ((i->mult * i->mult * i->rtt / i->total_packets) > timeout)
-            timeout = i->mult * i->mult * i->rtt / i->total_packets;
+        timeout = current_timeout(&i());
 	
-        if (msecdiff(tv, *(i->pkttimes->get(expect_packet))) >= timeout)
+        time_t elapsed = msecdiff(tv, *(i->pkttimes->get(expect_packet)));
+        if (elapsed >= timeout)
         {
             i->numtimeouts++;
+            stats.timeouts++;
+            tftp_trace.add(TRACE_TIMEOUT, i->remote, expect_packet, timeout);
 
-            log(WvLog::Debug1,
+            TFTPLOG(WvLog::Debug1,
                 "Timeout #%s (%s ms) on block %s from connection to %s.\n",
 		i->numtimeouts, timeout, expect_packet, i->remote);
-	    log(WvLog::Debug4, "[t1 %s, t2 %s, elapsed %s, expected %s]\n",
+	    TFTPLOG(WvLog::Debug4, "[t1 %s, t2 %s, elapsed %s, expected %s]\n",
 		tv.tv_sec, i->pkttimes->get(expect_packet)->tv_sec,
-		msecdiff(tv, *(i->pkttimes->get(expect_packet))),
-		expect_packet);
+		elapsed, expect_packet);
 		
-            log(WvLog::Debug4, "(packets %s, avg rtt %s, timeout %s, ms "
+            TFTPLOG(WvLog::Debug4, "(packets %s, avg rtt %s, timeout %s, ms "
                 "elapsed %s)\n", i->total_packets, 
                 i->total_packets ? i->rtt / i->total_packets : 1000, timeout,
-		msecdiff(tv, *(i->pkttimes->get(expect_packet))));
+		elapsed);
 
             if (i->numtimeouts == cfg["TFTP/Max Timeout Count"].getmeint(80))
             {
                 log(WvLog::Info,"Max number of timeouts reached; aborting "
                     "transfer.\n");
+                tftp_trace.add(TRACE_ABORT, i->remote, expect_packet);
+                stats.aborted[TFTPStats::ABORT_TIMEOUTS]++;
+                if (tftp_trace.dump())
+                    log(WvLog::Info, "Protocol trace written to %s.\n",
+                        tftp_trace.getpath());
                 setdest(i->remote);
                 send_err(0, "Too many timeouts.");
                 conns.remove(&i());
@@ -170,10 +869,10 @@ void WvTFTPServer::check_timeouts()
                     (time_t)cfg["TFTP"]["Max Timeout"].getmeint(5000))
                 {
                     i->mult++;
-                    log(WvLog::Debug1, "Multipler increased to %s.\n", i->mult);
+                    TFTPLOG(WvLog::Debug1, "Multipler increased to %s.\n", i->mult);
                 }
                 else
-                    log(WvLog::Debug1, "Max timeout duration reached; not "
+                    TFTPLOG(WvLog::Debug1, "Max timeout duration reached; not "
                         "increasing further.\n");
 
                 // If the client times out too many times, stop sending it so
@@ -181,26 +880,27 @@ void WvTFTPServer::check_timeouts()
                 if ((i->numtimeouts % 5) == 0 && i->pktclump > 1) 
                 {
                     i->pktclump--;
-                    log(WvLog::Debug1, 
+                    tftp_trace.add(TRACE_WINDOW, i->remote, expect_packet,
+                                   i->pktclump);
+                    TFTPLOG(WvLog::Debug1, 
                         "Too many timeouts, reducing prefetch to %s\n", 
                         i->pktclump);
                 }
 
-                setdest(i->remote);
                 if (i->send_oack)
                 {
-                    log(WvLog::Debug4, "Sending oack ");
-                    memcpy(packet, i->oack, 512);
-                    packetsize = i->oacklen;
-                    dump_pkt();
-                    write(packet, packetsize);
+                    TFTPLOG(WvLog::Debug4, "Sending oack ");
+                    send_pkt(i->remote, i->oack);
+                    tftp_trace.add(TRACE_OACK, i->remote, 0);
                     i->pkttimes->set(expect_packet, tv);
                     i->timed_out_ignore = i->lastsent; 
                 }
                 else if (i->direction == tftpread)
                 {
-                    send_data(&i(), true);
-                    i->timed_out_ignore = i->lastsent; 
+                    if (send_data(&i(), true))
+                        i->timed_out_ignore = i->lastsent;
+                    else
+                        conns.remove(&i());
                 }
                 else
                 {
@@ -216,6 +916,13 @@ void WvTFTPServer::check_timeouts()
 	    i.rewind();
         }
     }
+
+    if (nqueued && conns.count() < count)
+        admit_queued();
+
+    mcast_check();
+    flush_sched();
+    flush_sends();
 }
 
 
@@ -239,7 +946,22 @@ int WvTFTPServer::validate_access(TFTPConn *c)
     for (cp = c->filename + 1; *cp; cp++)
         if(*cp == '.' && strncmp(cp-1, "/../", 4) == 0)
             return 2;
-    if (stat(c->filename, &stbuf) < 0)
+
+    // What's in the archive is all there is, and none of it can be written.
+    if (archive)
+    {
+        if (c->direction == tftpwrite)
+            return 2;
+        return archive_member(c->filename) ? 0 : 1;
+    }
+
+    // A file that is only there gzipped is served as if it weren't.
+    int ret = stat(c->filename, &stbuf);
+    if (ret < 0 && errno == ENOENT && c->direction == tftpread
+        && cfg["TFTP"]["Decompress"].getmeint(1))
+        ret = stat(WvString("%s.gz", c->filename), &stbuf);
+
+    if (ret < 0)
         if (c->direction == tftpread)
             return (errno == ENOENT ? 1 : 2);
         else
@@ -277,7 +999,7 @@ WvString WvTFTPServer::check_aliases(TFTPConn *c)
 
     if (!!alias)
     {
-	log(WvLog::Debug4, "Alias once is \"%s\".\n", alias);
+	TFTPLOG(WvLog::Debug4, "Alias once is \"%s\".\n", alias);
 	c->alias_once = true;
 	c->alias = cfg["TFTP/Alias Once"]
 	              [alias_once_fn_only ? WvString("default")
@@ -289,7 +1011,7 @@ WvString WvTFTPServer::check_aliases(TFTPConn *c)
 	alias = cfg["TFTP/Aliases"][clientportless][c->filename].getme(
 	    cfg["TFTP/Aliases/default"][c->filename].getme("")
 	    );
-	log(WvLog::Debug4, "Alias is \"%s\".\n", alias);
+	TFTPLOG(WvLog::Debug4, "Alias is \"%s\".\n", alias);
     }
 
     return alias;
@@ -298,20 +1020,37 @@ WvString WvTFTPServer::check_aliases(TFTPConn *c)
 
 void WvTFTPServer::new_connection()
 {
+    // Parse before anything else, so junk costs as little as possible.
+    TFTPRequest req;
+    int err = tftp_parse_request(packet, packetsize, req);
+    if (err < 0)
+    {
+        TFTPLOG(WvLog::Debug, "Erroneous packet from %s; ignored.\n",
+                remaddr);
+        return;
+    }
+
     log(WvLog::Info, "New connection from %s\n", remaddr);
-    int code = packet[0]*256 + packet[1];
-    log(WvLog::Debug4, "Packet opcode is %s.\n", code);
-    if ((!code) || (code > 2))
+    if (err)
     {
-        log(WvLog::Debug, "Erroneous packet; aborting.\n");
-        //send_err(4);
+        if (req.mode_str.str && req.mode == TFTP_MODE_UNKNOWN)
+            log(WvLog::Info, "Unknown mode string \"%s\"; aborting.\n",
+                req.mode_str.str);
+        else
+            log(WvLog::Debug, "Badly formed packet; aborting.\n");
+        send_err(err);
+        stats.rejected++;
         return;
     }
-    TFTPOpcode pktcode = static_cast<TFTPOpcode>(code);
-    
+    TFTPLOG(WvLog::Debug4, "Packet opcode is %s.\n", req.opcode);
+
+    update_archive();
+
     TFTPConn *c = new TFTPConn;
-    c->last_received = wvtime();
+    c->last_received = now();
+    c->start_time = c->last_received;
     c->remote = remaddr;
+    start_capture(c);
     WvIPAddr clientportless = static_cast<WvIPAddr>(c->remote);
     UniConfKey clientportlessk = UniConfKey(clientportless);
 
@@ -321,71 +1060,29 @@ void WvTFTPServer::new_connection()
         cfg["TFTP/New Clients"][clientportlessk].setmeint(true);
     }
 
-    // Make sure the filename and mode actually end with nulls.
-    bool foundnull1 = false;
-    bool foundnull2 = false;
-    unsigned int modestart = 0;
-    for (unsigned int i = 2; i < packetsize; i++)
-    {
-        if (packet[i] == 0)
-        {
-            if (foundnull1)
-            {
-                foundnull2 = true;
-                break;
-            }
-            else
-            {
-                foundnull1 = true;
-                modestart = i + 1;
-            }
-        }
-    }
-    if (!foundnull1 || !foundnull2)
-    {
-        log(WvLog::Debug, "Badly formed packet; aborting.\n");
-        send_err(4);
-        delete c;
-        return;
-    }
-
-    WvString origfilename = &packet[2];
+    // The filename is NUL-terminated in place.
+    WvString origfilename = req.filename.str;
     c->filename = origfilename;
 
-    c->direction = static_cast<TFTPDir>((int)pktcode-1);
-    log(WvLog::Debug4, "Direction is %s.\n", c->direction);
+    c->direction = static_cast<TFTPDir>(req.opcode - 1);
+    TFTPLOG(WvLog::Debug4, "Direction is %s.\n", c->direction);
     if ((c->direction == tftpwrite) && cfg["TFTP"]["Readonly"].getmeint(1))
     {
         log(WvLog::Warning, "Writes are not permitted.\n");
         send_err(2);
+        stats.rejected++;
         delete c;
         return;
     }
 
-    // convert mode to TFTPMode type.
-    unsigned int ch;
-    for (ch = modestart; packet[ch] != 0; ch++)
-        packet[ch] = tolower(packet[ch]);
-    if (!strcmp(&packet[modestart], "netascii"))
-        c->mode = netascii;
-    else if (!strcmp(&packet[modestart], "octet"))
-        c->mode = octet;
-    else if (!strcmp(&packet[modestart], "mail"))
-        c->mode = mail;
-    else
-    { 
-        log(WvLog::Info, "Unknown mode string \"%s\"; aborting.\n",
-            &packet[modestart]);
-        send_err(4);
-        delete c;
-        return;
-    }
-    log(WvLog::Debug4, "Mode is %s.\n", c->mode);
+    c->mode = static_cast<TFTPMode>(req.mode);
+    TFTPLOG(WvLog::Debug4, "Mode is %s.\n", c->mode);
 
     c->blksize = 512;
     c->tsize = 0;
     c->pktclump = cfg["TFTP"]["Prefetch"].getmeint(3);
     c->pkttimes = new PktTime(c->pktclump);
+    c->pkts = new PktRing(c->pktclump);
     c->unack = 0;
     c->donefile = false;
     c->numtimeouts = 0;
@@ -396,10 +1093,15 @@ void WvTFTPServer::new_connection()
     
     for (int i = 0; i < c->pktclump; i++)
     {
-        struct timeval tv = wvtime();
+        struct timeval tv = now();
 	c->pkttimes->set(i, tv);
     }
 
+    // check_filename() must leave a partial upload alone; whether it really
+    // is one is up to process_options().
+    c->append = c->direction == tftpwrite
+        && req.known[TFTP_OPT_BLKOFFSET] >= 0;
+
     if (c->direction == tftpread)
         log(WvLog::Info, "Client is requesting to read '%s'.\n",
 	    origfilename);
@@ -409,6 +1111,7 @@ void WvTFTPServer::new_connection()
 
     if (!check_filename(c))
     {
+        stats.rejected++;
         delete c;
         return;
     }
@@ -418,25 +1121,31 @@ void WvTFTPServer::new_connection()
 
     if (c->direction == tftpread)
     {
-        if (c->mode == netascii)
-            c->tftpfile = fopen(c->filename, "r");
-        else if (c->mode == octet)
-            c->tftpfile = fopen(c->filename, "rb");
-
-        if (!c->tftpfile)
+        if (!open_read(c))
         {
             log(WvLog::Info, "Failed to open file for reading; aborting.\n");
             send_err(2);
+            stats.rejected++;
             delete c;
             return;
         }
+        learn_sequence(c);
     }
     else
     {
         // check_filename() has already ensured that the file is not there
         // or that the user is allowed to overwrite it.
         umask(011);
-        if (c->mode == netascii)
+        if (c->append)
+            c->tftpfile = fopen(c->filename,
+                                c->mode == netascii ? "r+" : "r+b");
+        if (c->tftpfile)
+        {
+            struct stat st;
+            if (fstat(fileno(c->tftpfile), &st) == 0)
+                c->filesize = st.st_size;
+        }
+        else if (c->mode == netascii)
             c->tftpfile = fopen(c->filename, "w");
         else if (c->mode == octet)
             c->tftpfile = fopen(c->filename, "wb");
@@ -445,72 +1154,297 @@ void WvTFTPServer::new_connection()
         {
             log(WvLog::Info, "Failed to open file for writing; aborting.\n");
             send_err(3);
+            stats.rejected++;
             delete c;
             return;
         }
     }
 
     c->send_oack = false;
-    c->oacklen = 0;
 
-    if (!process_options(c, ch+1))
+    if (!process_options(c, req))
+    {
+        stats.rejected++;
+        delete c;
+        return;
+    }
+
+    // Offsets are 64-bit, but block numbers are ints; at the smallest
+    // blksizes that runs out long before the file does.
+    off_t size = c->direction == tftpread ? c->filesize : c->tsize;
+    if (size / (off_t)c->blksize >= INT_MAX)
     {
+        log(WvLog::Warning, "File too large for blksize %s; aborting.\n",
+            c->blksize);
+        send_err(c->direction == tftpread ? 0 : 3,
+                 "File too large for this blksize.");
+        stats.rejected++;
         delete c;
         return;
     }
 
-    if (!strcmp(&packet[modestart], "netascii"))
-      c->mode = netascii;
-    else if (!strcmp(&packet[modestart], "octet"))
-      c->mode = octet;
-    else if (!strcmp(&packet[modestart], "mail"))
-      c->mode = mail;
+    tftp_trace.add(c->direction == tftpread ? TRACE_RRQ : TRACE_WRQ,
+                   c->remote, 0, c->blksize);
+
+    if (c->direction == tftpread)
+    {
+        c->lastsent = c->blkoffset;
+        c->unack = c->blkoffset + 1;
+    }
     else
-    { 
-	log(WvLog::Info, "Unknown mode string \"%s\"; aborting.\n",
-	    &packet[modestart]);
-	send_err(4);
-	delete c;
-	return;
+        c->lastsent = c->blkoffset - 1;
+
+    // Reads beyond the limits wait their turn.  Once anything is waiting,
+    // new requests queue behind it too, so admit_queued() gets to choose.
+    // A passive multicast client costs nothing, so it never waits.
+    if (c->direction == tftpread && !c->passive
+        && (nqueued || !can_admit(c)))
+    {
+        if (nqueued >= cfg["TFTP/Queue Length"].getmeint(256))
+        {
+            log(WvLog::Warning, "Too many queued requests; refusing.\n");
+            send_err(0, "Server busy; try again later.");
+            stats.rejected++;
+            delete c;
+            return;
+        }
+        c->queued = true;
+        nqueued++;
     }
 
+    c->request = new char[packetsize];
+    c->requestlen = packetsize;
+    memcpy(c->request, packet, packetsize);
+
     alarm(tftp_tick);
     conns.add(c, true);
+    if (c->queued)
+    {
+        log(WvLog::Info, "Server busy; request queued.\n");
+        admit_queued();
+    }
+    else
+        start_transfer(c);
+}
+
+
+void WvTFTPServer::start_transfer(TFTPConn *c)
+{
+    stats.started[c->direction == tftpread ? TFTPStats::READ
+                                           : TFTPStats::WRITE]++;
+    setup_transfer(c);
+
     if (c->direction == tftpread)
     {
-        c->lastsent = 0;
-        c->unack = 1;
         if (c->send_oack)
         {
-            log(WvLog::Debug4, "Sending oack ");
-            memcpy(packet, c->oack, 512);
-            packetsize = c->oacklen;
-            dump_pkt();
-            write(packet, packetsize);
-	    // Set pkttimes[1] to avoid timeouts on ACK for options.
-	    struct timeval tv = wvtime();
-	    c->pkttimes->set(1, tv);
+            TFTPLOG(WvLog::Debug4, "Sending oack ");
+            send_pkt(c->remote, c->oack);
+            tftp_trace.add(TRACE_OACK, c->remote, 0);
+	    // Set pkttimes[unack] to avoid timeouts on ACK for options.
+	    struct timeval tv = now();
+	    c->pkttimes->set(c->unack, tv);
         }
         else
         {
-            log(WvLog::Debug4, "Last sent: %s unack: %s pktclump: %s\n",
+            TFTPLOG(WvLog::Debug4, "Last sent: %s unack: %s pktclump: %s\n",
                 c->lastsent, c->unack, c->pktclump);
             int pktsremain = c->lastsent - c->unack;
             while (pktsremain < c->pktclump - 1)
             {
-                log(WvLog::Debug4, "Result is %s\n", pktsremain);
-                send_data(c);
+                TFTPLOG(WvLog::Debug4, "Result is %s\n", pktsremain);
+                if (!send_data(c))
+                {
+                    conns.remove(c);
+                    return;
+                }
                 if (c->donefile)
                     break;
                 pktsremain = c->lastsent - c->unack;
             }
         }
     }
-    else
+    else if (c->send_oack)
     {
-        c->lastsent = -1;
+        // In place of ACK 0 (or of the last block a resumed upload has).
+        c->lastsent++;
+        send_pkt(c->remote, c->oack);
+        tftp_trace.add(TRACE_OACK, c->remote, 0);
+        struct timeval tv = now();
+        c->pkttimes->set(c->lastsent, tv);
+    }
+    else
         send_ack(c);
+}
+
+
+void WvTFTPServer::setup_transfer(TFTPConn *c)
+{
+    sched.set_rate(cfg["TFTP/Max Rate KB"].getmeint(0) * 1024LL,
+                   cfg["TFTP/Max Burst KB"].getmeint(64) * 1024LL);
+    if (sched.enabled())
+        c->flow = new TFTPSchedFlow(&sched, c->remote, flow_weight(c));
+
+    if (c->direction == tftpread && c->tftpfile && !c->mapped
+        && cfg["TFTP/Map Files"].getmeint(0))
+        c->mapped = TFTPMappedFile::get(mapped_files, fileno(c->tftpfile));
+
+    // A mapped file costs nothing to read again, and a gzipped one has a
+    // cache of its own.
+    int shared_kb = cfg["TFTP/Shared Cache KB"].getmeint(1024);
+    if (c->direction == tftpread && c->tftpfile && !c->mapped
+        && shared_kb > 0)
+        c->shared = TFTPSharedFile::get(shared_files, fileno(c->tftpfile),
+                                        c->blksize,
+                                        shared_kb * 1024 / c->blksize + 1);
+}
+
+
+// The window a transfer can have outstanding at once, in bytes.
+static long long window_bytes(WvTFTPBase::TFTPConn *c)
+{
+    return (long long)c->blksize
+        * (c->direction == WvTFTPBase::tftpread ? c->pktclump : 1);
+}
+
+
+bool WvTFTPServer::can_admit(TFTPConn *c)
+{
+    int max_active = cfg["TFTP/Max Active"].getmeint(0);
+    long long max_bytes = cfg["TFTP/Max Inflight KB"].getmeint(0) * 1024LL;
+    if (!max_active && !max_bytes)
+        return true;
+
+    int active = 0;
+    long long bytes = 0;
+    TFTPConnDict::Iter i(conns);
+    for (i.rewind(); i.next(); )
+    {
+        if (i->queued || i->passive || &i() == c)
+            continue;
+        active++;
+        bytes += window_bytes(&i());
     }
+
+    if (max_active && active >= max_active)
+        return false;
+    // A transfer whose window alone is over the limit still gets to run,
+    // just not alongside anything else.
+    return !max_bytes || !active || bytes + window_bytes(c) <= max_bytes;
+}
+
+
+void WvTFTPServer::admit_queued()
+{
+    off_t small = cfg["TFTP/Small File KB"].getmeint(1024) * (off_t)1024;
+
+    for (;;)
+    {
+        TFTPConn *best = NULL;
+        bool best_small = false;
+        int waiting = 0;
+        TFTPConnDict::Iter i(conns);
+        for (i.rewind(); i.next(); )
+        {
+            if (!i->queued)
+                continue;
+            waiting++;
+            bool is_small = i->filesize <= small;
+            if (!best || (is_small && !best_small)
+                || (is_small == best_small
+                    && timercmp(&i->start_time, &best->start_time, <)))
+            {
+                best = &i();
+                best_small = is_small;
+            }
+        }
+        nqueued = waiting;
+
+        if (!best || !can_admit(best))
+            return;
+
+        log(WvLog::Info, "Starting queued transfer of '%s' to %s.\n",
+            best->filename, best->remote);
+        best->queued = false;
+        nqueued--;
+        start_transfer(best);
+    }
+}
+
+
+int WvTFTPServer::subnet_value(WvStringParm sect, const WvIPPortAddr &remote,
+                               int def)
+{
+    WvIPNet client(static_cast<WvIPAddr>(remote), 32);
+    int value = def, best_bits = -1;
+    UniConf subnets(cfg[sect]);
+    UniConf::RecursiveIter i(subnets);
+    for (i.rewind(); i.next(); )
+    {
+        if (i().haschildren())
+            continue;
+        // "10.1.0.0/16" is stored as a key and a subkey.
+        WvIPNet net(i().fullkey(subnets.fullkey()).printable());
+        if (net.bits() > best_bits && net.includes(client))
+        {
+            best_bits = net.bits();
+            value = i().getmeint(def);
+        }
+    }
+    return value;
+}
+
+
+int WvTFTPServer::flow_weight(TFTPConn *c)
+{
+    int subnet_weight = subnet_value("TFTP/Subnet Weights", c->remote, 1);
+
+    // Patterns without a '/' match the file's name alone.
+    const char *name = strrchr(c->filename, '/');
+    name = name ? name + 1 : c->filename.cstr();
+    int file_weight = 0;
+    UniConf files(cfg["TFTP/File Weights"]);
+    UniConf::RecursiveIter j(files);
+    for (j.rewind(); j.next(); )
+    {
+        if (j().haschildren())
+            continue;
+        WvString pattern(j().fullkey(files.fullkey()).printable());
+        if (fnmatch(pattern, strchr(pattern, '/') ? c->filename.cstr() : name,
+                    0) == 0 && j().getmeint(1) > file_weight)
+            file_weight = j().getmeint(1);
+    }
+
+    int weight = subnet_weight * (file_weight ? file_weight : 1);
+    if (weight < 1)
+        weight = 1;
+    else if (weight > 1000)
+        weight = 1000;
+    return weight;
+}
+
+
+void WvTFTPServer::start_capture(TFTPConn *c)
+{
+    WvString dir = cfg["TFTP/Capture Dir"].getme("");
+    if (!dir)
+        return;
+
+    WvString name("%s/%s-%s-%s.pcap", dir, static_cast<WvIPAddr>(c->remote),
+                  c->remote.port, c->start_time.tv_sec);
+    c->capture = new TFTPPcapWriter(name);
+    if (!c->capture->isok())
+    {
+        log(WvLog::Warning, "Can't create capture file %s: %s\n", name,
+            strerror(errno));
+        delete c->capture;
+        c->capture = NULL;
+        return;
+    }
+
+    capturing = true;
+    c->capture->record(c->start_time, c->remote, localaddr, packet,
+                       packetsize);
 }
 
 
@@ -526,14 +1460,14 @@ bool WvTFTPServer::check_filename(TFTPConn *c)
         if (strip_prefix[strip_prefix.len() -1] != '/')
             strip_prefix.append("/");
 
-        log(WvLog::Debug4, "Strip prefix is %s.\n", strip_prefix);
+        TFTPLOG(WvLog::Debug4, "Strip prefix is %s.\n", strip_prefix);
         if (!strncmp(c->filename, strip_prefix, strip_prefix.len()))
         {
-            log(WvLog::Debug4, "Stripping prefix.\n");
+            TFTPLOG(WvLog::Debug4, "Stripping prefix.\n");
             c->filename = WvString(&c->filename[strip_prefix.len()]);
         }
     }
-    log(WvLog::Debug4, "Filename after stripping is %s.\n", c->filename);
+    TFTPLOG(WvLog::Debug4, "Filename after stripping is %s.\n", c->filename);
 
     WvString alias(check_aliases(c));
 
@@ -563,12 +1497,12 @@ bool WvTFTPServer::check_filename(TFTPConn *c)
         if (alias == "")
         {
             // Check for aliases again
-            log(WvLog::Debug4,
+            TFTPLOG(WvLog::Debug4,
 		"Filename before 2nd alias check is %s.\n", c->filename);
 	    alias = check_aliases(c);
 	    if (!!alias)
 		c->filename = alias;
-            log(WvLog::Debug4,
+            TFTPLOG(WvLog::Debug4,
 		"Filename after adding basedir and checking for alias is %s.\n",
                 c->filename);
         }
@@ -579,7 +1513,19 @@ bool WvTFTPServer::check_filename(TFTPConn *c)
         struct stat st;
         if (stat(c->filename, &st) == 0)
         {
-            if (cfg["TFTP"]["Overwrite existing file"].getmeint())
+            if (c->append)
+            {
+                // Nothing already there is rewritten, so this isn't an
+                // overwrite; but it is still someone else's file unless it's
+                // world writable.
+                if (!(st.st_mode & S_IWOTH))
+                {
+                    log(WvLog::Warning, "File is not world writable.\n");
+                    send_err(2);
+                    return false;
+                }
+            }
+            else if (cfg["TFTP"]["Overwrite existing file"].getmeint())
             {
                 if (!(st.st_mode & S_IWOTH))
                 {
@@ -673,114 +1619,379 @@ bool WvTFTPServer::check_filename(TFTPConn *c)
         send_err(tftpaccess);
         return false;
     }
-    log(WvLog::Debug4, "Filename is %s.\n", c->filename);
+    TFTPLOG(WvLog::Debug4, "Filename is %s.\n", c->filename);
+    return true;
+}
+
+
+// What path_mtu() last found for a few recent destinations, so a client
+// asking for one file after another doesn't cost a socket each time.
+struct PathMTUCache
+{
+    uint32_t addr;
+    time_t when;
+    int mtu;
+};
+
+static const int PATH_MTU_SLOTS = 256;
+static const int PATH_MTU_SECONDS = 10;   // PMTU discovery may learn more
+static PathMTUCache path_mtu_cache[PATH_MTU_SLOTS];
+
+
+// Returns the MTU of the route to 'remote', or 0 if the kernel won't say.
+// That is the outgoing interface's MTU, or less if path MTU discovery has
+// already found a smaller one on the way.
+static int path_mtu(const WvIPPortAddr &remote)
+{
+    int mtu = 0;
+#ifdef IP_MTU
+    uint32_t addr;
+    memcpy(&addr, remote.rawdata(), sizeof(addr));
+    PathMTUCache &cached =
+        path_mtu_cache[(addr * 2654435761U) % PATH_MTU_SLOTS];
+    time_t now = time(NULL);
+    if (cached.when && cached.addr == addr
+        && now - cached.when < PATH_MTU_SECONDS && now >= cached.when)
+        return cached.mtu;
+
+    int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return 0;
+    int pmtudisc = IP_PMTUDISC_DO;
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc, sizeof(pmtudisc));
+
+    // Connecting a UDP socket only picks the route; nothing is sent.
+    sockaddr_bin *sa = remote.sockaddr();
+    socklen_t len = sizeof(mtu);
+    if (connect(fd, (struct sockaddr *)sa, remote.sockaddr_len()) < 0
+        || getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+        mtu = 0;
+    delete sa;
+    close(fd);
+
+    cached.addr = addr;
+    cached.when = now;
+    cached.mtu = mtu;
+#endif
+    return mtu;
+}
+
+
+size_t WvTFTPServer::max_blksize(TFTPConn *c)
+{
+    int mtu = subnet_value("TFTP/Subnet MTU", c->remote, 0);
+    if (!mtu && cfg["TFTP/Path MTU"].getmeint(1))
+        mtu = path_mtu(c->remote);
+
+    // 20 bytes of IP header, 8 of UDP and 4 of TFTP.
+    if (mtu <= 32 + 8)
+        return 65464;
+    return mtu - 32 < 65464 ? mtu - 32 : 65464;
+}
+
+
+// Appends "name\0value\0" to the OACK.  Returns false if it doesn't fit.
+static bool oack_append(TFTPPacket *oack, const char *name, WvStringParm value)
+{
+    size_t namelen = strlen(name) + 1, valuelen = value.len() + 1;
+    if (oack->len + namelen + valuelen > oack->size)
+        return false;
+    memcpy(oack->data + oack->len, name, namelen);
+    oack->len += namelen;
+    memcpy(oack->data + oack->len, value.cstr(), valuelen);
+    oack->len += valuelen;
     return true;
 }
 
 
-unsigned int WvTFTPServer::process_options(TFTPConn *c, unsigned int opts_start)
+bool WvTFTPServer::process_options(TFTPConn *c, const TFTPRequest &req)
 {
-    unsigned int p = opts_start;
-    if (p < packetsize)
+    if (!req.nopts)
+        return true;
+
+    c->oack = pool.get(512);
+    c->oack->hdr[0] = 0;
+    c->oack->hdr[1] = 6;
+    c->oack->hdrlen = 2;
+
+    bool want_mcast = false;
+    long long blkoffset = -1;
+    for (int i = 0; i < req.nopts; i++)
     {
-        // One or more options available for reading.
-        c->oack[0] = 0;
-        c->oack[1] = 6;
-        c->oacklen = 2;
-        char *oackp = &(c->oack[2]);
-        char *optname;
-        char *optvalue = NULL; // Give optvalue a dummy value so gcc doesn't 
-                               // complain about potential lack of
-                               // initialization.
-        while (p < packetsize-1)
+        const TFTPOption &o = req.opts[i];
+        unsigned long long val;
+        log(WvLog::Debug, "Option %s, value %s.\n", o.name.str, o.value.str);
+
+        switch (o.id)
         {
-            optname = &packet[p];
-            for (int i = 0; i < 2; i++)
+        case TFTP_OPT_BLKSIZE:
+            if (!tftp_parse_uint(o.value, 65464, val) || val < 8)
             {
-                while (packet[++p])
-                {
-                    if (p == packetsize)
-                    {    
-                        log(WvLog::Warning,
-                            "Badly formed option %s.  Aborting.\n",
-                            (i==0) ? "name" : "value");
-                        send_err(8);
-                        return 0;
-                    }
-                }
-                if (!i)
-                    optvalue = &packet[p+1];
+                WvString message("Request for blksize of %s is invalid.  "
+                                 "Aborting.", o.value.str);
+                log(WvLog::Warning, "%s\n", message);
+                send_err(8, message);
+                return false;
             }
-            p++;
-            log(WvLog::Debug, "Option %s, value %s.\n", optname, optvalue);
-            strlwr(optname);
-
-            if (!strcmp(optname, "blksize"))
+            // RFC 2348 lets us answer with less than was asked for, and a
+            // block that doesn't fit in one packet is lost if any of its
+            // fragments are.
+            c->blksize = max_blksize(c);
+            if (val < c->blksize)
+                c->blksize = val;
+            else if (val > c->blksize)
+                log(WvLog::Debug, "Blksize %s would fragment; using %s.\n",
+                    val, c->blksize);
+            log(WvLog::Debug, "Blksize option enabled (%s octets).\n",
+                c->blksize);
+            oack_append(c->oack, tftp_option_name(o.id), WvString(c->blksize));
+            break;
+
+        case TFTP_OPT_TIMEOUT:
+            log(WvLog::Debug,
+                "Client request for timeout ignored.  Adaptive"
+                " retransmission is better.\n");
+            break;
+
+        case TFTP_OPT_TSIZE:
+            if (!tftp_parse_uint(o.value, LLONG_MAX, val))
             {
-                c->blksize = atoi(optvalue);
-                if (c->blksize < 8 || c->blksize > 65464)
-                {
-                    WvString message("Request for blksize of %s is invalid.  "
-                                     "Aborting.", c->blksize);
-                    log(WvLog::Warning, "%s\n", message);
-                    send_err(8, message);
-                    return 0;
-                }
-
-		WvString oackblksize(c->blksize);
-                log(WvLog::Debug, "Blksize option enabled (%s octets).\n", oackblksize);
-                strcpy(oackp, optname);
-                oackp += strlen(optname) + 1;
-                c->oacklen += strlen(optname) + 1;
-                strcpy(oackp, oackblksize);
-		oackp += oackblksize.len() + 1;
-		c->oacklen += oackblksize.len() + 1;
+                WvString message("Request for tsize of %s is invalid.  "
+                                 "Aborting.", o.value.str);
+                log(WvLog::Warning, "%s\n", message);
+                send_err(8, message);
+                return false;
             }
-            else if (!strcmp(optname, "timeout"))
-                log(WvLog::Debug,
-                    "Client request for timeout ignored.  Adaptive"
-                    " retransmission is better.\n");
-            else if (!strcmp(optname, "tsize"))
+            c->tsize = val;
+
+            // The file is already open (or found in the archive), so its
+            // size is known.
+            if (c->tsize == 0 && c->direction == tftpread)
+                c->tsize = c->filesize;
+
+            log(WvLog::Debug, "Tsize option enabled (%s octets).\n",
+                c->tsize);
+            oack_append(c->oack, tftp_option_name(o.id), WvString(c->tsize));
+            break;
+
+        case TFTP_OPT_MULTICAST:
+            // The value is empty in requests; the session depends on the
+            // blksize, which may come later.  Only octet mode can pick up
+            // at an arbitrary block.
+            want_mcast = c->direction == tftpread && c->mode == octet;
+            break;
+
+        case TFTP_OPT_BLKOFFSET:
+            // Counted in blocks of the blksize, which may come later.
+            if (!tftp_parse_uint(o.value, INT_MAX - 1, val))
             {
-                c->tsize = atoi(optvalue);
-                if (c->tsize < 0)
-                {
-                    WvString message("Request for tsize of %s is invalid.  "
-                                     "Aborting.", c->tsize);
-                    log(WvLog::Warning, "%s\n", message);
-                    send_err(8, message);
-                    return 0;
-                }
+                WvString message("Request for blkoffset of %s is invalid.  "
+                                 "Aborting.", o.value.str);
+                log(WvLog::Warning, "%s\n", message);
+                send_err(8, message);
+                return false;
+            }
+            blkoffset = val;
+            break;
 
-                if (c->tsize == 0 && c->direction == tftpread)
-                {
-                    struct stat tftpfilestat;
-                    if (stat(c->filename, &tftpfilestat) != 0)
-                    {
-                        WvString message("Cannot get stats for file.  "
-                                         "Aborting.");
-                        log(WvLog::Warning, "%s\n", message);
-                        send_err(8, message);
-                        return 0;
-                    }
-                    c->tsize = tftpfilestat.st_size;
-                }
+        default:
+            // Unknown options are simply left out of the OACK.
+            break;
+        }
+    }
 
-                WvString oacktsize(c->tsize);
-                log(WvLog::Debug, "Tsize option enabled (%s octets).\n", oacktsize);
-                strcpy(oackp, optname);
-                oackp += strlen(optname) + 1;
-                c->oacklen += strlen(optname) + 1;
-                strcpy(oackp, oacktsize);
-                oackp += oacktsize.len() + 1;
-                c->oacklen += oacktsize.len() + 1;
-            }
+    if (blkoffset >= 0)
+    {
+        if (!set_blkoffset(c, blkoffset))
+            return false;
+        oack_append(c->oack, tftp_option_name(TFTP_OPT_BLKOFFSET),
+                    WvString(c->blkoffset));
+
+        // A group is sent the file from wherever its master is, so the
+        // two don't mix.
+        want_mcast = false;
+    }
+
+    // Last, so that mcast_promote() knows where to find the "mc" flag.
+    if (want_mcast)
+        mcast_join(c);
+
+    if (c->oack->len)
+        c->send_oack = true;
+    else
+    {
+        c->oack->release();
+        c->oack = NULL;
+    }
+    return true;
+}
+
+
+bool WvTFTPServer::set_blkoffset(TFTPConn *c, long long blkoffset)
+{
+    off_t start = (off_t)blkoffset * c->blksize;
+    if (c->direction == tftpread)
+    {
+        // Having the whole file except its (empty) last block is fine.
+        if (start > c->filesize)
+        {
+            WvString message("Blkoffset %s is past the end of the file.",
+                             blkoffset);
+            log(WvLog::Warning, "%s\n", message);
+            send_err(8, message);
+            return false;
         }
-        if (c->oacklen)
-            c->send_oack = true;
-        else
-            delete c->oack;
+        if (c->tftpfile && !c->inflated)
+            fseeko(c->tftpfile, start, SEEK_SET);
+    }
+    else
+    {
+        // Only ever appended to: a partial upload must be exactly the
+        // blocks the client says it sent.
+        if (start != c->filesize)
+        {
+            WvString message("Partial upload is %s bytes, not %s blocks.",
+                             c->filesize, blkoffset);
+            log(WvLog::Warning, "%s\n", message);
+            send_err(8, message);
+            return false;
+        }
+        fseeko(c->tftpfile, start, SEEK_SET);
+    }
+
+    c->blkoffset = blkoffset;
+    if (blkoffset)
+        log(WvLog::Info, "Resuming after block %s.\n", blkoffset);
+    return true;
+}
+
+
+void WvTFTPServer::mcast_join(TFTPConn *c)
+{
+    WvString group = cfg["TFTP/Multicast Group"].getme("");
+    if (!group)
+    {
+        log(WvLog::Debug, "Multicast not configured; sending by unicast.\n");
+        return;
+    }
+
+    if (!c->tftpfile)
+    {
+        log(WvLog::Debug, "Only plain files are multicast; sending by "
+            "unicast.\n");
+        return;
+    }
+
+    int fd = fileno(c->tftpfile);
+    TFTPMcastSession *s = TFTPMcastSession::find(mcast_sessions, fd,
+                                                 c->blksize);
+    bool master = !s;
+    if (!s)
+    {
+        // Each session needs a port of its own, so that clients only hear
+        // the file they asked for.
+        int first = cfg["TFTP/Multicast Port"].getmeint(1758);
+        int nports = cfg["TFTP/Multicast Sessions"].getmeint(16);
+        int port;
+        for (port = first; port < first + nports; port++)
+        {
+            TFTPMcastSession *t;
+            for (t = mcast_sessions; t; t = t->next)
+                if (t->group.port == port)
+                    break;
+            if (!t)
+                break;
+        }
+        if (port == first + nports)
+        {
+            log(WvLog::Info, "All multicast ports in use; sending by "
+                "unicast.\n");
+            return;
+        }
+
+        s = TFTPMcastSession::create(mcast_sessions, fd, c->blksize,
+                                     WvIPPortAddr(WvIPAddr(group), port));
+        if (!s)
+            return;
+
+        int ttl = cfg["TFTP/Multicast TTL"].getmeint(1);
+        setsockopt(getwfd(), IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        WvString iface = cfg["TFTP/Multicast Interface"].getme("");
+        struct in_addr ifaddr;
+        if (!!iface && inet_aton(iface, &ifaddr))
+            setsockopt(getwfd(), IPPROTO_IP, IP_MULTICAST_IF, &ifaddr,
+                       sizeof(ifaddr));
+    }
+
+    WvString value("%s,%s,%s", static_cast<WvIPAddr>(s->group),
+                   s->group.port, master ? 1 : 0);
+    if (!oack_append(c->oack, tftp_option_name(TFTP_OPT_MULTICAST), value))
+    {
+        s->release();
+        return;
     }
 
-    return p;
+    log(WvLog::Debug, "Multicast option enabled (%s, %s).\n", value,
+        master ? "master" : "passive");
+    c->mcast = s;
+    if (master)
+    {
+        s->master = c->remote;
+        c->data_to = &s->group;
+    }
+    else
+        c->passive = true;
+}
+
+
+void WvTFTPServer::mcast_check()
+{
+    for (TFTPMcastSession *s = mcast_sessions; s; s = s->next)
+    {
+        TFTPConn *m = conns[s->master];
+        if (!m || m->mcast != s)
+            mcast_promote(s);
+    }
+}
+
+
+void WvTFTPServer::mcast_promote(TFTPMcastSession *s)
+{
+    TFTPConn *best = NULL;
+    TFTPConnDict::Iter i(conns);
+    for (i.rewind(); i.next(); )
+    {
+        if (i->mcast == s && i->passive
+            && (!best || timercmp(&i->start_time, &best->start_time, <)))
+            best = &i();
+    }
+    if (!best)
+        return;
+
+    log(WvLog::Info, "%s is now the multicast master for '%s'.\n",
+        best->remote, best->filename);
+    s->master = best->remote;
+    best->passive = false;
+    // Once the group has had every block, whatever a client still lacks
+    // is repaired by unicast, to it alone.
+    best->data_to = s->pass_done ? NULL : &s->group;
+
+    // The option was appended last, so its value ends in the "mc" flag.
+    best->oack->data[best->oack->len - 2] = '1';
+    best->send_oack = true;
+    send_pkt(best->remote, best->oack);
+    tftp_trace.add(TRACE_OACK, best->remote, 0);
+
+    struct timeval tv = now();
+    best->pkttimes->set(1, tv);
+    best->last_received = tv;
+    s->active = tv;
+}
+
+
+void WvTFTPServer::transfer_done(TFTPConn *c)
+{
+    WvTFTPBase::transfer_done(c);
+    if (c->mcast && c->data_to)
+        c->mcast->pass_done = true;
 }
@@ -23,21 +23,72 @@
 #define __WVTFTPSERVER_H
 
 #include "wvtftpbase.h"
+#include "wvtftpparse.h"
+#include "wvtftparchive.h"
+#include "wvtftppreload.h"
+#include "wvtftpsequence.h"
 #include "uniconf.h"
 
 class WvTFTPServer : public WvTFTPBase
 {
 public:
-    WvTFTPServer(UniConf &_cfg, int _tftp_tick);
+    /** With an 'inherit_fd', serves from that socket (passed on by the
+     * process we are upgrading from) instead of binding [TFTP] "Port".
+     */
+    WvTFTPServer(UniConf &_cfg, int _tftp_tick, int inherit_fd = -1);
     void add_dir(WvString dir);
     void rm_dir(WvString dir);
     virtual ~WvTFTPServer();
 
-private:
-    UniConf &cfg;
-    virtual void execute();
-    virtual void new_connection();
+    /** Appends one line per active transfer to 'out': peer, direction,
+     * filename, blksize, window, unack/lastsent, current timeout,
+     * retransmits and bytes/s.
+     */
+    void list_conns(WvString &out);
+
+    /** Aborts the transfer to 'remote'.  Returns false if there is none. */
+    bool abort_conn(const WvIPPortAddr &remote);
+
+    /** Changes the window (prefetch) of the transfer to 'remote'.  It can't
+     * grow past the window the transfer started with.  Returns the window
+     * actually set, or 0 if there is no such transfer.
+     */
+    int set_window(const WvIPPortAddr &remote, int window);
+
+    /** Rereads what is only read at startup, after 'cfg' has changed.
+     * Transfers in progress keep the file, blksize and window they started
+     * with.  The timeout and retry settings are read as they are used, so
+     * those apply to them straight away.
+     */
+    void reload();
+
+    /** Writes what it takes to carry on every transfer in progress to
+     * 'fd', for resume_transfers() in another process, and commits 'cfg'
+     * for it to read.  Returns how many were written.
+     */
+    int save_transfers(int fd);
+
+    /** Carries on the transfers save_transfers() wrote to 'fd'.  Returns
+     * how many could be.
+     */
+    int resume_transfers(int fd);
+
+    // All servers in the process, for the control socket.
+    static WvTFTPServer *first_server()
+        { return servers; }
+    WvTFTPServer *next_server() const
+        { return next; }
+
+protected:
+    /** Handles the datagram in 'packet' (of 'packetsize' bytes), which came
+     * from 'remaddr'.
+     */
+    void process_packet();
+
+    /** Retransmits or aborts every transfer whose timer has run out. */
     void check_timeouts();
+
+    virtual void new_connection();
     int validate_access(TFTPConn *c);
     WvString check_aliases(TFTPConn *c);
 
@@ -47,12 +98,141 @@ private:
      */
     bool check_filename(TFTPConn *c);
 
-    /** Finds and processes TFTP options.
-     * Sets TFTPConn options and sends option ACKs.
-     * Returns the packet index of the byte following the last option
-     * value.
+    /** Opens c->filename for reading, wherever it is: in the archive, a
+     * file of its own, or gzipped.  Sets c->filesize.
+     */
+    bool open_read(TFTPConn *c);
+
+    /** Sets up 'c' to read what c->filename + ".gz" uncompresses to.
+     * Returns false if there's no such file, it isn't gzip, or [TFTP]
+     * "Decompress" is off.
+     */
+    bool open_compressed(TFTPConn *c);
+
+    /** Sends the first reply to the request that created 'c' (an OACK,
+     * the first window of DATA, or ACK 0), starting the transfer.
+     */
+    void start_transfer(TFTPConn *c);
+
+    /** Sets up what a transfer needs besides its file: its queue in the
+     * scheduler, and any mapping or shared blocks to read from.
+     */
+    void setup_transfer(TFTPConn *c);
+
+    /** Rebuilds a transfer from one line written by save_transfers().
+     * Returns NULL if it can't be carried on.
+     */
+    TFTPConn *resume_conn(const char *line);
+
+    /** Returns true if starting 'c' now stays within [TFTP] "Max Active"
+     * transfers and "Max Inflight KB" of outstanding window.
+     */
+    bool can_admit(TFTPConn *c);
+
+    /** Starts queued reads, small files first and then in arrival order,
+     * for as long as can_admit() allows.
+     */
+    void admit_queued();
+
+    /** Returns the scheduler weight of 'c': the weight of the most specific
+     * [TFTP/Subnet Weights] entry containing the client, times the largest
+     * [TFTP/File Weights] pattern matching the file.  Both default to 1.
+     */
+    int flow_weight(TFTPConn *c);
+
+    /** Processes the options of 'req', setting them in 'c' and building
+     * c->oack if any of them need acknowledging.  Sends an error and
+     * returns false if an option's value is unacceptable.
+     */
+    bool process_options(TFTPConn *c, const TFTPRequest &req);
+
+    /** Starts 'c' after the first 'blkoffset' blocks, which the client
+     * already has (or, for a write, we already have).  Sends an error and
+     * returns false if the file doesn't agree.
+     */
+    bool set_blkoffset(TFTPConn *c, long long blkoffset);
+
+    /** Puts the read 'c' into the multicast session for its file, starting
+     * one (with 'c' as master) if there is none, and appends the RFC 2090
+     * "multicast" option to c->oack.  Leaves 'c' alone, so it stays unicast,
+     * if [TFTP] "Multicast Group" isn't set or every port is taken.
+     */
+    void mcast_join(TFTPConn *c);
+
+    /** Gives every multicast session whose master has gone a new one. */
+    void mcast_check();
+
+    /** Makes the longest-waiting passive member of 's' its master and sends
+     * it a new OACK saying so.
+     */
+    void mcast_promote(TFTPMcastSession *s);
+
+    virtual void transfer_done(TFTPConn *c);
+
+private:
+    UniConf &cfg;
+    static WvTFTPServer *servers;
+    WvTFTPServer *next;
+    int nqueued;                // connections with 'queued' set
+    TFTPMcastSession *mcast_sessions;
+    TFTPArchive *archive;       // if "Base dir" is an archive
+    struct timeval archive_checked;
+    TFTPPreload *preload;       // [TFTP/Preload], until it's done
+    bool preload_reported;
+    TFTPSequence *sequence;     // if "Learn Sequence KB" is set
+    WvString last_prefetch;     // so a boot storm reads ahead once
+    time_t last_prefetch_time;
+
+    virtual void execute();
+
+    /** If the request in 'packet' is byte for byte the one that started
+     * 'c', and the client hasn't acknowledged anything past our reply to it,
+     * repeats that reply (the OACK, the first window or ACK 0) and returns
+     * true.  The client evidently lost it; there's no need to start over.
+     */
+    bool resend_first_reply(TFTPConn *c);
+
+    /** Returns the value of the most specific subnet in the config section
+     * 'sect' (keys like "10.1.0.0/16") that contains 'remote', or 'def'.
+     */
+    int subnet_value(WvStringParm sect, const WvIPPortAddr &remote, int def);
+
+    /** Returns the largest blksize that reaches 'c' without fragmenting:
+     * from its [TFTP/Subnet MTU] entry if it has one, otherwise from the
+     * MTU of the route the kernel would use.
+     */
+    size_t max_blksize(TFTPConn *c);
+
+    /** Loads the archive if [TFTP] "Base dir" names one, or a new one if
+     * it's been replaced, looking at most once a second.
+     */
+    void update_archive();
+
+    /** Maps the files matching the patterns in [TFTP/Preload] and starts
+     * reading them in.
+     */
+    void start_preload();
+
+    /** Updates the preload's stats, and logs once it has finished. */
+    void check_preload();
+
+    /** Learns from the read 'c' what its client's class asks for after
+     * what, and reads ahead the file it will probably want next.
+     */
+    void learn_sequence(TFTPConn *c);
+
+    /** Returns the archive member 'filename' is, or NULL if it isn't one
+     * (or there's no such member).
+     */
+    const TFTPArchive::Member *archive_member(const char *filename);
+
+    /** Returns the retransmission timeout of 'c' right now, in ms. */
+    time_t current_timeout(TFTPConn *c);
+
+    /** Starts recording the packets of 'c' if [TFTP] "Capture Dir" is set.
+     * The request in 'packet' is the first one recorded.
      */
-    unsigned int process_options(TFTPConn *c, unsigned int opts_start);
+    void start_capture(TFTPConn *c);
 
     /** Checks for old WvConf-style cfg and converts to new UniConf style.
      * Returns true if an update was actually performed.
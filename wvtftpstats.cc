@@ -0,0 +1,173 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpstats.h"
+#include <string.h>
+
+static const uint64_t rtt_bounds[] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+static const uint64_t completion_bounds[] = {
+    10, 50, 100, 500, 1000, 2000, 5000, 10000, 30000, 60000, 300000, 600000
+};
+static const uint64_t window_bounds[] = {
+    1, 2, 4, 8, 16, 32, 64
+};
+
+#define NBOUNDS(x) (int)(sizeof(x) / sizeof(x[0]))
+
+
+TFTPHistogram::TFTPHistogram(const uint64_t *_bounds, int _nbounds)
+{
+    bounds = _bounds;
+    nbounds = _nbounds;
+    counts = new uint64_t[nbounds + 1];
+    clear();
+}
+
+
+TFTPHistogram::~TFTPHistogram()
+{
+    delete[] counts;
+}
+
+
+void TFTPHistogram::clear()
+{
+    memset(counts, 0, (nbounds + 1) * sizeof(uint64_t));
+    sum = count = 0;
+}
+
+
+void TFTPHistogram::add(uint64_t value)
+{
+    int i;
+    for (i = 0; i < nbounds; i++)
+        if (value <= bounds[i])
+            break;
+    counts[i]++;
+    sum += value;
+    count++;
+}
+
+
+void TFTPHistogram::merge(const TFTPHistogram &h)
+{
+    for (int i = 0; i <= nbounds; i++)
+        counts[i] += h.counts[i];
+    sum += h.sum;
+    count += h.count;
+}
+
+
+TFTPStats *TFTPStats::all = NULL;
+
+
+TFTPStats::TFTPStats(bool reg)
+    : rtt(rtt_bounds, NBOUNDS(rtt_bounds)),
+      completion(completion_bounds, NBOUNDS(completion_bounds)),
+      window(window_bounds, NBOUNDS(window_bounds))
+{
+    clear();
+    registered = reg;
+    prev = NULL;
+    next = NULL;
+    if (registered)
+    {
+        next = all;
+        if (all)
+            all->prev = this;
+        all = this;
+    }
+}
+
+
+TFTPStats::~TFTPStats()
+{
+    if (!registered)
+        return;
+    if (prev)
+        prev->next = next;
+    else
+        all = next;
+    if (next)
+        next->prev = prev;
+}
+
+
+void TFTPStats::clear()
+{
+    memset(started, 0, sizeof(started));
+    memset(completed, 0, sizeof(completed));
+    memset(aborted, 0, sizeof(aborted));
+    rejected = bytes_sent = bytes_received = retransmits = timeouts = 0;
+    duplicate_requests = shared_blocks = shared_misses = 0;
+    mapped_blocks = inflated_blocks = 0;
+    active = queued = backlog = 0;
+    preload_pending = preloaded_bytes = preload_ms = 0;
+    prefetches = prefetch_hits = prefetch_misses = sequence_bytes = 0;
+    rtt.clear();
+    completion.clear();
+    window.clear();
+}
+
+
+void TFTPStats::merge(const TFTPStats &s)
+{
+    for (int i = 0; i < NUM_DIRECTIONS; i++)
+    {
+        started[i] += s.started[i];
+        completed[i] += s.completed[i];
+    }
+    for (int i = 0; i < NUM_ABORT_REASONS; i++)
+        aborted[i] += s.aborted[i];
+    rejected += s.rejected;
+    duplicate_requests += s.duplicate_requests;
+    bytes_sent += s.bytes_sent;
+    bytes_received += s.bytes_received;
+    retransmits += s.retransmits;
+    shared_blocks += s.shared_blocks;
+    shared_misses += s.shared_misses;
+    mapped_blocks += s.mapped_blocks;
+    inflated_blocks += s.inflated_blocks;
+    timeouts += s.timeouts;
+    active += s.active;
+    queued += s.queued;
+    backlog += s.backlog;
+    preload_pending += s.preload_pending;
+    preloaded_bytes += s.preloaded_bytes;
+    if (s.preload_ms > preload_ms)
+        preload_ms = s.preload_ms;
+    prefetches += s.prefetches;
+    prefetch_hits += s.prefetch_hits;
+    prefetch_misses += s.prefetch_misses;
+    sequence_bytes += s.sequence_bytes;
+    rtt.merge(s.rtt);
+    completion.merge(s.completion);
+    window.merge(s.window);
+}
+
+
+void TFTPStats::collect(TFTPStats &total)
+{
+    total.clear();
+    for (TFTPStats *s = all; s; s = s->next)
+        if (s != &total)
+            total.merge(*s);
+}
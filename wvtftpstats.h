@@ -0,0 +1,113 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPStats, the counters and histograms each WvTFTPBase keeps about its
+ * transfers.  They are exported in Prometheus text format by
+ * TFTPMetrics (see wvtftpmetrics.h).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPSTATS_H
+#define __WVTFTPSTATS_H
+
+#include <stdint.h>
+
+class TFTPHistogram
+{
+public:
+    // 'bounds' are the upper bounds of each bucket, in increasing order.
+    TFTPHistogram(const uint64_t *_bounds, int _nbounds);
+    ~TFTPHistogram();
+
+    void add(uint64_t value);
+    void merge(const TFTPHistogram &h);
+    void clear();
+
+    const uint64_t *bounds;
+    int nbounds;
+    uint64_t *counts;           // per bucket, plus one for +Inf
+    uint64_t sum;
+    uint64_t count;
+};
+
+
+/** Statistics for one server (worker).
+ * Each worker only ever touches its own TFTPStats from its own packet loop,
+ * so the counters are plain integers: no locks or atomic operations on the
+ * packet path.  Every TFTPStats registers itself in a global list, and a
+ * scrape adds them all up (see collect()).
+ */
+class TFTPStats
+{
+public:
+    enum Direction { READ = 0, WRITE, NUM_DIRECTIONS };
+    enum AbortReason {
+        ABORT_ERROR_PACKET = 0,     // the client sent us an ERROR
+        ABORT_PROTOCOL,             // unexpected opcode
+        ABORT_TIMEOUTS,             // "Max Timeout Count" reached
+        ABORT_IDLE,                 // "Total Timeout Seconds" elapsed
+        ABORT_RESTARTED,            // client sent a new request instead
+        ABORT_ADMIN,                // "abort" on the control socket
+        ABORT_READ_ERROR,           // the file (or .gz) couldn't be read
+        NUM_ABORT_REASONS
+    };
+
+    // Unregistered stats (reg == false) are left out of collect().
+    TFTPStats(bool reg = true);
+    ~TFTPStats();
+
+    uint64_t started[NUM_DIRECTIONS];
+    uint64_t completed[NUM_DIRECTIONS];
+    uint64_t aborted[NUM_ABORT_REASONS];
+    uint64_t rejected;          // requests refused before starting
+    uint64_t duplicate_requests; // resent requests answered in place
+    uint64_t bytes_sent;        // DATA payload, including retransmits
+    uint64_t bytes_received;
+    uint64_t retransmits;       // DATA packets resent after a timeout
+    uint64_t shared_blocks;     // DATA read by another transfer first
+    uint64_t shared_misses;     // DATA a shared reader had to read itself
+    uint64_t mapped_blocks;     // DATA sent straight from a mapped file
+    uint64_t inflated_blocks;   // DATA decompressed from a .gz file
+    uint64_t timeouts;
+    uint64_t prefetches;        // files read ahead on a learned guess
+    uint64_t prefetch_hits;     // requests for the file we guessed
+    uint64_t prefetch_misses;   // requests for something else
+    uint64_t active;            // gauge: connections right now
+    uint64_t queued;            // gauge: requests waiting to start
+    uint64_t backlog;           // gauge: bytes waiting in the scheduler
+    uint64_t preload_pending;   // gauge: files the preload has yet to read
+    uint64_t preloaded_bytes;   // gauge: bytes the preload has read so far
+    uint64_t preload_ms;        // how long the preload took, once done
+    uint64_t sequence_bytes;    // gauge: memory the learned order takes
+
+    TFTPHistogram rtt;          // per ACK, in ms
+    TFTPHistogram completion;   // per completed transfer, in ms
+    TFTPHistogram window;       // window size at the end of each transfer
+
+    void clear();
+    void merge(const TFTPStats &s);
+
+    /** Adds up the stats of every registered TFTPStats into 'total'. */
+    static void collect(TFTPStats &total);
+
+private:
+    TFTPStats *next, *prev;
+    static TFTPStats *all;
+    bool registered;
+};
+
+#endif // __WVTFTPSTATS_H
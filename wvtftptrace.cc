@@ -0,0 +1,140 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftptrace.h"
+#include "wvaddr.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+TFTPTrace tftp_trace;
+
+
+TFTPTrace::TFTPTrace()
+{
+    memset(recs, 0, sizeof(recs));
+    head = 0;
+    set_path("/var/lib/wvtftpd/wvtftpd.trace");
+}
+
+
+void TFTPTrace::set_path(const char *_path)
+{
+    strncpy(path, _path, sizeof(path) - 1);
+    path[sizeof(path) - 1] = 0;
+}
+
+
+void TFTPTrace::add(TFTPTraceEvent type, const WvIPPortAddr &peer,
+                    uint32_t block, uint32_t arg)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    TFTPTraceRecord &r = recs[head & (SIZE - 1)];
+    r.usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    memcpy(&r.addr, peer.rawdata(), sizeof(r.addr));
+    r.port = peer.port;
+    r.type = type;
+    r.pad = 0;
+    r.block = block;
+    r.arg = arg;
+    head = head + 1;
+}
+
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+// Opens a new file next to 'path' for dump() to write before renaming it
+// into place, putting its name in 'tmp'.  mkstemp() isn't async-signal-safe,
+// so this makes its own names; O_EXCL means a planted file or symlink is
+// never written through, just skipped.
+static int open_temp(const char *path, char *tmp, size_t size)
+{
+    size_t len = strlen(path);
+    if (len + 16 > size)
+        return -1;
+
+    unsigned long pid = getpid();
+    for (unsigned int attempt = 0; attempt < 100; attempt++)
+    {
+        memcpy(tmp, path, len);
+        char *p = tmp + len;
+        *p++ = '.';
+        unsigned long n = pid * 100 + attempt;
+        char digits[24];
+        int nd = 0;
+        do {
+            digits[nd++] = '0' + n % 10;
+            n /= 10;
+        } while (n);
+        while (nd)
+            *p++ = digits[--nd];
+        *p = 0;
+
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+        if (fd >= 0 || errno != EEXIST)
+            return fd;
+    }
+    return -1;
+}
+
+
+bool TFTPTrace::dump() const
+{
+    TFTPTraceHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TFTP_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TFTP_TRACE_VERSION;
+    hdr.recsize = sizeof(TFTPTraceRecord);
+    hdr.nrecs = SIZE;
+    hdr.head = head;
+
+    // Never open 'path' itself: a remote client can make us dump, and
+    // whatever is sitting there (a symlink to /etc/shadow, say) would be
+    // truncated.  rename() replaces a symlink rather than following it.
+    char tmp[sizeof(path) + 16];
+    int fd = open_temp(path, tmp, sizeof(tmp));
+    if (fd < 0)
+        return false;
+    bool ok = write_all(fd, &hdr, sizeof(hdr))
+        && write_all(fd, recs, sizeof(recs));
+    close(fd);
+    if (ok)
+        ok = rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    return ok;
+}
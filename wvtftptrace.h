@@ -0,0 +1,108 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPTrace, an always-on ring of binary protocol events.  Recording an
+ * event is a handful of stores, so it can stay enabled in production; the
+ * ring is written out on SIGUSR2 or when a transfer dies, and decoded
+ * offline with wvtftpdecode.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPTRACE_H
+#define __WVTFTPTRACE_H
+
+#include <stdint.h>
+
+class WvIPPortAddr;
+
+enum TFTPTraceEvent
+{
+    TRACE_RRQ = 1,      // arg = blksize
+    TRACE_WRQ,          // arg = blksize
+    TRACE_OACK,
+    TRACE_DATA,         // arg = payload length
+    TRACE_RESEND,       // arg = payload length
+    TRACE_ACK,          // arg = rtt in ms, if measured
+    TRACE_TIMEOUT,      // arg = timeout in ms
+    TRACE_WINDOW,       // arg = new window (prefetch) size
+    TRACE_DONE,
+    TRACE_ABORT,        // arg = TFTP error code sent, if any
+    TRACE_MAX
+};
+
+// One event.  The layout is also the on-disk format, so only append.
+struct TFTPTraceRecord
+{
+    uint64_t usec;      // CLOCK_MONOTONIC, in microseconds
+    uint32_t addr;      // peer IPv4 address, network byte order
+    uint16_t port;      // peer port
+    uint8_t type;       // TFTPTraceEvent
+    uint8_t pad;
+    uint32_t block;
+    uint32_t arg;
+};
+
+// Start of a dump file; followed by 'nrecs' TFTPTraceRecords.
+struct TFTPTraceHeader
+{
+    char magic[8];      // TFTP_TRACE_MAGIC
+    uint32_t version;
+    uint32_t recsize;   // sizeof(TFTPTraceRecord) of the writer
+    uint32_t nrecs;     // ring size
+    uint32_t head;      // total number of events recorded so far
+};
+
+#define TFTP_TRACE_MAGIC "WVTFTPTR"
+#define TFTP_TRACE_VERSION 1
+
+
+class TFTPTrace
+{
+public:
+    // Number of records kept; must be a power of two.
+    static const uint32_t SIZE = 8192;
+
+    TFTPTrace();
+
+    void add(TFTPTraceEvent type, const WvIPPortAddr &peer, uint32_t block,
+             uint32_t arg = 0);
+
+    /** Sets the file dump() writes to. */
+    void set_path(const char *_path);
+
+    /** Writes the ring to the dump file, by way of a new file in the same
+     * directory that is renamed over it.  Only async-signal-safe calls are
+     * used, so this may be called straight from a signal handler.
+     * Returns false if the file couldn't be written.
+     */
+    bool dump() const;
+
+    const char *getpath() const
+        { return path; }
+
+private:
+    TFTPTraceRecord recs[SIZE];
+    // Only the packet loop ever writes, so this needs no locking; a dump
+    // from a signal handler at worst sees one half-written record.
+    volatile uint32_t head;
+    char path[256];
+};
+
+// The ring shared by every server in the process.
+extern TFTPTrace tftp_trace;
+
+#endif // __WVTFTPTRACE_H
@@ -0,0 +1,224 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "wvtftpwarm.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = "WVTFTPW";
+
+// Opens 'dir', creating it if it isn't there, if it is a directory of our
+// own that nobody else can get into.  Anyone who could write to it could
+// plant links for us to write through, or have us delete their files.
+static int open_dir(const char *dir)
+{
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    int dfd = ::open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (dfd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(dfd, &st) < 0 || !S_ISDIR(st.st_mode)
+        || st.st_uid != geteuid() || (st.st_mode & 0777) != 0700)
+    {
+        close(dfd);
+        return -1;
+    }
+    return dfd;
+}
+
+
+// Bytes of memory the files in 'dfd' take.
+static off_t dir_usage(int dfd)
+{
+    off_t total = 0;
+    DIR *d = fdopendir(dup(dfd));
+    if (!d)
+        return 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+    {
+        struct stat st;
+        if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+            && S_ISREG(st.st_mode))
+            total += (off_t)st.st_blocks * 512;
+    }
+    closedir(d);
+    return total;
+}
+
+
+// Removes the copies in 'dfd' of other versions of a file, whose names
+// start with 'prefix'.
+static void remove_stale(int dfd, const char *prefix)
+{
+    DIR *d = fdopendir(dup(dfd));
+    if (!d)
+        return;
+    size_t len = strlen(prefix);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+        if (!strncmp(e->d_name, prefix, len))
+            unlinkat(dirfd(d), e->d_name, 0);
+    closedir(d);
+}
+
+
+TFTPWarmFile *TFTPWarmFile::open(const char *dir, const struct stat &src,
+                                 off_t size, size_t chunk, off_t limit)
+{
+    if (!dir || !*dir || size <= 0 || limit <= 0)
+        return NULL;
+
+    off_t nchunks = (size + chunk - 1) / chunk;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t dataoff = (sizeof(Header) + nchunks + pagesize - 1) / pagesize
+        * pagesize;
+    off_t maplen = dataoff + size;
+    if ((off_t)(size_t)maplen != maplen)
+        return NULL;
+
+    char prefix[64], name[128];
+    snprintf(prefix, sizeof(prefix), "%llx-%llx-",
+             (unsigned long long)src.st_dev, (unsigned long long)src.st_ino);
+    snprintf(name, sizeof(name), "%s%llx-%llx.v%d", prefix,
+             (unsigned long long)src.st_size, (long long)src.st_mtime,
+             (int)VERSION);
+
+    int dfd = open_dir(dir);
+    if (dfd < 0)
+        return NULL;
+    int fd = openat(dfd, name, O_RDWR | O_NOFOLLOW);
+    if (fd < 0 && errno == ENOENT)
+    {
+        remove_stale(dfd, prefix);
+        if (dir_usage(dfd) + maplen > limit)
+        {
+            close(dfd);
+            return NULL;
+        }
+
+        // Set up under another name, so nobody attaches to half a header.
+        // The memory is all reserved now: running out of it while writing
+        // through the mapping would be SIGBUS.
+        char tmp[sizeof(name) + 16];
+        snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+        fd = openat(dfd, tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+        if (fd < 0)
+        {
+            close(dfd);
+            return NULL;
+        }
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MAGIC, sizeof(h.magic));
+        h.version = VERSION;
+        h.chunk = chunk;
+        h.dev = src.st_dev;
+        h.ino = src.st_ino;
+        h.srcsize = src.st_size;
+        h.mtime = src.st_mtime;
+        h.size = size;
+        h.nchunks = nchunks;
+        if (posix_fallocate(fd, 0, maplen) != 0
+            || pwrite(fd, &h, sizeof(h), 0) != sizeof(h)
+            || renameat(dfd, tmp, dfd, name) < 0)
+        {
+            close(fd);
+            unlinkat(dfd, tmp, 0);
+            close(dfd);
+            return NULL;
+        }
+    }
+    if (fd < 0)
+    {
+        close(dfd);
+        return NULL;
+    }
+
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && st.st_uid == geteuid() && st.st_size >= maplen)
+        base = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    Header *h = (Header *)base;
+    if (base == MAP_FAILED || memcmp(h->magic, MAGIC, sizeof(h->magic))
+        || h->version != VERSION || h->chunk != chunk
+        || h->dev != (uint64_t)src.st_dev || h->ino != (uint64_t)src.st_ino
+        || h->srcsize != (uint64_t)src.st_size || h->mtime != src.st_mtime
+        || h->size != (uint64_t)size || h->nchunks != (uint64_t)nchunks)
+    {
+        // Not ours, or from a daemon that disagrees about the layout: the
+        // next one to want it can start again.
+        if (base != MAP_FAILED)
+            munmap(base, maplen);
+        unlinkat(dfd, name, 0);
+        close(dfd);
+        return NULL;
+    }
+    close(dfd);
+
+    TFTPWarmFile *w = new TFTPWarmFile;
+    w->base = (unsigned char *)base;
+    w->maplen = maplen;
+    w->hdr = h;
+    w->present = w->base + sizeof(Header);
+    w->data = w->base + dataoff;
+    w->chunk = chunk;
+    w->size = size;
+    w->nchunks = nchunks;
+    return w;
+}
+
+
+TFTPWarmFile::~TFTPWarmFile()
+{
+    munmap(base, maplen);
+}
+
+
+const unsigned char *TFTPWarmFile::get(off_t n) const
+{
+    if (n < 0 || n >= nchunks
+        || !__atomic_load_n(&present[n], __ATOMIC_ACQUIRE))
+        return NULL;
+    return data + n * chunk;
+}
+
+
+void TFTPWarmFile::put(off_t n, const unsigned char *buf, size_t len)
+{
+    if (n < 0 || n >= nchunks)
+        return;
+    off_t want = size - n * (off_t)chunk;
+    if (len != (want < (off_t)chunk ? (size_t)want : chunk))
+        return;
+
+    // Another process may be reading it; the data goes in before the flag
+    // says it's there.
+    memcpy(data + n * chunk, buf, len);
+    __atomic_store_n(&present[n], 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,87 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2004 Net Integration Technologies, Inc.
+ *
+ * TFTPWarmFile, the decompressed output of a gzipped file kept in shared
+ * memory (a file on a tmpfs like /run, say) a chunk at a time as it is made.
+ * Unlike everything else we cache, it outlives the process: a daemon that
+ * reloads its configuration or is restarted or upgraded attaches to what
+ * the last one left, and doesn't have to decompress it all over again.
+ * Plain files need none of this; their pages are in the page cache
+ * whoever reads them.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __WVTFTPWARM_H
+#define __WVTFTPWARM_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+class TFTPWarmFile
+{
+public:
+    enum { VERSION = 1 };
+
+    /** Attaches to the copy in 'dir' of the output of the file 'src', which
+     * is 'size' bytes cached in chunks of 'chunk', or creates it, throwing
+     * away any left from other versions of 'src'.  A copy is only created
+     * if everything in 'dir' would still fit in 'limit' bytes.  'dir' is
+     * created if need be, and must belong to us with mode 0700.  Returns
+     * NULL if there's no copy and can't be one.
+     */
+    static TFTPWarmFile *open(const char *dir, const struct stat &src,
+                              off_t size, size_t chunk, off_t limit);
+    ~TFTPWarmFile();
+
+    /** Returns chunk 'n' if some process has stored it, or NULL. */
+    const unsigned char *get(off_t n) const;
+
+    /** Stores 'len' bytes as chunk 'n'.  'len' must be the whole chunk:
+     * 'chunk', or what's left of 'size' for the last one.
+     */
+    void put(off_t n, const unsigned char *data, size_t len);
+
+private:
+    // The start of the file; a version, size or source that doesn't
+    // match means it's for something else.
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t chunk;
+        uint64_t dev, ino, srcsize;
+        int64_t mtime;
+        uint64_t size;
+        uint64_t nchunks;
+        // Then one byte per chunk, nonzero once it's there, and the data
+        // from the next page boundary.
+    };
+
+    TFTPWarmFile() { }
+
+    unsigned char *base;
+    size_t maplen;
+    Header *hdr;
+    unsigned char *present;
+    unsigned char *data;
+    size_t chunk;
+    off_t size;
+    off_t nchunks;
+};
+
+#endif // __WVTFTPWARM_H